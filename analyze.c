@@ -0,0 +1,570 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Streaming trace analyzer.
+ *
+ * Reads a trace written by the daemon once and reports, per op:
+ *  - the working set size (distinct 4 KiB blocks) of every window,
+ *  - an LRU reuse distance histogram and the miss-ratio curve derived from it,
+ *  - a heatmap of accesses over LBA range and time.
+ *
+ * The trace is mmap()ed and every worker thread walks all record headers,
+ * but only accounts blocks whose LBA hashes into its partition.  Partitions
+ * are disjoint spatial samples, so each worker keeps an independent LRU
+ * stack and their scaled reuse distances are merged at the end.  On top of
+ * that, SHARDS-style sampling (-s) only tracks blocks whose hash falls under
+ * the sampling rate, shrinking the stacks further.
+ *
+ * Reuse distances are computed exactly within a sample with a Fenwick tree
+ * over access times, which is renumbered when it fills up.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "cheeze.h"
+
+#define TRACE_TARGET "/trace"
+
+#define BLK_SHIFT 12
+#define OP_READ 0
+#define OP_WRITE 1
+#define OP_DISCARD 2
+#define NR_OPS 3
+#define OP_ALL NR_OPS	// index of the all-ops column
+#define NR_BUCKETS 48	// log2 reuse distance buckets
+
+static const char *op_names[NR_OPS + 1] = { "read", "write", "discard", "all" };
+
+struct entry {
+	uint64_t key;		// lba + 1, 0 if empty
+	uint64_t last;		// last access time, 0 if only discarded
+	uint32_t window[NR_OPS + 1];
+};
+
+struct worker {
+	pthread_t thread;
+	int idx;
+
+	/* lba -> entry, open addressing */
+	struct entry *table;
+	uint64_t table_cap, table_cnt;
+
+	/* Fenwick tree over access times 1..fen_cap */
+	int32_t *fen;
+	uint64_t fen_cap;
+	uint64_t now;
+
+	/* Results */
+	uint64_t hist[NR_OPS + 1][NR_BUCKETS];
+	uint64_t cold[NR_OPS + 1];
+	uint64_t sampled[NR_OPS + 1];
+	uint64_t *ws[NR_OPS + 1];	// per window
+	uint64_t *heat;			// heat_rows x nr_windows
+	uint64_t heat_rows;
+	uint64_t nr_windows;
+};
+
+/* Options */
+static int nr_workers = 1;
+static double sample_rate = 1.0;
+static uint64_t window_records = 100000;
+static uint64_t heat_gran_mib = 1024;
+
+/* Trace */
+static const char *trace;
+static size_t trace_len;
+static uint64_t sample_threshold;
+
+static inline uint64_t hash64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static inline int log2_bucket(uint64_t v)
+{
+	int b = v ? 64 - __builtin_clzll(v) : 0;
+
+	return b < NR_BUCKETS ? b : NR_BUCKETS - 1;
+}
+
+static void *xcalloc(size_t nmemb, size_t size)
+{
+	void *p = calloc(nmemb, size);
+
+	if (!p) {
+		perror("calloc");
+		exit(1);
+	}
+	return p;
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	void *p = realloc(ptr, size);
+
+	if (!p) {
+		perror("realloc");
+		exit(1);
+	}
+	return p;
+}
+
+/*
+ * Fenwick tree
+ */
+static inline void fen_add(struct worker *w, uint64_t i, int32_t v)
+{
+	for (; i <= w->fen_cap; i += i & -i)
+		w->fen[i] += v;
+}
+
+static inline int64_t fen_sum(struct worker *w, uint64_t i)
+{
+	int64_t s = 0;
+
+	for (; i; i -= i & -i)
+		s += w->fen[i];
+	return s;
+}
+
+static int cmp_last(const void *a, const void *b)
+{
+	const struct entry *x = *(const struct entry **)a;
+	const struct entry *y = *(const struct entry **)b;
+
+	return (x->last > y->last) - (x->last < y->last);
+}
+
+/* Renumber access times 1..n in LRU order and rebuild the tree */
+static void fen_compact(struct worker *w)
+{
+	struct entry **live;
+	uint64_t i, n = 0;
+
+	live = xcalloc(w->table_cnt + 1, sizeof(*live));
+	for (i = 0; i < w->table_cap; i++)
+		if (w->table[i].key && w->table[i].last)
+			live[n++] = &w->table[i];
+	qsort(live, n, sizeof(*live), cmp_last);
+
+	if (n * 2 > w->fen_cap) {
+		w->fen_cap *= 2;
+		w->fen = xrealloc(w->fen, (w->fen_cap + 1) * sizeof(*w->fen));
+	}
+	memset(w->fen, 0, (w->fen_cap + 1) * sizeof(*w->fen));
+
+	for (i = 0; i < n; i++) {
+		live[i]->last = i + 1;
+		fen_add(w, i + 1, 1);
+	}
+	w->now = n;
+
+	free(live);
+}
+
+/*
+ * Hash table
+ */
+static struct entry *table_get(struct worker *w, uint64_t lba);
+
+static void table_grow(struct worker *w)
+{
+	struct entry *old = w->table;
+	uint64_t i, old_cap = w->table_cap;
+
+	w->table_cap *= 2;
+	w->table = xcalloc(w->table_cap, sizeof(*w->table));
+	w->table_cnt = 0;
+
+	for (i = 0; i < old_cap; i++) {
+		if (!old[i].key)
+			continue;
+		*table_get(w, old[i].key - 1) = old[i];
+	}
+
+	free(old);
+}
+
+static struct entry *table_get(struct worker *w, uint64_t lba)
+{
+	uint64_t mask = w->table_cap - 1;
+	uint64_t i = hash64(lba ^ 0x9e3779b97f4a7c15ULL) & mask;
+	struct entry *e;
+
+	for (;; i = (i + 1) & mask) {
+		e = &w->table[i];
+		if (e->key == lba + 1)
+			return e;
+		if (!e->key)
+			break;
+	}
+
+	if ((w->table_cnt + 1) * 4 > w->table_cap * 3) {
+		table_grow(w);
+		return table_get(w, lba);
+	}
+
+	e->key = lba + 1;
+	w->table_cnt++;
+	return e;
+}
+
+/*
+ * Accounting
+ */
+static void ensure_window(struct worker *w, uint64_t win)
+{
+	uint64_t n = w->nr_windows, i;
+	int op;
+
+	if (win < n)
+		return;
+
+	n = win + 1 > n * 2 ? win + 1 : n * 2;
+	for (op = 0; op <= NR_OPS; op++) {
+		w->ws[op] = xrealloc(w->ws[op], n * sizeof(uint64_t));
+		memset(w->ws[op] + w->nr_windows, 0, (n - w->nr_windows) * sizeof(uint64_t));
+	}
+
+	w->heat = xrealloc(w->heat, n * w->heat_rows * sizeof(uint64_t));
+	for (i = w->nr_windows * w->heat_rows; i < n * w->heat_rows; i++)
+		w->heat[i] = 0;
+	w->nr_windows = n;
+}
+
+static void ensure_row(struct worker *w, uint64_t row)
+{
+	uint64_t rows = w->heat_rows, win, r;
+	uint64_t *heat;
+
+	if (row < rows)
+		return;
+
+	rows = row + 1 > rows * 2 ? row + 1 : rows * 2;
+	heat = xcalloc(w->nr_windows * rows, sizeof(uint64_t));
+	for (win = 0; win < w->nr_windows; win++)
+		for (r = 0; r < w->heat_rows; r++)
+			heat[win * rows + r] = w->heat[win * w->heat_rows + r];
+	free(w->heat);
+	w->heat = heat;
+	w->heat_rows = rows;
+}
+
+static inline void account_ws(struct entry *e, struct worker *w, int op, uint32_t win)
+{
+	/* Windows are stored + 1 so that 0 means never */
+	if (e->window[op] != win + 1) {
+		e->window[op] = win + 1;
+		w->ws[op][win]++;
+	}
+}
+
+static void access_block(struct worker *w, int op, uint64_t lba, uint64_t win)
+{
+	struct entry *e;
+	uint64_t dist;
+
+	e = table_get(w, lba);
+	account_ws(e, w, op, win);
+	account_ws(e, w, OP_ALL, win);
+
+	if (op == OP_DISCARD) {
+		/* Discarded blocks fall out of the LRU stack */
+		if (e->last) {
+			fen_add(w, e->last, -1);
+			e->last = 0;
+		}
+		w->sampled[op]++;
+		return;
+	}
+
+	w->sampled[op]++;
+	w->sampled[OP_ALL]++;
+
+	if (w->now == w->fen_cap)
+		fen_compact(w);
+	w->now++;
+
+	if (e->last) {
+		/* Distinct blocks touched since the previous access */
+		dist = fen_sum(w, w->now - 1) - fen_sum(w, e->last);
+		w->hist[op][log2_bucket(dist)]++;
+		w->hist[OP_ALL][log2_bucket(dist)]++;
+		fen_add(w, e->last, -1);
+	} else {
+		w->cold[op]++;
+		w->cold[OP_ALL]++;
+	}
+
+	e->last = w->now;
+	fen_add(w, w->now, 1);
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	const char *p = trace, *end = trace + trace_len;
+	const struct cheeze_req_user *ureq;
+	uint64_t rec = 0, win, lba, h, row, heat_shift;
+	unsigned int j, nr;
+	int op;
+
+	heat_shift = 20 - BLK_SHIFT;	// MiB -> blocks
+
+	w->table_cap = 1 << 16;
+	w->table = xcalloc(w->table_cap, sizeof(*w->table));
+	w->fen_cap = 1 << 20;
+	w->fen = xcalloc(w->fen_cap + 1, sizeof(*w->fen));
+	w->heat_rows = 1;
+	ensure_window(w, 0);
+
+	while (p + sizeof(*ureq) <= end) {
+		ureq = (const struct cheeze_req_user *)p;
+		nr = ureq->len >> BLK_SHIFT;
+		p += sizeof(*ureq) + nr * sizeof(uint32_t);
+		if (p > end)
+			break;
+
+		win = rec++ / window_records;
+		switch (ureq->op) {
+		case REQ_OP_READ:
+			op = OP_READ;
+			break;
+		case REQ_OP_WRITE:
+			op = OP_WRITE;
+			break;
+		case REQ_OP_DISCARD:
+			op = OP_DISCARD;
+			break;
+		default:
+			continue;
+		}
+
+		ensure_window(w, win);
+
+		for (j = 0; j < nr; j++) {
+			lba = (uint64_t)ureq->pos + j;
+			h = hash64(lba);
+			if ((int)(h % nr_workers) != w->idx)
+				continue;
+
+			row = (lba >> heat_shift) / heat_gran_mib;
+			ensure_row(w, row);
+			w->heat[win * w->heat_rows + row]++;
+
+			if ((h >> 40) >= sample_threshold)
+				continue;
+			access_block(w, op, lba, win);
+		}
+	}
+
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-t threads] [-s sample_rate] [-w window_records] [-g heat_mib] [trace]\n"
+		"    -t    worker threads (default: 1)\n"
+		"    -s    SHARDS sampling rate in (0, 1] (default: 1)\n"
+		"    -w    records per working set / heatmap window (default: 100000)\n"
+		"    -g    heatmap LBA granularity in MiB (default: 1024)\n"
+		"    trace defaults to " TRACE_TARGET "\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers, *w;
+	uint64_t hist[NR_OPS + 1][NR_BUCKETS] = { { 0 } };
+	uint64_t cold[NR_OPS + 1] = { 0 }, total[NR_OPS + 1] = { 0 };
+	uint64_t nr_windows = 0, heat_rows = 0, win, row, v, misses;
+	const char *path = TRACE_TARGET;
+	double scale;
+	struct stat st;
+	int fd, opt, i, op, b;
+
+	while ((opt = getopt(argc, argv, "t:s:w:g:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_workers = atoi(optarg);
+			break;
+		case 's':
+			sample_rate = atof(optarg);
+			break;
+		case 'w':
+			window_records = strtoull(optarg, NULL, 0);
+			break;
+		case 'g':
+			heat_gran_mib = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+	if (nr_workers < 1 || sample_rate <= 0 || sample_rate > 1 ||
+	    !window_records || !heat_gran_mib)
+		usage(argv[0]);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		return 1;
+	}
+	trace_len = st.st_size;
+	if (!trace_len) {
+		fprintf(stderr, "%s is empty\n", path);
+		return 1;
+	}
+	trace = mmap(NULL, trace_len, PROT_READ, MAP_SHARED, fd, 0);
+	if (trace == MAP_FAILED) {
+		perror("Failed to mmap trace");
+		return 1;
+	}
+	madvise((void *)trace, trace_len, MADV_SEQUENTIAL);
+	close(fd);
+
+	/* Top 24 bits of the hash decide SHARDS sampling */
+	sample_threshold = (uint64_t)(sample_rate * (1 << 24));
+
+	workers = xcalloc(nr_workers, sizeof(*workers));
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].idx = i;
+		if (pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		w = &workers[i];
+		pthread_join(w->thread, NULL);
+		for (op = 0; op <= NR_OPS; op++) {
+			for (b = 0; b < NR_BUCKETS; b++)
+				hist[op][b] += w->hist[op][b];
+			cold[op] += w->cold[op];
+			total[op] += w->sampled[op];
+		}
+		if (w->nr_windows > nr_windows)
+			nr_windows = w->nr_windows;
+		if (w->heat_rows > heat_rows)
+			heat_rows = w->heat_rows;
+	}
+
+	/* Each worker saw 1 / nr_workers of the blocks, sampled at sample_rate */
+	scale = nr_workers / sample_rate;
+
+	printf("# trace=%s threads=%d sample_rate=%g window_records=%lu\n",
+	       path, nr_workers, sample_rate, window_records);
+
+	printf("\n[working_set] distinct 4KiB blocks per window (estimated)\n");
+	printf("window");
+	for (op = 0; op <= NR_OPS; op++)
+		printf(" %s", op_names[op]);
+	printf("\n");
+	for (win = 0; win < nr_windows; win++) {
+		uint64_t sum[NR_OPS + 1] = { 0 };
+		int any = 0;
+
+		for (i = 0; i < nr_workers; i++)
+			for (op = 0; op <= NR_OPS; op++)
+				if (win < workers[i].nr_windows)
+					sum[op] += workers[i].ws[op][win];
+		for (op = 0; op <= NR_OPS; op++)
+			any |= !!sum[op];
+		if (!any)
+			continue;
+
+		printf("%lu", win);
+		for (op = 0; op <= NR_OPS; op++)
+			printf(" %.0f", sum[op] / sample_rate);
+		printf("\n");
+	}
+
+	printf("\n[reuse_distance] accesses per distance bucket (estimated, in 4KiB blocks)\n");
+	printf("bucket");
+	for (op = 0; op <= NR_OPS; op++)
+		if (op != OP_DISCARD)
+			printf(" %s", op_names[op]);
+	printf("\ncold");
+	for (op = 0; op <= NR_OPS; op++)
+		if (op != OP_DISCARD)
+			printf(" %.0f", cold[op] / sample_rate);
+	printf("\n");
+	for (b = 0; b < NR_BUCKETS; b++) {
+		if (!hist[OP_ALL][b])
+			continue;
+		/* bucket b holds sampled distances in [2^(b-1), 2^b) */
+		printf("<%.0f", b ? (double)(1ULL << b) * scale : 1.0);
+		for (op = 0; op <= NR_OPS; op++)
+			if (op != OP_DISCARD)
+				printf(" %.0f", hist[op][b] / sample_rate);
+		printf("\n");
+	}
+
+	printf("\n[mrc] LRU miss ratio per cache size\n");
+	printf("cache_mib");
+	for (op = 0; op <= NR_OPS; op++)
+		if (op != OP_DISCARD)
+			printf(" %s", op_names[op]);
+	printf("\n");
+	for (b = 0; b < NR_BUCKETS; b++) {
+		double blocks = (double)(1ULL << b) * scale;
+
+		if (b && !hist[OP_ALL][b - 1] && !hist[OP_ALL][b])
+			continue;
+
+		printf("%.3f", blocks * 4096 / (1024 * 1024));
+		for (op = 0; op <= NR_OPS; op++) {
+			int k;
+
+			if (op == OP_DISCARD)
+				continue;
+			/* Sampled distance >= 2^b misses in a cache of 2^b * scale */
+			misses = cold[op];
+			for (k = b + 1; k < NR_BUCKETS; k++)
+				misses += hist[op][k];
+			printf(" %.4f", total[op] ? (double)misses / total[op] : 0.0);
+		}
+		printf("\n");
+	}
+
+	printf("\n[heatmap] 4KiB block accesses, rows of %lu MiB, columns of %lu records\n",
+	       heat_gran_mib, window_records);
+	for (row = 0; row < heat_rows; row++) {
+		printf("%lu", row * heat_gran_mib);
+		for (win = 0; win < nr_windows; win++) {
+			v = 0;
+			for (i = 0; i < nr_workers; i++) {
+				w = &workers[i];
+				if (row < w->heat_rows && win < w->nr_windows)
+					v += w->heat[win * w->heat_rows + row];
+			}
+			printf(" %lu", v);
+		}
+		printf("\n");
+	}
+
+	return 0;
+}
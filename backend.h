@@ -0,0 +1,1044 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Header-only library for writing cheeze daemons.
+ *
+ * It owns the shm attach, send flag polling, request scheduling and
+ * completion.  A backend only provides a struct cheeze_backend of handlers:
+ *
+ *	static const struct cheeze_backend my_backend = {
+ *		.read = my_read,
+ *		.write = my_write,
+ *	};
+ *
+ *	cheeze_run(&shm, &my_backend, my_priv, &stop);
+ *
+ * cheeze_run() is always inlined, so when the backend is a compile-time
+ * constant every handler call is resolved to a direct (and usually inlined)
+ * call and no function pointer is followed per request.  Missing handlers
+ * complete the request without doing anything.
+ *
+ * A handler returns CHEEZE_DONE once the request is served, or CHEEZE_ASYNC
+ * if it will call cheeze_complete() itself later, possibly from another
+ * thread.
+ *
+ * The daemon can be restarted at any time: cheeze_shm_attach() bumps the
+ * generation in the control block and every slot that is still outstanding
+ * (send set, recv clear) is simply served again by the new daemon.
+ *
+ * When attached through /dev/cheeze-ctl, cheeze_run() sleeps in poll()
+ * after CHEEZE_IDLE_SCANS scans in a row found nothing to do, or, after
+ * cheeze_shm_uring(), waits for requests on io_uring commands instead of
+ * scanning the send flags at all.
+ *
+ * Counters are kept in a struct cheeze_stats_worker per serving thread,
+ * written only by that thread with plain stores.  cheeze_stats_open()
+ * moves them to a POSIX shm segment that cheezestat samples.
+ */
+
+#ifndef __CHEEZE_BACKEND_H
+#define __CHEEZE_BACKEND_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#include "cheeze.h"
+#include "crc32c.c"
+#include "uring.c"
+
+#define PHYS_ADDR 0x3ec0000000
+#define TOTAL_SIZE (3ULL * HP_SIZE) // 3 GB
+
+#define barrier() __asm__ __volatile__("": : :"memory")
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_CLASS(mask) ((mask) >> IOPRIO_CLASS_SHIFT)
+
+enum {
+	IOPRIO_CLASS_NONE,
+	IOPRIO_CLASS_RT,
+	IOPRIO_CLASS_BE,
+	IOPRIO_CLASS_IDLE,
+};
+
+/*
+ * Bulk requests served per scan before rescanning for urgent ones, and the
+ * number of scans a bulk request may be passed over before it is promoted.
+ */
+#define BULK_BUDGET 32
+#define BULK_MAX_DEFER 8
+
+/*
+ * Empty scans before sleeping in poll(), and how long to sleep at most so
+ * that the heartbeat and the tick handler keep going.
+ */
+#define CHEEZE_IDLE_SCANS 1024
+#define CHEEZE_IDLE_POLL_MS 10
+
+/* Handler return values */
+#define CHEEZE_DONE 0
+#define CHEEZE_ASYNC 1
+
+/*
+ * Stats segment, /dev/shm/cheeze-stats.  Times are in TSC cycles, see
+ * tsc_hz, and the latency histograms count backend handler times in
+ * power of two buckets: bucket b holds times in [2^b, 2^(b+1)) cycles.
+ */
+#define CHEEZE_STATS_NAME "/cheeze-stats"
+#define CHEEZE_STATS_MAGIC 0x7374617473ULL // "stats"
+#define CHEEZE_STATS_WORKERS 16
+#define CHEEZE_STATS_BUCKETS 64
+
+enum {
+	CHEEZE_STATS_READ,
+	CHEEZE_STATS_WRITE,
+	CHEEZE_STATS_DISCARD,
+	CHEEZE_STATS_FLUSH,
+	CHEEZE_STATS_OTHER,
+	CHEEZE_STATS_OPS,
+};
+
+struct cheeze_stats_worker {
+	uint64_t ops[CHEEZE_STATS_OPS];
+	uint64_t bytes[CHEEZE_STATS_OPS];
+	uint64_t cycles[CHEEZE_STATS_OPS];	// in the backend handlers
+	uint64_t hist[CHEEZE_STATS_OPS][CHEEZE_STATS_BUCKETS];
+	uint64_t busy_cycles;	// scans or waits that found requests, and serving them
+	uint64_t idle_cycles;	// the others
+	uint64_t scans;
+	uint64_t occupancy;	// sum of the requests outstanding at every scan
+} __attribute__((aligned(64)));
+
+struct cheeze_stats {
+	uint64_t magic;
+	uint64_t start_ns;	// CLOCK_REALTIME of the daemon start
+	uint64_t tsc_hz;
+	uint32_t nr_workers;
+	uint32_t pid;
+	struct cheeze_stats_worker workers[CHEEZE_STATS_WORKERS];
+};
+
+struct cheeze_shm {
+	void *base;
+	uint8_t *send_event_addr; // CHEEZE_QUEUE_SIZE ==> 16B
+	uint8_t *recv_event_addr; // 16B
+	uint64_t *seq_addr; // 8KB
+	struct cheeze_req_user *ureq_addr; // sizeof(req) * 1024
+	struct cheeze_shm_ctl *ctl_addr;
+	struct cheeze_zone *zones; // ctl_addr->nr_zones entries
+	struct cheeze_zone_log *zone_log; // per slot
+	char *bufs[CHEEZE_QUEUE_SIZE]; // CHEEZE_BUF_SIZE each
+	int ctl_fd; // /dev/cheeze-ctl, -1 if attached through /dev/mem
+	int uring; // serve through io_uring commands on ctl_fd
+	struct cheeze_uring ring;
+
+	/* Daemon-local scheduling state */
+	uint64_t generation; // ours, see cheeze_superseded()
+	volatile uint8_t inflight[CHEEZE_QUEUE_SIZE]; // handed to an async backend
+	uint8_t defer_cnt[CHEEZE_QUEUE_SIZE];
+	unsigned int idle; // scans in a row that found nothing to do
+	struct cheeze_stats_worker *stats; // stats_local or in the stats segment
+	struct cheeze_stats_worker stats_local;
+};
+
+struct cheeze_backend {
+	int (*read)(void *priv, struct cheeze_req_user *ureq, char *buf);
+	int (*write)(void *priv, struct cheeze_req_user *ureq, char *buf);
+	int (*discard)(void *priv, struct cheeze_req_user *ureq);
+	int (*flush)(void *priv, struct cheeze_req_user *ureq);
+	/* CHEEZE_OP_KV_*, buf holds a struct cheeze_kv_hdr, the key and the value */
+	int (*kv)(void *priv, struct cheeze_req_user *ureq, char *buf);
+	/* Called once per scan of the send flags */
+	void (*tick)(void *priv);
+};
+
+static inline off_t fdlength(int fd)
+{
+	struct stat st;
+	off_t cur, ret;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode))
+		return st.st_size;
+
+	cur = lseek(fd, 0, SEEK_CUR);
+	ret = lseek(fd, 0, SEEK_END);
+	lseek(fd, cur, SEEK_SET);
+
+	return ret;
+}
+
+static inline uint64_t cheeze_tsc_hz(void)
+{
+	struct timespec t0, t1, req = { 0, 20 * 1000000 };
+	uint64_t c0, c1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	c0 = __rdtsc();
+	nanosleep(&req, NULL);
+	c1 = __rdtsc();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	return (c1 - c0) * 1000000000ULL /
+	       ((t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec);
+}
+
+/* Publish the counters of shm in the stats segment, as its only worker */
+static inline int cheeze_stats_open(struct cheeze_shm *shm)
+{
+	struct cheeze_stats *st;
+	struct timespec ts;
+	int fd;
+
+	fd = shm_open(CHEEZE_STATS_NAME, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror("Failed to open the stats segment");
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(*st))) {
+		perror("Failed to size the stats segment");
+		close(fd);
+		return -1;
+	}
+	st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (st == MAP_FAILED) {
+		perror("Failed to mmap the stats segment");
+		return -1;
+	}
+
+	// Not truncated, a running cheezestat would fault on its mapping
+	memset(st, 0, sizeof(*st));
+	clock_gettime(CLOCK_REALTIME, &ts);
+	st->start_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	st->tsc_hz = cheeze_tsc_hz();
+	st->nr_workers = 1;
+	st->pid = getpid();
+	st->workers[0] = shm->stats_local;
+	shm->stats = &st->workers[0];
+	barrier();
+	st->magic = CHEEZE_STATS_MAGIC;
+
+	return 0;
+}
+
+static inline void cheeze_stats_account(struct cheeze_stats_worker *w,
+					struct cheeze_req_user *ureq, uint64_t cycles)
+{
+	int op;
+
+	switch (ureq->op) {
+	case REQ_OP_READ:
+		op = CHEEZE_STATS_READ;
+		break;
+	case REQ_OP_WRITE:
+	case CHEEZE_OP_ZONE_APPEND:
+		op = CHEEZE_STATS_WRITE;
+		break;
+	case REQ_OP_DISCARD:
+		op = CHEEZE_STATS_DISCARD;
+		break;
+	case REQ_OP_FLUSH:
+		op = CHEEZE_STATS_FLUSH;
+		break;
+	default:
+		op = CHEEZE_STATS_OTHER;
+	}
+
+	w->ops[op]++;
+	w->bytes[op] += ureq->len;
+	w->cycles[op] += cycles;
+	w->hist[op][cycles ? 63 - __builtin_clzll(cycles) : 0]++;
+}
+
+static inline void cheeze_shm_meta_init(struct cheeze_shm *shm, char *ppage_addr)
+{
+	//memset(ppage_addr, 0, HP_SIZE);
+	shm->send_event_addr = (uint8_t *)(ppage_addr + SEND_OFF);
+	shm->recv_event_addr = (uint8_t *)(ppage_addr + RECV_OFF);
+	shm->seq_addr = (uint64_t *)(ppage_addr + SEQ_OFF);
+	shm->ureq_addr = (struct cheeze_req_user *)(ppage_addr + REQS_OFF);
+	shm->ctl_addr = (struct cheeze_shm_ctl *)(ppage_addr + CTL_OFF);
+	shm->zones = (struct cheeze_zone *)(ppage_addr + ZONES_OFF);
+	shm->zone_log = (struct cheeze_zone_log *)(ppage_addr + ZLOG_OFF);
+}
+
+/*
+ * Announce a new daemon and count the requests left by the previous one.
+ * gen is the generation from CHEEZE_IOC_ATTACH, or 0 through /dev/mem,
+ * where the daemon bumps it itself.
+ */
+static inline int cheeze_shm_recover(struct cheeze_shm *shm, uint64_t gen)
+{
+	struct cheeze_shm_ctl *ctl = shm->ctl_addr;
+	int i, outstanding = 0;
+
+	if (ctl->magic != CHEEZE_SHM_MAGIC) {
+		fprintf(stderr, "cheeze: shm is not initialized, is the module loaded?\n");
+		return -1;
+	}
+
+	if (!gen)
+		gen = __atomic_add_fetch(&ctl->generation, 1, __ATOMIC_SEQ_CST);
+	ctl->daemon_pid = getpid();
+	shm->generation = gen;
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++)
+		if (shm->send_event_addr[i] && !shm->recv_event_addr[i])
+			outstanding++;
+
+	printf("cheeze: attached as generation %lu, %d outstanding requests\n",
+	       gen, outstanding);
+	if (ctl->nr_zones)
+		printf("cheeze: zoned, %lu zones of %lu blocks\n",
+		       ctl->nr_zones, ctl->zone_blocks);
+
+	return 0;
+}
+
+/* Map the regions allocated by the module behind /dev/cheeze-ctl */
+static inline int cheeze_shm_attach_ctl(struct cheeze_shm *shm, int fd)
+{
+	char *meta, *data;
+	uint64_t gen;
+	int i;
+
+	// Fences out the daemon this one supersedes, before mapping anything
+	if (ioctl(fd, CHEEZE_IOC_ATTACH, &gen)) {
+		perror("Failed to attach to " CHEEZE_CTL_PATH);
+		close(fd);
+		return -1;
+	}
+
+	meta = mmap(NULL, CHEEZE_CTL_META_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (meta == MAP_FAILED) {
+		perror("Failed to mmap " CHEEZE_CTL_PATH " metadata");
+		close(fd);
+		return -1;
+	}
+
+	data = mmap(NULL, CHEEZE_CTL_DATA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, CHEEZE_CTL_DATA_OFF);
+	if (data == MAP_FAILED) {
+		perror("Failed to mmap " CHEEZE_CTL_PATH " data");
+		munmap(meta, CHEEZE_CTL_META_SIZE);
+		close(fd);
+		return -1;
+	}
+
+	shm->base = meta;
+	shm->ctl_fd = fd;
+	cheeze_shm_meta_init(shm, meta);
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++)
+		shm->bufs[i] = data + i * CHEEZE_BUF_SIZE;
+
+	return cheeze_shm_recover(shm, gen);
+}
+
+/*
+ * Map the shm regions through /dev/cheeze-ctl, or the ones reserved at
+ * PHYS_ADDR, in the order given to the module, if it is not available.
+ */
+static inline int cheeze_shm_attach(struct cheeze_shm *shm)
+{
+	uint64_t pagesize, addr, len;
+	char *page_addr;
+	int fd, i;
+
+	memset(shm, 0, sizeof(*shm));
+	shm->ctl_fd = -1;
+	shm->stats = &shm->stats_local;
+
+	fd = open(CHEEZE_CTL_PATH, O_RDWR);
+	if (fd >= 0)
+		return cheeze_shm_attach_ctl(shm, fd);
+	if (errno != ENOENT)
+		fprintf(stderr, "cheeze: %s: %s, falling back to /dev/mem\n",
+			CHEEZE_CTL_PATH, strerror(errno));
+
+	fd = open("/dev/mem", O_RDWR);
+	if (fd == -1) {
+		perror("Failed to open /dev/mem");
+		return -1;
+	}
+
+	pagesize = getpagesize();
+	addr = PHYS_ADDR & (~(pagesize - 1));
+	len = (PHYS_ADDR & (pagesize - 1)) + TOTAL_SIZE;
+	page_addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, addr);
+	close(fd);
+	if (page_addr == MAP_FAILED) {
+		perror("Failed to mmap plain device path");
+		return -1;
+	}
+
+	shm->base = page_addr;
+	cheeze_shm_meta_init(shm, page_addr + 2 * HP_SIZE);
+	// page_addr1 is at + 1GB and page_addr2 at + 0
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++)
+		shm->bufs[i] = page_addr + (1 - i / ITEMS_PER_HP) * HP_SIZE +
+			       (i % ITEMS_PER_HP) * CHEEZE_BUF_SIZE;
+
+	return cheeze_shm_recover(shm, 0);
+}
+
+static inline char *cheeze_buf(struct cheeze_shm *shm, int id)
+{
+	return shm->bufs[id];
+}
+
+/* Sleep until the kernel publishes a request, or CHEEZE_IDLE_POLL_MS */
+static inline void cheeze_idle_wait(struct cheeze_shm *shm)
+{
+	struct pollfd pfd = { .fd = shm->ctl_fd, .events = POLLIN };
+
+	poll(&pfd, 1, CHEEZE_IDLE_POLL_MS);
+}
+
+/*
+ * Whether a newer daemon attached.  The kernel may have handed out the
+ * slots this one was serving again, so it must not complete anything.
+ */
+static inline int cheeze_superseded(struct cheeze_shm *shm)
+{
+	return __atomic_load_n(&shm->ctl_addr->generation, __ATOMIC_ACQUIRE) != shm->generation;
+}
+
+/*
+ * Publish the completion of slot id to the kernel.  The recv store is the
+ * commit point, the kernel clears send and then recv when it reaps it.
+ */
+static inline void cheeze_complete(struct cheeze_shm *shm, int id)
+{
+	barrier();
+	if (__builtin_expect(!cheeze_superseded(shm), 1))
+		shm->recv_event_addr[id] = 1;
+	barrier();
+	shm->inflight[id] = 0;
+}
+
+static inline int cheeze_is_urgent(struct cheeze_req_user *ureq)
+{
+	int class = IOPRIO_PRIO_CLASS(ureq->ioprio);
+
+	if (class == IOPRIO_CLASS_RT)
+		return 1;
+	if (class == IOPRIO_CLASS_IDLE)
+		return 0;
+	if (ureq->flags & (CHEEZE_REQ_BACKGROUND | CHEEZE_REQ_RAHEAD))
+		return 0;
+
+	return !!(ureq->flags & (CHEEZE_REQ_SYNC | CHEEZE_REQ_META |
+				 CHEEZE_REQ_PRIO | CHEEZE_REQ_SWAP));
+}
+
+/*
+ * Zoned mode.  Writes must start at the write pointer of a writable zone,
+ * zone appends are redirected to it and report where they landed in pos,
+ * and the management ops only move the zone state.  Resets are also handed
+ * to the discard handler, through a temporary descriptor it must not keep.
+ *
+ * Every op that moves the zone table is logged per slot by its seq, see
+ * struct cheeze_zone_log, so that serving a slot again after a restart
+ * neither appends twice nor fails a write the lost daemon already applied.
+ * Only the dispatching thread changes the zone table, so a PENDING entry
+ * is the last op before the crash and nothing moved its zone since.
+ *
+ * Returns 1 if the request still has to be served by the backend, 0 if it
+ * is done, with ureq->ret set on failure.
+ */
+static inline int cheeze_zone_discard(const struct cheeze_backend *be, void *priv,
+				      struct cheeze_req_user *ureq, struct cheeze_zone *z)
+{
+	struct cheeze_req_user dreq = *ureq;
+
+	z->wp = z->start;
+	z->cond = CHEEZE_ZONE_COND_EMPTY;
+
+	if (!be->discard)
+		return 0;
+
+	dreq.op = REQ_OP_DISCARD;
+	dreq.pos = z->start;
+	dreq.len = z->len << CHEEZE_LOGICAL_BLOCK_SHIFT;
+	return be->discard(priv, &dreq);
+}
+
+static inline int cheeze_zone_apply(struct cheeze_shm *shm, const struct cheeze_backend *be,
+				    void *priv, struct cheeze_req_user *ureq, struct cheeze_zone *z)
+{
+	uint64_t i, nr_zones = shm->ctl_addr->nr_zones;
+	uint64_t nr = ureq->len >> CHEEZE_LOGICAL_BLOCK_SHIFT;
+
+	if (ureq->op == CHEEZE_OP_ZONE_RESET_ALL) {
+		for (i = 0; i < nr_zones; i++)
+			if (shm->zones[i].cond != CHEEZE_ZONE_COND_EMPTY)
+				cheeze_zone_discard(be, priv, ureq, &shm->zones[i]);
+		return 0;
+	}
+
+	if (!z)
+		goto err;
+
+	switch (ureq->op) {
+	case CHEEZE_OP_ZONE_APPEND:
+		ureq->pos = z->wp;
+		/* fallthrough */
+	case REQ_OP_WRITE:
+		if (z->cond == CHEEZE_ZONE_COND_FULL || z->cond == CHEEZE_ZONE_COND_READONLY ||
+		    z->cond == CHEEZE_ZONE_COND_OFFLINE || ureq->pos != z->wp ||
+		    z->wp + nr > z->start + z->len)
+			goto err;
+		z->wp += nr;
+		if (z->wp == z->start + z->len)
+			z->cond = CHEEZE_ZONE_COND_FULL;
+		else if (z->cond != CHEEZE_ZONE_COND_EXP_OPEN)
+			z->cond = CHEEZE_ZONE_COND_IMP_OPEN;
+		return 1;
+	case CHEEZE_OP_ZONE_RESET:
+		cheeze_zone_discard(be, priv, ureq, z);
+		return 0;
+	case CHEEZE_OP_ZONE_OPEN:
+		if (z->cond != CHEEZE_ZONE_COND_FULL)
+			z->cond = CHEEZE_ZONE_COND_EXP_OPEN;
+		return 0;
+	case CHEEZE_OP_ZONE_CLOSE:
+		if (z->cond == CHEEZE_ZONE_COND_IMP_OPEN || z->cond == CHEEZE_ZONE_COND_EXP_OPEN)
+			z->cond = z->wp == z->start ? CHEEZE_ZONE_COND_EMPTY : CHEEZE_ZONE_COND_CLOSED;
+		return 0;
+	case CHEEZE_OP_ZONE_FINISH:
+		z->wp = z->start + z->len;
+		z->cond = CHEEZE_ZONE_COND_FULL;
+		return 0;
+	}
+
+err:
+	ureq->ret = -EIO;
+	return 0;
+}
+
+static inline int cheeze_zone_prep(struct cheeze_shm *shm, const struct cheeze_backend *be,
+				   void *priv, int id)
+{
+	struct cheeze_req_user *ureq = shm->ureq_addr + id;
+	struct cheeze_zone_log *log = shm->zone_log + id;
+	uint64_t i, seq = shm->seq_addr[id];
+	struct cheeze_zone *z = NULL;
+	int ret;
+
+	/* Nothing to check for these, and KV commands don't address the disk */
+	if (ureq->op == REQ_OP_READ || ureq->op == REQ_OP_DISCARD ||
+	    (ureq->op >= CHEEZE_OP_KV_PUT && ureq->op <= CHEEZE_OP_KV_ITER))
+		return 1;
+
+	if (log->seq == seq && log->state == CHEEZE_ZLOG_DONE) {
+		/* Applied already, pos and ret are still in the slot */
+		if (ureq->op == REQ_OP_WRITE || ureq->op == CHEEZE_OP_ZONE_APPEND)
+			return !ureq->ret;
+		return 0;
+	}
+
+	if (log->seq == seq && log->state == CHEEZE_ZLOG_PENDING && log->zone != CHEEZE_ZLOG_ALL) {
+		z = &shm->zones[log->zone];
+		z->wp = log->wp;
+		z->cond = log->cond;
+		z = NULL;
+	}
+
+	log->state = CHEEZE_ZLOG_NONE;
+	barrier();
+	log->seq = seq;
+	log->zone = CHEEZE_ZLOG_ALL;
+	if (ureq->op != CHEEZE_OP_ZONE_RESET_ALL) {
+		i = ureq->pos / shm->ctl_addr->zone_blocks;
+		if (i < shm->ctl_addr->nr_zones) {
+			z = &shm->zones[i];
+			log->zone = i;
+			log->wp = z->wp;
+			log->cond = z->cond;
+		}
+	}
+	barrier();
+	log->state = CHEEZE_ZLOG_PENDING;
+	barrier();
+
+	ret = cheeze_zone_apply(shm, be, priv, ureq, z);
+
+	barrier();
+	log->state = CHEEZE_ZLOG_DONE;
+
+	return ret;
+}
+
+static inline __attribute__((always_inline))
+void cheeze_dispatch(struct cheeze_shm *shm, const struct cheeze_backend *be,
+		     void *priv, int id)
+{
+	struct cheeze_req_user *ureq = shm->ureq_addr + id;
+	char *buf = cheeze_buf(shm, id);
+	int ret = CHEEZE_DONE;
+	uint64_t start = __rdtsc();
+
+	shm->defer_cnt[id] = 0;
+	/* Set before the handler runs, an async backend may complete at once */
+	shm->inflight[id] = 1;
+
+	if (__builtin_expect(shm->ctl_addr->nr_zones != 0, 0) &&
+	    !cheeze_zone_prep(shm, be, priv, id)) {
+		cheeze_complete(shm, id);
+		return;
+	}
+
+	switch (ureq->op) {
+	case REQ_OP_READ:
+		if (be->read)
+			ret = be->read(priv, ureq, buf);
+		break;
+	case REQ_OP_WRITE:
+	case CHEEZE_OP_ZONE_APPEND:
+		if (be->write)
+			ret = be->write(priv, ureq, buf);
+		break;
+	case REQ_OP_DISCARD:
+		if (be->discard)
+			ret = be->discard(priv, ureq);
+		break;
+	case REQ_OP_FLUSH:
+		if (be->flush)
+			ret = be->flush(priv, ureq);
+		break;
+	case CHEEZE_OP_KV_PUT:
+	case CHEEZE_OP_KV_GET:
+	case CHEEZE_OP_KV_DELETE:
+	case CHEEZE_OP_KV_ITER:
+		if (be->kv)
+			ret = be->kv(priv, ureq, buf);
+		else
+			ureq->ret = -EOPNOTSUPP;
+		break;
+	}
+
+	/* For async requests, only the time to hand them over */
+	cheeze_stats_account(shm->stats, ureq, __rdtsc() - start);
+
+	if (ret != CHEEZE_ASYNC)
+		cheeze_complete(shm, id);
+}
+
+/* Serve requests from io_uring commands instead of the send flags, see cheeze_run() */
+static inline int cheeze_shm_uring(struct cheeze_shm *shm)
+{
+	int ret;
+
+	if (shm->ctl_fd < 0) {
+		fprintf(stderr, "cheeze: io_uring commands need " CHEEZE_CTL_PATH "\n");
+		return -1;
+	}
+
+	ret = cheeze_uring_init(&shm->ring, CHEEZE_QUEUE_SIZE, 0);
+	if (ret) {
+		fprintf(stderr, "cheeze: io_uring_setup: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	shm->uring = 1;
+	return 0;
+}
+
+/* Queue a CHEEZE_URING_CMD_* command for slot id, submitted on the next wait */
+static inline void cheeze_uring_cmd(struct cheeze_shm *shm, int id, uint32_t op)
+{
+	struct io_uring_sqe *sqe;
+
+	// At most one command per slot, this only fills up before the first submit
+	while (!(sqe = cheeze_uring_get_sqe(&shm->ring)))
+		cheeze_uring_submit(&shm->ring, 0);
+
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = shm->ctl_fd;
+	sqe->cmd_op = op;
+	sqe->user_data = id;
+	((struct cheeze_uring_cmd *)sqe->cmd)->id = id;
+}
+
+/*
+ * Every slot keeps a fetch armed.  A completed fetch hands over a request,
+ * and once the backend completed it, the commit of its result goes out
+ * with the next fetch of the slot in the same command.  All requests
+ * fetched by one wait are served, urgent ones first, before waiting again.
+ *
+ * Returns -1 if the kernel does not support the commands.
+ */
+static inline __attribute__((always_inline))
+int cheeze_run_uring(struct cheeze_shm *shm, const struct cheeze_backend *be,
+		     void *priv, volatile sig_atomic_t *stop)
+{
+	int ready[CHEEZE_QUEUE_SIZE], owned[CHEEZE_QUEUE_SIZE];
+	int i, id, res, pass, nr_ready, nr_owned = 0;
+	struct cheeze_stats_worker *st = shm->stats;
+	struct io_uring_cqe *cqe;
+	uint64_t last = __rdtsc(), now;
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++)
+		cheeze_uring_cmd(shm, i, CHEEZE_URING_CMD_FETCH);
+
+	while (!*stop) {
+		if (cheeze_superseded(shm)) {
+			fprintf(stderr, "cheeze: a newer daemon attached, exiting\n");
+			break;
+		}
+		shm->ctl_addr->heartbeat++;
+		if (be->tick)
+			be->tick(priv);
+
+		/* Don't sleep while an async request still has to be committed */
+		res = cheeze_uring_submit(&shm->ring, nr_owned ? 0 : 1);
+		if (res < 0 && res != -EINTR) {
+			fprintf(stderr, "cheeze: io_uring_enter: %s\n", strerror(-res));
+			return -1;
+		}
+		if (!nr_owned) {
+			now = __rdtsc();
+			st->idle_cycles += now - last;
+			last = now;
+		}
+
+		nr_ready = 0;
+		while ((cqe = cheeze_uring_peek_cqe(&shm->ring))) {
+			id = cqe->user_data;
+			res = cqe->res;
+			cheeze_uring_cqe_seen(&shm->ring);
+
+			if (res == 0) {
+				ready[nr_ready++] = id;
+			} else if (res == -EAGAIN || res == -EBUSY) {
+				// -EBUSY: a fetch of the previous daemon, about to be flushed
+				cheeze_uring_cmd(shm, id, CHEEZE_URING_CMD_FETCH);
+			} else if (res == -ESTALE) {
+				fprintf(stderr, "cheeze: a newer daemon attached, exiting\n");
+				return 0;
+			} else {
+				fprintf(stderr, "cheeze: fetch on slot %d: %s\n", id, strerror(-res));
+				return -1;
+			}
+		}
+
+		for (pass = 0; pass < 2; pass++) {
+			for (i = 0; i < nr_ready; i++) {
+				id = ready[i];
+				if (cheeze_is_urgent(shm->ureq_addr + id) == pass)
+					continue;
+				cheeze_dispatch(shm, be, priv, id);
+				owned[nr_owned++] = id;
+			}
+		}
+
+		for (i = 0; i < nr_owned;) {
+			if (shm->inflight[owned[i]]) {
+				i++;
+				continue;
+			}
+			cheeze_uring_cmd(shm, owned[i], CHEEZE_URING_CMD_COMMIT_AND_FETCH);
+			owned[i] = owned[--nr_owned];
+		}
+
+		now = __rdtsc();
+		if (nr_ready || nr_owned)
+			st->busy_cycles += now - last;
+		else
+			st->idle_cycles += now - last;
+		last = now;
+		st->scans++;
+		st->occupancy += nr_owned;
+	}
+
+	return 0;
+}
+
+/*
+ * Serve requests until *stop is set.
+ *
+ * Sync and high-priority requests are served first.  Bulk requests are
+ * served BULK_BUDGET at a time between rescans, except for ones already
+ * passed over BULK_MAX_DEFER times.
+ */
+static inline __attribute__((always_inline))
+void cheeze_run(struct cheeze_shm *shm, const struct cheeze_backend *be,
+		void *priv, volatile sig_atomic_t *stop)
+{
+	int urgent[CHEEZE_QUEUE_SIZE], bulk[CHEEZE_QUEUE_SIZE];
+	int i, nr_urgent, nr_bulk, budget, busy;
+	struct cheeze_stats_worker *st;
+	uint64_t last, now;
+
+	if (shm->uring) {
+		if (!cheeze_run_uring(shm, be, priv, stop))
+			return;
+		fprintf(stderr, "cheeze: falling back to scanning the send flags\n");
+		// Nobody would reap the fetches still armed on it
+		cheeze_uring_exit(&shm->ring);
+		shm->uring = 0;
+	}
+
+	st = shm->stats;
+	last = __rdtsc();
+	while (!*stop) {
+		if (cheeze_superseded(shm)) {
+			fprintf(stderr, "cheeze: a newer daemon attached, exiting\n");
+			break;
+		}
+		shm->ctl_addr->heartbeat++;
+		if (be->tick)
+			be->tick(priv);
+
+		nr_urgent = nr_bulk = busy = 0;
+		for (i = 0; i < CHEEZE_QUEUE_SIZE; i++) {
+			/*
+			 * inflight is cleared after recv is set, and the
+			 * kernel clears send before recv, so check them in
+			 * this order to never pick up a stale slot.
+			 */
+			if (shm->inflight[i]) {
+				busy++;
+				continue;
+			}
+			barrier();
+			if (shm->recv_event_addr[i])
+				continue;
+			barrier();
+			if (!shm->send_event_addr[i])
+				continue;
+			if (cheeze_is_urgent(shm->ureq_addr + i) ||
+			    shm->defer_cnt[i] >= BULK_MAX_DEFER)
+				urgent[nr_urgent++] = i;
+			else
+				bulk[nr_bulk++] = i;
+		}
+
+		for (i = 0; i < nr_urgent; i++)
+			cheeze_dispatch(shm, be, priv, urgent[i]);
+
+		budget = nr_bulk < BULK_BUDGET ? nr_bulk : BULK_BUDGET;
+		for (i = 0; i < nr_bulk; i++) {
+			if (i < budget)
+				cheeze_dispatch(shm, be, priv, bulk[i]);
+			else
+				shm->defer_cnt[bulk[i]]++;
+		}
+
+		/* An async completion wakes nobody, keep spinning while one is pending */
+		if (nr_urgent || nr_bulk || busy)
+			shm->idle = 0;
+		else if (shm->ctl_fd >= 0 && ++shm->idle >= CHEEZE_IDLE_SCANS)
+			cheeze_idle_wait(shm);
+
+		now = __rdtsc();
+		if (nr_urgent || nr_bulk || busy)
+			st->busy_cycles += now - last;
+		else
+			st->idle_cycles += now - last;
+		last = now;
+		st->scans++;
+		st->occupancy += nr_urgent + nr_bulk + busy;
+	}
+}
+
+/*
+ * CRC32C of every 4 KiB block of the slot, next to its descriptor in the
+ * metadata page.  See CHEEZE_REQ_CSUM.
+ */
+static inline uint32_t *cheeze_csums(struct cheeze_req_user *ureq)
+{
+	char *meta = (char *)(ureq - ureq->id) - REQS_OFF;
+
+	return (uint32_t *)(meta + CSUM_OFF) + ureq->id * CSUMS_PER_SLOT;
+}
+
+/* Copy len bytes and the CRC32C of every 4 KiB block of them, in one pass */
+static inline void cheeze_copy_csum(char *dst, const char *src, unsigned int len,
+				    uint32_t *crcs)
+{
+	unsigned int j;
+
+	for (j = 0; j < len; j += 4096)
+		crcs[j >> 12] = crc32c_copy(0, dst + j, src + j, 4096);
+}
+
+/* Append a trace record with the CRCs already at hand */
+static inline void cheeze_trace_crcs(int fd, struct cheeze_req_user *ureq, const uint32_t *crcs)
+{
+	write(fd, ureq, sizeof(*ureq));
+	write(fd, crcs, (ureq->len >> 12) * sizeof(*crcs));
+}
+
+/*
+ * Append a trace record: the descriptor followed by the CRC32C of every
+ * 4 KiB block of buf, or zeroes if buf is NULL.  The CRCs the kernel
+ * computed for writes are used as is, and the ones computed for reads are
+ * published back to the kernel if it asked for them.
+ */
+static inline void cheeze_trace(int fd, struct cheeze_req_user *ureq, const char *buf)
+{
+	uint32_t crcs[CSUMS_PER_SLOT];
+	unsigned int j, nr = ureq->len >> 12;
+
+	if (!buf) {
+		memset(crcs, 0, nr * sizeof(*crcs));
+	} else if (ureq->op == REQ_OP_WRITE && (ureq->flags & CHEEZE_REQ_CSUM)) {
+		memcpy(crcs, cheeze_csums(ureq), nr * sizeof(*crcs));
+	} else {
+		for (j = 0; j < nr; j++)
+			crcs[j] = crc32c(0, buf + (j << 12), 4096);
+		if (ureq->op == REQ_OP_READ && (ureq->flags & CHEEZE_REQ_CSUM)) {
+			memcpy(cheeze_csums(ureq), crcs, nr * sizeof(*crcs));
+			ureq->flags |= CHEEZE_REQ_CSUM_VALID;
+		}
+	}
+
+	cheeze_trace_crcs(fd, ureq, crcs);
+}
+
+/*
+ * Null backend: completes everything without touching data.
+ */
+static const struct cheeze_backend cheeze_null_backend = {
+	.read = NULL,
+};
+
+/*
+ * Memory backend: serves I/O from a mmap()ed file, such as
+ * /dev/hugepages/disk, optionally tracing every request.
+ */
+struct cheeze_mem {
+	char *mem;
+	uint64_t size;
+	int trace_fd; // -1 if not tracing
+};
+
+static inline int cheeze_mem_open(struct cheeze_mem *m, const char *path, int trace_fd)
+{
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: ", path);
+		perror(NULL);
+		return -1;
+	}
+
+	m->size = fdlength(fd);
+	m->mem = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m->mem == MAP_FAILED) {
+		perror("Failed to mmap copy path");
+		return -1;
+	}
+
+	m->trace_fd = trace_fd;
+
+	return 0;
+}
+
+/* NULL with ureq->ret set if the request is beyond the image */
+static inline char *cheeze_mem_addr(struct cheeze_mem *m, struct cheeze_req_user *ureq)
+{
+	uint64_t off = (uint64_t)ureq->pos << CHEEZE_LOGICAL_BLOCK_SHIFT;
+
+	if (off + ureq->len > m->size) {
+		fprintf(stderr, "cheeze_mem: pos %u+%u beyond %lu bytes\n",
+			ureq->pos, ureq->len, m->size);
+		ureq->ret = -EIO;
+		return NULL;
+	}
+
+	return m->mem + off;
+}
+
+static inline int cheeze_mem_read(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct cheeze_mem *m = priv;
+	char *src = cheeze_mem_addr(m, ureq);
+	uint32_t crcs[CSUMS_PER_SLOT], *out = crcs;
+
+	if (!src)
+		return CHEEZE_DONE;
+
+	// Checksum while copying, instead of reading src twice
+	if (ureq->flags & CHEEZE_REQ_CSUM)
+		out = cheeze_csums(ureq);
+	else if (m->trace_fd < 0) {
+		memcpy(buf, src, ureq->len);
+		return CHEEZE_DONE;
+	}
+
+	cheeze_copy_csum(buf, src, ureq->len, out);
+	if (out != crcs)
+		ureq->flags |= CHEEZE_REQ_CSUM_VALID;
+	if (m->trace_fd >= 0)
+		cheeze_trace_crcs(m->trace_fd, ureq, out);
+
+	return CHEEZE_DONE;
+}
+
+static inline int cheeze_mem_write(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct cheeze_mem *m = priv;
+	char *dst = cheeze_mem_addr(m, ureq);
+
+	uint32_t crcs[CSUMS_PER_SLOT];
+
+	if (!dst)
+		return CHEEZE_DONE;
+
+	if (m->trace_fd < 0) {
+		memcpy(dst, buf, ureq->len);
+	} else if (ureq->flags & CHEEZE_REQ_CSUM) {
+		// The kernel already checksummed it
+		memcpy(dst, buf, ureq->len);
+		cheeze_trace_crcs(m->trace_fd, ureq, cheeze_csums(ureq));
+	} else {
+		cheeze_copy_csum(dst, buf, ureq->len, crcs);
+		cheeze_trace_crcs(m->trace_fd, ureq, crcs);
+	}
+
+	return CHEEZE_DONE;
+}
+
+static inline int cheeze_mem_discard(void *priv, struct cheeze_req_user *ureq)
+{
+	struct cheeze_mem *m = priv;
+	char *dst = cheeze_mem_addr(m, ureq);
+
+	if (!dst)
+		return CHEEZE_DONE;
+
+	memset(dst, 0, ureq->len);
+	if (m->trace_fd >= 0)
+		cheeze_trace(m->trace_fd, ureq, NULL);
+
+	return CHEEZE_DONE;
+}
+
+static const struct cheeze_backend cheeze_mem_backend = {
+	.read = cheeze_mem_read,
+	.write = cheeze_mem_write,
+	.discard = cheeze_mem_discard,
+};
+
+#endif
@@ -0,0 +1,484 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Microbenchmarks of the data path primitives.
+ *
+ * Every case runs for at least -t milliseconds and prints one CSV line:
+ *
+ *	case,size,cache,ops,ns_per_op,mb_per_s
+ *
+ * "hot" cases reuse the same buffer, so anything up to the cache size is
+ * served from cache.  "cold" cases walk a POOL_SIZE pool so that every
+ * operation touches memory the previous ones evicted.  The CRC variants
+ * are checked against each other over the pool first, and bench exits with
+ * 1 if they disagree.
+ *
+ * The protocol cases measure the cost per request of handing requests over
+ * through the send flag array, as the daemon scans it, versus a ring of
+ * slot ids, with size requests outstanding per scan, and the round trip of
+ * publishing a size-byte descriptor to another thread and seeing it
+ * complete.  Their mb_per_s is 0.
+ *
+ * With -d, dev_read and dev_write time 4 KiB O_DIRECT I/O on a cheeze
+ * device at queue depth 1, so ns_per_op is the round trip latency.  Run
+ * them with the module loaded with and without bio_mode to compare the
+ * bio path against blk-mq.  dev_write overwrites the device.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <emmintrin.h>
+
+#include "backend.h"
+
+#define POOL_SIZE (512UL * 1024 * 1024)
+
+static const size_t sizes[] = {
+	4096, 16384, 65536, 262144, 1048576, 2097152,
+};
+
+static const unsigned int occupancies[] = {
+	1, 32, 1024,
+};
+
+static uint64_t min_ns = 50 * 1000000ULL;
+static const char *filter;
+static const char *dev;
+static char *pool, *pool2;
+static volatile uint64_t sink;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* bytes is the data touched per op, 0 for the protocol cases */
+static void report(const char *name, size_t size, const char *cache,
+		   uint64_t ops, uint64_t ns, size_t bytes)
+{
+	printf("%s,%zu,%s,%lu,%.2f,%.1f\n", name, size, cache, ops,
+	       (double)ns / ops, (double)bytes * ops / ns * 1000);
+	fflush(stdout);
+}
+
+static inline int skip(const char *name)
+{
+	return filter && !strstr(name, filter);
+}
+
+/* CRC-32C with a single dependency chain, for comparison with crc32c() */
+static uint32_t crc32c_1way(uint32_t crc, void const *buf, size_t len)
+{
+	unsigned char const *next = buf;
+	uint64_t crc0 = ~crc;
+
+	for (; len >= 8; len -= 8, next += 8)
+		__asm__("crc32q\t" "(%1), %0"
+			: "=r"(crc0)
+			: "r"(next), "0"(crc0));
+	for (; len; len--, next++)
+		__asm__("crc32b\t" "(%1), %0"
+			: "=r"(crc0)
+			: "r"(next), "0"(crc0));
+
+	return ~crc0;
+}
+
+/* memcpy() with streaming stores, dst and src 16-byte aligned, len a multiple of 64 */
+static void memcpy_nt(void *dst, const void *src, size_t len)
+{
+	__m128i *d = dst;
+	const __m128i *s = src;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(*d); i += 4) {
+		__m128i a = _mm_load_si128(s + i);
+		__m128i b = _mm_load_si128(s + i + 1);
+		__m128i c = _mm_load_si128(s + i + 2);
+		__m128i e = _mm_load_si128(s + i + 3);
+
+		_mm_stream_si128(d + i, a);
+		_mm_stream_si128(d + i + 1, b);
+		_mm_stream_si128(d + i + 2, c);
+		_mm_stream_si128(d + i + 3, e);
+	}
+	_mm_sfence();
+}
+
+/* Offset of the i-th buffer of size bytes, walking the pool for cold runs */
+static inline size_t buf_off(size_t size, uint64_t i, int cold)
+{
+	return cold ? (i * size) % (POOL_SIZE - size) / 64 * 64 : 0;
+}
+
+static void bench_crc(const char *name, uint32_t (*fn)(uint32_t, void const *, size_t))
+{
+	uint64_t start, ns, ops;
+	uint32_t crc = 0;
+	unsigned int i;
+	int cold;
+
+	if (skip(name))
+		return;
+
+	for (cold = 0; cold < 2; cold++) {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			ops = 0;
+			start = now_ns();
+			do {
+				crc ^= fn(crc, pool + buf_off(sizes[i], ops, cold), sizes[i]);
+				ops++;
+			} while ((ops & 15) || (ns = now_ns() - start) < min_ns);
+			report(name, sizes[i], cold ? "cold" : "hot", ops, ns, sizes[i]);
+		}
+	}
+
+	sink += crc;
+}
+
+static void bench_copy(const char *name, void (*fn)(void *, const void *, size_t))
+{
+	uint64_t start, ns, ops;
+	unsigned int i;
+	size_t off;
+	int cold;
+
+	if (skip(name))
+		return;
+
+	for (cold = 0; cold < 2; cold++) {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			ops = 0;
+			start = now_ns();
+			do {
+				off = buf_off(sizes[i], ops, cold);
+				fn(pool2 + off, pool + off, sizes[i]);
+				ops++;
+			} while ((ops & 15) || (ns = now_ns() - start) < min_ns);
+			report(name, sizes[i], cold ? "cold" : "hot", ops, ns, sizes[i]);
+		}
+	}
+}
+
+static void memcpy_libc(void *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+
+/* What the daemon did before crc32c_copy(): copy, then checksum every 4 KiB block */
+static void memcpy_crc(void *dst, const void *src, size_t len)
+{
+	uint32_t crc = 0;
+	size_t j;
+
+	memcpy(dst, src, len);
+	for (j = 0; j < len; j += 4096)
+		crc ^= crc32c(0, (char *)dst + j, 4096);
+	sink += crc;
+}
+
+static void memcpy_crc_fused(void *dst, const void *src, size_t len)
+{
+	uint32_t crc = 0;
+	size_t j;
+
+	for (j = 0; j < len; j += 4096)
+		crc ^= crc32c_copy(0, (char *)dst + j, (const char *)src + j, 4096);
+	sink += crc;
+}
+
+/* Publish occ requests through the flag array and consume them with a full scan */
+static void bench_flag_scan(void)
+{
+	static volatile uint8_t send[CHEEZE_QUEUE_SIZE];
+	uint64_t start, ns, ops = 0, sum = 0;
+	unsigned int i, j, occ, stride;
+
+	if (skip("flag_scan"))
+		return;
+
+	for (i = 0; i < sizeof(occupancies) / sizeof(occupancies[0]); i++) {
+		occ = occupancies[i];
+		stride = CHEEZE_QUEUE_SIZE / occ;
+		ops = 0;
+		start = now_ns();
+		do {
+			for (j = 0; j < occ; j++)
+				send[j * stride] = 1;
+			for (j = 0; j < CHEEZE_QUEUE_SIZE; j++) {
+				if (!send[j])
+					continue;
+				send[j] = 0;
+				sum += j;
+			}
+			ops += occ;
+		} while ((ns = now_ns() - start) < min_ns);
+		report("flag_scan", occ, "hot", ops, ns, 0);
+	}
+
+	sink += sum;
+}
+
+/* Same, through a single-producer single-consumer ring of slot ids */
+static void bench_ring(void)
+{
+	static volatile uint16_t ring[CHEEZE_QUEUE_SIZE];
+	static volatile uint32_t head, tail;
+	uint64_t start, ns, ops = 0, sum = 0;
+	unsigned int i, j, occ, stride;
+
+	if (skip("ring"))
+		return;
+
+	for (i = 0; i < sizeof(occupancies) / sizeof(occupancies[0]); i++) {
+		occ = occupancies[i];
+		stride = CHEEZE_QUEUE_SIZE / occ;
+		ops = 0;
+		start = now_ns();
+		do {
+			for (j = 0; j < occ; j++) {
+				ring[head % CHEEZE_QUEUE_SIZE] = j * stride;
+				barrier();
+				head = head + 1;
+			}
+			while (tail != head) {
+				sum += ring[tail % CHEEZE_QUEUE_SIZE];
+				barrier();
+				tail = tail + 1;
+			}
+			ops += occ;
+		} while ((ns = now_ns() - start) < min_ns);
+		report("ring", occ, "hot", ops, ns, 0);
+	}
+
+	sink += sum;
+}
+
+/*
+ * Publish a descriptor in a slot of a real metadata layout and wait for
+ * another thread to pick it up and complete it, as the kernel and the
+ * daemon do.  Reported per round trip.
+ */
+static struct cheeze_shm pub_shm;
+static volatile int pub_stop;
+
+static void *publish_peer(void *unused)
+{
+	volatile uint8_t *send = pub_shm.send_event_addr;
+	volatile uint8_t *recv = pub_shm.recv_event_addr;
+	struct cheeze_req_user ureq;
+	uint64_t sum = 0;
+
+	while (!pub_stop) {
+		if (recv[0] || !send[0])
+			continue;
+		barrier();
+		memcpy(&ureq, pub_shm.ureq_addr, sizeof(ureq));
+		sum += ureq.pos + pub_shm.seq_addr[0];
+		barrier();
+		recv[0] = 1;
+	}
+
+	sink += sum;
+	return NULL;
+}
+
+static void bench_publish(void)
+{
+	volatile uint8_t *send, *recv;
+	struct cheeze_req_user ureq = { .op = REQ_OP_READ, .len = 4096 };
+	uint64_t start, ns, ops = 0;
+	pthread_t peer;
+	char *meta;
+
+	if (skip("publish"))
+		return;
+
+	/* Both sides spin, a single CPU only measures the scheduler */
+	if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+		fprintf(stderr, "publish: needs at least 2 CPUs, skipping\n");
+		return;
+	}
+
+	meta = aligned_alloc(4096, (META_SIZE + 4095) & ~4095UL);
+	memset(meta, 0, META_SIZE);
+	cheeze_shm_meta_init(&pub_shm, meta);
+	send = pub_shm.send_event_addr;
+	recv = pub_shm.recv_event_addr;
+
+	pub_stop = 0;
+	pthread_create(&peer, NULL, publish_peer, NULL);
+
+	start = now_ns();
+	do {
+		ureq.pos = ops;
+		memcpy(pub_shm.ureq_addr, &ureq, sizeof(ureq));
+		pub_shm.seq_addr[0] = ops;
+		barrier();
+		send[0] = 1;
+		while (!recv[0])
+			;
+		barrier();
+		send[0] = 0;
+		barrier();
+		recv[0] = 0;
+		ops++;
+	} while ((ops & 255) || (ns = now_ns() - start) < min_ns);
+	report("publish", sizeof(ureq), "hot", ops, ns, 0);
+
+	pub_stop = 1;
+	pthread_join(peer, NULL);
+	free(meta);
+}
+
+/* 4 KiB O_DIRECT I/O on dev at queue depth 1, all at offset 0 or walking the device */
+static void bench_dev(const char *name, int write)
+{
+	uint64_t start, ns, ops, blocks;
+	ssize_t ret;
+	off_t size, off;
+	char *buf;
+	int fd, cold;
+
+	if (!dev || skip(name))
+		return;
+
+	fd = open(dev, (write ? O_WRONLY : O_RDONLY) | O_DIRECT);
+	if (fd < 0) {
+		perror(dev);
+		return;
+	}
+	size = lseek(fd, 0, SEEK_END);
+	blocks = size / 4096;
+	if (!blocks) {
+		fprintf(stderr, "%s: %s is empty, skipping\n", name, dev);
+		close(fd);
+		return;
+	}
+
+	buf = aligned_alloc(4096, 4096);
+	memset(buf, 0x5a, 4096);
+
+	for (cold = 0; cold < 2; cold++) {
+		ops = 0;
+		start = now_ns();
+		do {
+			off = cold ? (ops * 7919 % blocks) * 4096 : 0;
+			ret = write ? pwrite(fd, buf, 4096, off) : pread(fd, buf, 4096, off);
+			if (ret != 4096) {
+				perror(name);
+				goto out;
+			}
+			ops++;
+		} while ((ns = now_ns() - start) < min_ns);
+		report(name, 4096, cold ? "cold" : "hot", ops, ns, 4096);
+	}
+
+out:
+	free(buf);
+	close(fd);
+}
+
+/* The CRC variants must agree before any of them is timed */
+static int check_crc(void)
+{
+	uint64_t x = 88172645463325252ULL;
+	uint32_t hw, hw1, sw;
+	size_t i;
+
+	for (i = 0; i < POOL_SIZE / 8; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		((uint64_t *)pool)[i] = x;
+	}
+
+	/* All of it, then an odd length at an odd offset for the tails */
+	hw = crc32c(0, pool, POOL_SIZE);
+	hw1 = crc32c_1way(0, pool, POOL_SIZE);
+	sw = crc32c_sw(0, pool, POOL_SIZE);
+	if (hw == hw1 && hw == sw) {
+		hw = crc32c(0, pool + 3, 1000003);
+		hw1 = crc32c_1way(0, pool + 3, 1000003);
+		sw = crc32c_sw(0, pool + 3, 1000003);
+	}
+	if (hw != hw1 || hw != sw) {
+		fprintf(stderr, "crc32c mismatch: hw 0x%08x, hw_1way 0x%08x, sw 0x%08x\n",
+			hw, hw1, sw);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-t ms] [-c case] [-d dev]\n"
+		"    -t    minimum run time of each case in milliseconds (default: 50)\n"
+		"    -c    only run cases whose name contains case\n"
+		"    -d    also time 4 KiB I/O on the cheeze device dev, overwriting it\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:c:d:")) != -1) {
+		switch (opt) {
+		case 't':
+			min_ns = strtoull(optarg, NULL, 0) * 1000000ULL;
+			break;
+		case 'c':
+			filter = optarg;
+			break;
+		case 'd':
+			dev = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	pool = aligned_alloc(4096, POOL_SIZE);
+	pool2 = aligned_alloc(4096, POOL_SIZE);
+	if (!pool || !pool2) {
+		perror("aligned_alloc");
+		return 1;
+	}
+	/* Fault everything in and give the CRCs non-zero data */
+	memset(pool, 0x5a, POOL_SIZE);
+	memset(pool2, 0, POOL_SIZE);
+	if (check_crc())
+		return 1;
+
+	printf("case,size,cache,ops,ns_per_op,mb_per_s\n");
+
+	bench_crc("crc32c_hw", crc32c);
+	bench_crc("crc32c_hw_1way", crc32c_1way);
+	bench_crc("crc32c_sw", crc32c_sw);
+	bench_copy("memcpy", memcpy_libc);
+	bench_copy("memcpy_nt", memcpy_nt);
+	bench_copy("memcpy_crc", memcpy_crc);
+	bench_copy("memcpy_crc_fused", memcpy_crc_fused);
+	bench_flag_scan();
+	bench_ring();
+	bench_publish();
+	bench_dev("dev_read", 0);
+	bench_dev("dev_write", 1);
+
+	return 0;
+}
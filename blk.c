@@ -14,14 +14,21 @@
 
 #include <linux/module.h>
 #include <linux/blkdev.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
 #include <linux/genhd.h>
+#endif
 #include <linux/backing-dev.h>
 #include <linux/delay.h>
 #include <linux/completion.h>
 #include <linux/blk-mq.h>
+#include <linux/uaccess.h>
 
 #include "cheeze.h"
 
+#define CREATE_TRACE_POINTS
+#include "cheeze_trace.h"
+
 // cheeze is intentionally designed to expose 1 disk only
 
 /* Globals */
@@ -31,7 +38,49 @@ static u64 cheeze_disksize;
 static struct page *swap_header_page;
 static struct blk_mq_tag_set tag_set;
 
-struct class *cheeze_chr_class;
+/* blk-mq per-request data, points back at the slot serving the request */
+struct cheeze_rq_pdu {
+	struct cheeze_req *req;
+};
+
+/* Dedicated HCTX_TYPE_POLL queues for io_uring IOPOLL / RWF_HIPRI users */
+static unsigned int poll_queues;
+module_param(poll_queues, uint, 0444);
+
+/*
+ * Expose a host-managed zoned device of zone_size_mb zones.  The daemon
+ * keeps the zone state in the shm zone table and serves zone append and
+ * management requests, see struct cheeze_zone.
+ */
+static unsigned int zone_size_mb;
+module_param(zone_size_mb, uint, 0444);
+
+/*
+ * Take bios straight from submit_bio() and publish them in shm, without
+ * blk-mq tags, scheduler, plugging and completion IPIs.  Bios are split
+ * to the slot size, completions run wherever they are reaped, and there
+ * is no request timeout to fail requests of a dead daemon.
+ */
+static bool bio_mode;
+module_param(bio_mode, bool, 0444);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define cheeze_mode_t blk_mode_t
+#define CHEEZE_OPEN_WRITE BLK_OPEN_WRITE
+
+static int cheeze_open(struct gendisk *gdisk, blk_mode_t mode)
+{
+	pr_info("%s\n", __func__);
+	return 0;
+}
+
+static void cheeze_release(struct gendisk *gdisk)
+{
+	pr_info("%s\n", __func__);
+}
+#else
+#define cheeze_mode_t fmode_t
+#define CHEEZE_OPEN_WRITE FMODE_WRITE
 
 static int cheeze_open(struct block_device *dev, fmode_t mode)
 {
@@ -43,15 +92,64 @@ static void cheeze_release(struct gendisk *gdisk, fmode_t mode)
 {
 	pr_info("%s\n", __func__);
 }
+#endif
 
-static int cheeze_ioctl(struct block_device *bdev, fmode_t mode, unsigned cmd,
+static int cheeze_ioctl(struct block_device *bdev, cheeze_mode_t mode, unsigned cmd,
 		   unsigned long arg)
 {
+	struct cheeze_kv_cmd kv;
+	int ret;
+
+	switch (cmd) {
+	case CHEEZE_IOC_KV:
+		if (copy_from_user(&kv, (void __user *)arg, sizeof(kv)))
+			return -EFAULT;
+		if ((kv.op == CHEEZE_OP_KV_PUT || kv.op == CHEEZE_OP_KV_DELETE) &&
+		    !(mode & CHEEZE_OPEN_WRITE))
+			return -EBADF;
+		ret = cheeze_kv(&kv);
+		if (copy_to_user((void __user *)arg, &kv, sizeof(kv)))
+			return -EFAULT;
+		return ret;
+	}
+
 	pr_info("ioctl cmd 0x%08x\n", cmd);
 
 	return -ENOTTY;
 }
 
+/*
+ * Single-page I/O, mostly swap, served synchronously by spinning on the
+ * daemon instead of going through a request.  .rw_page is gone in 6.3.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+#define CHEEZE_RW_PAGE
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+typedef enum req_op cheeze_rw_op_t;
+#else
+typedef unsigned int cheeze_rw_op_t;
+#endif
+
+static int cheeze_rw_page_op(struct block_device *bdev, sector_t sector,
+			     struct page *page, cheeze_rw_op_t op)
+{
+	bool write = op_is_write(op);
+	int ret;
+
+	// Zone writes have to go through the scheduler
+	if (PageTransHuge(page) || zone_size_mb)
+		return -EOPNOTSUPP;
+
+	ret = cheeze_rw_page(page, sector, write);
+	if (ret)
+		return ret;
+
+	page_endio(page, write, 0);
+	return 0;
+}
+#endif
+
 /* Serve requests */
 static int do_request(struct request *rq)
 {
@@ -59,23 +157,33 @@ static int do_request(struct request *rq)
 	uint64_t seq;
 	struct cheeze_req *req;
 
-	seq = cheeze_push(rq, &req);
-	id = req->user.id;
-	if (unlikely(id < 0)) {
-		if (id == SKIP)
+	// No shm until page_addr2 is set or /dev/cheeze-ctl is opened
+	if (unlikely(!cheeze_shm_ready())) {
+		blk_mq_end_request(rq, BLK_STS_IOERR);
+		return 0;
+	}
+
+	seq = cheeze_push(rq, NULL, &req);
+	if (unlikely((int64_t)seq < 0)) {
+		if (seq == SKIP) {
+			blk_mq_end_request(rq, BLK_STS_OK);
 			return 0;
-		return id;
+		}
+		return seq;
 	}
 
-	if (req->user.op == WRITE)
+	id = req->user.id;
+	((struct cheeze_rq_pdu *)blk_mq_rq_to_pdu(rq))->req = req;
+
+	if (req->user.op == WRITE || req->user.op == CHEEZE_OP_ZONE_APPEND)
 		cheeze_do_request(req);
 
+	cheeze_lat_start(req);
 	send_req(req, id, seq);
 
 	//wait_for_completion(&req->acked);
 
 	//ret = req->ret;
-	req->id = id;
 	ret = 0;
 	//cheeze_move_pop(id);
 
@@ -100,15 +208,189 @@ static blk_status_t queue_rq(struct blk_mq_hw_ctx *hctx,
 	return ret;
 }
 
+static void cheeze_bio_request(struct bio *bio)
+{
+	struct cheeze_req *req;
+	uint64_t seq;
+
+	if (unlikely(!cheeze_shm_ready())) {
+		bio_io_error(bio);
+		return;
+	}
+
+	// Empty flushes, as cheeze_push() ignores REQ_OP_FLUSH
+	if (unlikely(!bio->bi_iter.bi_size)) {
+		bio_endio(bio);
+		return;
+	}
+
+	seq = cheeze_push(NULL, bio, &req);
+	if (unlikely((int64_t)seq < 0)) {
+		if (seq != SKIP)
+			bio->bi_status = errno_to_blk_status(seq);
+		bio_endio(bio);
+		return;
+	}
+
+	if (req->user.op == WRITE)
+		cheeze_do_request(req);
+
+	cheeze_lat_start(req);
+	send_req(req, req->id, seq);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+#define cheeze_qc_t void
+#define CHEEZE_QC_T_NONE
+#else
+#define cheeze_qc_t blk_qc_t
+#define CHEEZE_QC_T_NONE BLK_QC_T_NONE
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+static cheeze_qc_t cheeze_submit_bio(struct bio *bio)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	bio = bio_split_to_limits(bio);
+	if (!bio)
+		return CHEEZE_QC_T_NONE;
+#else
+	blk_queue_split(&bio);
+#endif
+	cheeze_bio_request(bio);
+
+	return CHEEZE_QC_T_NONE;
+}
+#else
+static blk_qc_t cheeze_make_request(struct request_queue *q, struct bio *bio)
+{
+	blk_queue_split(q, &bio);
+	cheeze_bio_request(bio);
+
+	return BLK_QC_T_NONE;
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+#define CHEEZE_MQ_F_SG_MERGE BLK_MQ_F_SG_MERGE
+#else
+#define CHEEZE_MQ_F_SG_MERGE 0
+#endif
+
+// Merging is the default from 6.14
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+#define CHEEZE_MQ_F_SHOULD_MERGE BLK_MQ_F_SHOULD_MERGE
+#else
+#define CHEEZE_MQ_F_SHOULD_MERGE 0
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+#define cheeze_map_t void
+#define CHEEZE_MAP_OK
+#else
+#define cheeze_map_t int
+#define CHEEZE_MAP_OK 0
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+static cheeze_map_t cheeze_map_queues(struct blk_mq_tag_set *set)
+{
+	int i, qoff;
+
+	for (i = 0, qoff = 0; i < set->nr_maps; i++) {
+		struct blk_mq_queue_map *map = &set->map[i];
+
+		switch (i) {
+		case HCTX_TYPE_DEFAULT:
+			map->nr_queues = 1;
+			break;
+		case HCTX_TYPE_POLL:
+			map->nr_queues = poll_queues;
+			break;
+		default:
+			map->nr_queues = 0;
+			continue;
+		}
+
+		map->queue_offset = qoff;
+		qoff += map->nr_queues;
+		blk_mq_map_queues(map);
+	}
+
+	return CHEEZE_MAP_OK;
+}
+#endif
+
+/*
+ * Requests stay parked in shm while a daemon is alive or may still be
+ * restarting.  Without one for restart_grace_ms they are failed.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+static enum blk_eh_timer_return cheeze_timeout(struct request *rq)
+#else
+static enum blk_eh_timer_return cheeze_timeout(struct request *rq, bool reserved)
+#endif
+{
+	struct cheeze_rq_pdu *pdu = blk_mq_rq_to_pdu(rq);
+
+	if (cheeze_daemon_alive())
+		return BLK_EH_RESET_TIMER;
+
+	if (!cheeze_cancel_req(pdu->req))
+		return BLK_EH_RESET_TIMER;
+
+	pr_warn_ratelimited("no daemon, failing request id=%d\n", pdu->req->id);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+	blk_mq_complete_request(rq);
+
+	return BLK_EH_DONE;
+#else
+	// blk-mq completes it through ->complete
+	return BLK_EH_HANDLED;
+#endif
+}
+
+static void cheeze_complete_rq(struct request *rq)
+{
+	struct cheeze_rq_pdu *pdu = blk_mq_rq_to_pdu(rq);
+
+	cheeze_end_req(pdu->req);
+}
+
 static const struct blk_mq_ops mq_ops = {
 	.queue_rq = queue_rq,
+	.complete = cheeze_complete_rq,
+	.timeout = cheeze_timeout,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	.map_queues = cheeze_map_queues,
+	.poll = cheeze_poll,
+#endif
 };
 
 static const struct block_device_operations cheeze_fops = {
 	.owner = THIS_MODULE,
 	.open = cheeze_open,
 	.release = cheeze_release,
-	.ioctl = cheeze_ioctl
+	.ioctl = cheeze_ioctl,
+#ifdef CHEEZE_RW_PAGE
+	.rw_page = cheeze_rw_page_op,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	.report_zones = cheeze_report_zones,
+#endif
+};
+
+static const struct block_device_operations cheeze_bio_fops = {
+	.owner = THIS_MODULE,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	.submit_bio = cheeze_submit_bio,
+#endif
+	.open = cheeze_open,
+	.release = cheeze_release,
+	.ioctl = cheeze_ioctl,
+#ifdef CHEEZE_RW_PAGE
+	.rw_page = cheeze_rw_page_op,
+#endif
 };
 
 static ssize_t disksize_show(struct device *dev,
@@ -134,6 +416,8 @@ static ssize_t disksize_store(struct device *dev,
 	}
 
 	cheeze_disksize = PAGE_ALIGN(disksize);
+	if (zone_size_mb)
+		cheeze_disksize = rounddown(disksize, (u64)zone_size_mb << 20);
 	if (!cheeze_disksize) {
 		pr_err("disksize is invalid (disksize = %llu)\n", cheeze_disksize);
 
@@ -142,8 +426,32 @@ static ssize_t disksize_store(struct device *dev,
 		return -EINVAL;
 	}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	if (zone_size_mb) {
+		ret = cheeze_zones_init((cheeze_disksize >> 20) / zone_size_mb,
+					((u64)zone_size_mb << 20) >> CHEEZE_LOGICAL_BLOCK_SHIFT);
+		if (ret) {
+			pr_err("failed to set up zones: %d\n", ret);
+			cheeze_disksize = 0;
+			return ret;
+		}
+	}
+#endif
+
 	set_capacity(cheeze_disk, cheeze_disksize >> SECTOR_SHIFT);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	if (zone_size_mb) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		ret = blk_revalidate_disk_zones(cheeze_disk);
+#else
+		ret = blk_revalidate_disk_zones(cheeze_disk, NULL);
+#endif
+		if (ret)
+			return ret;
+	}
+#endif
+
 	return len;
 }
 
@@ -158,89 +466,267 @@ static const struct attribute_group cheeze_disk_attr_group = {
 	.attrs = cheeze_disk_attrs,
 };
 
-#ifndef blk_mq_init_sq_queue
 /*
- * Helper for setting up a queue with mq ops, given queue depth, and
- * the passed in mq ops flags.
+ * One default hctx, plus poll_queues HCTX_TYPE_POLL hctxs whose requests
+ * are only completed through cheeze_poll().
+ */
+static int cheeze_init_tag_set(struct blk_mq_tag_set *set, unsigned int queue_depth)
+{
+	memset(set, 0, sizeof(*set));
+	set->ops = &mq_ops;
+	set->nr_hw_queues = 1;
+	set->queue_depth = queue_depth;
+	set->numa_node = NUMA_NO_NODE;
+	set->cmd_size = sizeof(struct cheeze_rq_pdu);
+	set->flags = CHEEZE_MQ_F_SHOULD_MERGE | CHEEZE_MQ_F_SG_MERGE;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	if (poll_queues) {
+		set->nr_hw_queues += poll_queues;
+		set->nr_maps = HCTX_MAX_TYPES;
+	}
+#else
+	if (poll_queues)
+		pr_warn("poll_queues requires Linux 5.0 or later, ignoring\n");
+#endif
+
+	return blk_mq_alloc_tag_set(set);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
+#define cheeze_queue_flag_set(flag, q) queue_flag_set_unlocked(flag, q)
+#define cheeze_queue_flag_clear(flag, q) queue_flag_clear_unlocked(flag, q)
+#else
+#define cheeze_queue_flag_set(flag, q) blk_queue_flag_set(flag, q)
+#define cheeze_queue_flag_clear(flag, q) blk_queue_flag_clear(flag, q)
+#endif
+
+/*
+ * To ensure that we always get PAGE_SIZE aligned and n*PAGE_SIZED sized
+ * I/O requests, up to 512 * 4096 = 2MiB.  From 6.9 the limits are passed
+ * in when allocating the disk, before that they are set on its queue.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+static void cheeze_init_limits(struct queue_limits *lim)
+{
+	memset(lim, 0, sizeof(*lim));
+	lim->physical_block_size = PAGE_SIZE;
+	lim->logical_block_size = CHEEZE_LOGICAL_BLOCK_SIZE;
+	lim->io_min = PAGE_SIZE;
+	lim->max_hw_sectors = 4096;
+
+	lim->discard_granularity = PAGE_SIZE;
+	lim->max_hw_discard_sectors = 4096;
+	lim->max_write_zeroes_sectors = 4096;
+
+	if (zone_size_mb) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+		lim->features |= BLK_FEAT_ZONED;
+#else
+		lim->zoned = true;
+#endif
+		lim->chunk_sectors = zone_size_mb << (20 - SECTOR_SHIFT);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+		lim->max_hw_zone_append_sectors = 4096;
+#else
+		lim->max_zone_append_sectors = 4096;
+#endif
+	}
+}
+#else
+static void cheeze_set_limits(struct request_queue *q)
+{
+	blk_queue_physical_block_size(q, PAGE_SIZE);
+	blk_queue_logical_block_size(q, CHEEZE_LOGICAL_BLOCK_SIZE);
+	blk_queue_io_min(q, PAGE_SIZE);
+	blk_queue_max_hw_sectors(q, 4096);
+
+	q->limits.discard_granularity = PAGE_SIZE;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+	cheeze_queue_flag_set(QUEUE_FLAG_DISCARD, q);
+#endif
+	blk_queue_max_discard_sectors(q, 4096);
+	blk_queue_max_write_zeroes_sectors(q, 4096);
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 14, 0)
+static struct request_queue *cheeze_init_bio_queue(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	return blk_alloc_queue(NUMA_NO_NODE);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0)
+	return blk_alloc_queue(cheeze_make_request, NUMA_NO_NODE);
+#else
+	struct request_queue *q = blk_alloc_queue(GFP_KERNEL);
+
+	if (q)
+		blk_queue_make_request(q, cheeze_make_request);
+	return q;
+#endif
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+/*
+ * What is not a queue limit yet.  From 6.10 zone write plugging keeps
+ * writes in order without the elevator, and reset all is always supported.
  */
-static struct request_queue *blk_mq_init_sq_queue(struct blk_mq_tag_set *set,
-                                          const struct blk_mq_ops *ops,
-                                          unsigned int queue_depth,
-                                          unsigned int set_flags)
+static void cheeze_set_zoned(struct gendisk *disk)
 {
-       struct request_queue *q;
-       int ret;
-
-       memset(set, 0, sizeof(*set));
-       set->ops = ops;
-       set->nr_hw_queues = 1;
-       set->queue_depth = queue_depth;
-       set->numa_node = NUMA_NO_NODE;
-       set->flags = set_flags;
-
-       ret = blk_mq_alloc_tag_set(set);
-       if (ret)
-               return ERR_PTR(ret);
-
-       q = blk_mq_init_queue(set);
-       if (IS_ERR(q)) {
-               blk_mq_free_tag_set(set);
-               return q;
-       }
-
-       return q;
+	struct request_queue *q = disk->queue;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	disk_set_zoned(disk);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+	disk_set_zoned(disk, BLK_ZONED_HM);
+#else
+	blk_queue_set_zoned(disk, BLK_ZONED_HM);
+#endif
+	blk_queue_chunk_sectors(q, zone_size_mb << (20 - SECTOR_SHIFT));
+	blk_queue_max_zone_append_sectors(q, 4096);
+#endif
+	blk_queue_flag_set(QUEUE_FLAG_ZONE_RESETALL, q);
+	/* Keeps at most one write per zone in flight */
+	blk_queue_required_elevator_features(q, ELEVATOR_F_ZBD_SEQ_WRITE);
 }
 #endif
 
+/*
+ * The gendisk and its queue, blk-mq or bio based.  From 5.14 they are
+ * allocated together and the disk owns the queue.
+ */
+static struct gendisk *cheeze_alloc_disk(void)
+{
+	struct gendisk *disk;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	struct queue_limits lim;
+#endif
+	int ret;
+
+	if (!bio_mode) {
+		ret = cheeze_init_tag_set(&tag_set, 1024);
+		if (ret)
+			return ERR_PTR(ret);
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	cheeze_init_limits(&lim);
+	if (bio_mode)
+		disk = blk_alloc_disk(&lim, NUMA_NO_NODE);
+	else
+		disk = blk_mq_alloc_disk(&tag_set, &lim, NULL);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+	if (bio_mode)
+		disk = blk_alloc_disk(NUMA_NO_NODE);
+	else
+		disk = blk_mq_alloc_disk(&tag_set, NULL);
+#else
+	disk = alloc_disk(1);
+	if (disk) {
+		if (bio_mode)
+			disk->queue = cheeze_init_bio_queue();
+		else
+			disk->queue = blk_mq_init_queue(&tag_set);
+		if (IS_ERR_OR_NULL(disk->queue)) {
+			put_disk(disk);
+			disk = NULL;
+		}
+	}
+#endif
+	if (IS_ERR_OR_NULL(disk)) {
+		if (!bio_mode)
+			blk_mq_free_tag_set(&tag_set);
+		return disk ? disk : ERR_PTR(-ENOMEM);
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+	disk->minors = 1;
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+	cheeze_set_limits(disk->queue);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+	if (zone_size_mb)
+		cheeze_set_zoned(disk);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+	/* cheeze devices sort of resembles non-rotational disks, the default from 6.11 */
+	cheeze_queue_flag_set(QUEUE_FLAG_NONROT, disk->queue);
+	cheeze_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, disk->queue);
+#endif
+
+	return disk;
+}
+
+/* Undo cheeze_alloc_disk(), after del_gendisk() if the disk was added */
+static void cheeze_free_disk(struct gendisk *disk)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	put_disk(disk);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+	blk_cleanup_disk(disk);
+#else
+	blk_cleanup_queue(disk->queue);
+	put_disk(disk);
+#endif
+	if (!bio_mode)
+		blk_mq_free_tag_set(&tag_set);
+}
+
 static int create_device(void)
 {
 	int ret;
 
-	/* gendisk structure */
-	cheeze_disk = alloc_disk(1);
-	if (!cheeze_disk) {
-		pr_err("%s %d: Error allocating disk structure for device\n",
-		       __func__, __LINE__);
-		ret = -ENOMEM;
-		goto out;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	if (zone_size_mb && !is_power_of_2(zone_size_mb)) {
+		pr_warn("zone_size_mb must be a power of 2, ignoring\n");
+		zone_size_mb = 0;
+	}
+#else
+	if (zone_size_mb) {
+		pr_warn("zone_size_mb requires Linux 5.9 or later, ignoring\n");
+		zone_size_mb = 0;
 	}
+#endif
 
-	cheeze_disk->queue = blk_mq_init_sq_queue(&tag_set, &mq_ops, 1024, BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_SG_MERGE);
-	if (!cheeze_disk->queue) {
-		pr_err("%s %d: Error allocating disk queue for device\n",
-		       __func__, __LINE__);
-		ret = -ENOMEM;
-		goto out_put_disk;
+	// Zone writes are kept in order by the blk-mq scheduler
+	if (bio_mode && zone_size_mb) {
+		pr_warn("zone_size_mb requires blk-mq, ignoring bio_mode\n");
+		bio_mode = false;
 	}
 
-	// blk_queue_make_request(cheeze_disk->queue, cheeze_make_request);
+	/* gendisk structure */
+	cheeze_disk = cheeze_alloc_disk();
+	if (IS_ERR(cheeze_disk)) {
+		pr_err("%s %d: Error allocating disk for device\n",
+		       __func__, __LINE__);
+		ret = PTR_ERR(cheeze_disk);
+		cheeze_disk = NULL;
+		return ret;
+	}
 
 	cheeze_disk->major = cheeze_major;
 	cheeze_disk->first_minor = 0;
-	cheeze_disk->fops = &cheeze_fops;
+	cheeze_disk->fops = bio_mode ? &cheeze_bio_fops : &cheeze_fops;
 	cheeze_disk->private_data = NULL;
 	snprintf(cheeze_disk->disk_name, 16, "cheeze%d", 0);
 
 	/* Actual capacity set using sysfs (/sys/block/cheeze<id>/disksize) */
 	set_capacity(cheeze_disk, 0);
 
-	/*
-	 * To ensure that we always get PAGE_SIZE aligned
-	 * and n*PAGE_SIZED sized I/O requests.
-	 */
-	blk_queue_physical_block_size(cheeze_disk->queue, PAGE_SIZE);
-	blk_queue_logical_block_size(cheeze_disk->queue,
-				     CHEEZE_LOGICAL_BLOCK_SIZE);
-	blk_queue_io_min(cheeze_disk->queue, PAGE_SIZE);
-	blk_queue_max_hw_sectors(cheeze_disk->queue, 4096); // 512 * 4096 = 2MiB
-
-	// Set discard capability
-	cheeze_disk->queue->limits.discard_granularity = PAGE_SIZE;
-	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, cheeze_disk->queue);
-	blk_queue_max_discard_sectors(cheeze_disk->queue, 4096); // 512 * 4096 = 2MiB
-	blk_queue_max_write_zeroes_sectors(cheeze_disk->queue, 4096); // 512 * 4096 = 2MiB
-
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	ret = add_disk(cheeze_disk);
+	if (ret) {
+		pr_err("%s %d: Error adding disk\n", __func__, __LINE__);
+		goto out_free_disk;
+	}
+#else
 	add_disk(cheeze_disk);
+#endif
 
 	cheeze_disksize = 0;
 
@@ -249,21 +735,18 @@ static int create_device(void)
 	if (ret < 0) {
 		pr_err("%s %d: Error creating sysfs group\n",
 		       __func__, __LINE__);
-		goto out_free_queue;
+		goto out_del_disk;
 	}
 
-	/* cheeze devices sort of resembles non-rotational disks */
-	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, cheeze_disk->queue);
-	queue_flag_clear_unlocked(QUEUE_FLAG_ADD_RANDOM, cheeze_disk->queue);
-
-out:
-	return ret;
-
-out_free_queue:
-	blk_cleanup_queue(cheeze_disk->queue);
+	return 0;
 
-out_put_disk:
-	put_disk(cheeze_disk);
+out_del_disk:
+	del_gendisk(cheeze_disk);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+out_free_disk:
+#endif
+	cheeze_free_disk(cheeze_disk);
+	cheeze_disk = NULL;
 
 	return ret;
 }
@@ -278,11 +761,8 @@ static void destroy_device(void)
 	sysfs_remove_group(&disk_to_dev(cheeze_disk)->kobj,
 			   &cheeze_disk_attr_group);
 
-	if (cheeze_disk->queue)
-		blk_cleanup_queue(cheeze_disk->queue);
-
 	del_gendisk(cheeze_disk);
-	put_disk(cheeze_disk);
+	cheeze_free_disk(cheeze_disk);
 
 	cheeze_disk = NULL;
 }
@@ -313,11 +793,36 @@ static int __init cheeze_init(void)
 		goto nomem;
 	}
 	cheeze_queue_init();
+
+	ret = cheeze_copy_init();
+	if (ret) {
+		pr_err("%s %d: Unable to allocate read copy workers\n", __func__, __LINE__);
+		goto free_reqs;
+	}
+
+	ret = cheeze_lat_init();
+	if (ret) {
+		pr_err("%s %d: Unable to allocate latency timers\n", __func__, __LINE__);
+		goto free_copy;
+	}
+
+	ret = cheeze_chr_init_module();
+	if (ret) {
+		pr_err("%s %d: Unable to register /dev/cheeze-ctl\n", __func__, __LINE__);
+		goto free_lat;
+	}
 	//for (i = 0; i < CHEEZE_QUEUE_SIZE; i++)
 	//	init_completion(&reqs[i].acked);
 
 	return 0;
 
+free_lat:
+	cheeze_lat_exit();
+free_copy:
+	cheeze_copy_exit();
+free_reqs:
+	cheeze_queue_exit();
+	kfree(reqs);
 nomem:
 	destroy_device();
 free_devices:
@@ -326,15 +831,26 @@ out:
 	return ret;
 }
 
+/*
+ * In reverse init order: the disk first, which drains it, then everything
+ * that may still complete a request, kshm, the latency timers and the copy
+ * workers, and only then the shm regions and reqs they touch.
+ */
 static void __exit cheeze_exit(void)
 {
-	cheeze_queue_exit();
-
-	kfree(reqs);
+	destroy_device();
 
 	shm_exit();
 
-	destroy_device();
+	cheeze_lat_exit();
+
+	cheeze_copy_exit();
+
+	cheeze_chr_cleanup_module();
+
+	cheeze_queue_exit();
+
+	kfree(reqs);
 
 	unregister_blkdev(cheeze_major, "cheeze");
 
@@ -6,6 +6,8 @@
 #ifndef __CHEEZE_H
 #define __CHEEZE_H
 
+#include <linux/ioctl.h>
+
 #define SECTOR_SHIFT		9
 #define SECTOR_SIZE		(1 << SECTOR_SHIFT)
 #define SECTORS_PER_PAGE_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
@@ -33,7 +35,66 @@
 #define SEQ_SIZE (CHEEZE_QUEUE_SIZE * sizeof(uint64_t))
 
 #define REQS_OFF (SEQ_OFF + SEQ_SIZE)
-#define REQS_SIZE (CHEEZE_QUEUE_SIZE * sizeof(struct cheeze_req))
+#define REQS_SIZE (CHEEZE_QUEUE_SIZE * sizeof(struct cheeze_req_user))
+
+#define CTL_OFF (REQS_OFF + REQS_SIZE)
+#define CTL_SIZE (sizeof(struct cheeze_shm_ctl))
+
+/* CRC32C of every 4 KiB block of every slot, see CHEEZE_REQ_CSUM */
+#define CSUMS_PER_SLOT (CHEEZE_BUF_SIZE >> CHEEZE_LOGICAL_BLOCK_SHIFT)
+#define CSUM_OFF ((CTL_OFF + CTL_SIZE + 63) & ~63ULL)
+#define CSUM_SIZE (CHEEZE_QUEUE_SIZE * CSUMS_PER_SLOT * sizeof(uint32_t)) // 2MB
+
+/* Zone table of the zoned mode, see struct cheeze_zone */
+#define CHEEZE_MAX_ZONES 65536
+#define ZONES_OFF (CSUM_OFF + CSUM_SIZE)
+#define ZONES_SIZE (CHEEZE_MAX_ZONES * sizeof(struct cheeze_zone)) // 2MB
+
+/* Per slot zone op log of the daemon, see struct cheeze_zone_log */
+#define ZLOG_OFF (ZONES_OFF + ZONES_SIZE)
+#define ZLOG_SIZE (CHEEZE_QUEUE_SIZE * sizeof(struct cheeze_zone_log)) // 32KB
+
+/* Only this much of the metadata hugepage is used, and cleared on init */
+#define META_SIZE (ZLOG_OFF + ZLOG_SIZE)
+
+/*
+ * mmap() layout of /dev/cheeze-ctl: the metadata at 0 and the data slots
+ * back to back from CHEEZE_CTL_DATA_OFF.
+ */
+#define CHEEZE_CTL_PATH "/dev/cheeze-ctl"
+#define CHEEZE_CTL_META_SIZE ((META_SIZE + CHEEZE_BUF_SIZE - 1) & ~(CHEEZE_BUF_SIZE - 1))
+#define CHEEZE_CTL_DATA_OFF HP_SIZE
+#define CHEEZE_CTL_DATA_SIZE (CHEEZE_QUEUE_SIZE * CHEEZE_BUF_SIZE)
+
+/*
+ * A daemon attaches with this ioctl on /dev/cheeze-ctl before mapping the
+ * regions, and gets the new generation.  Every mapping made before is torn
+ * down first, so the daemon it supersedes faults with SIGBUS instead of
+ * completing a slot the new one serves again.  io_uring commands on an
+ * fd of an older generation, or one that never attached, fail with -ESTALE.
+ */
+#define CHEEZE_IOC_ATTACH _IOR('C', 0x02, uint64_t)
+
+/*
+ * IORING_OP_URING_CMD commands on /dev/cheeze-ctl, with a struct
+ * cheeze_uring_cmd in sqe->cmd.
+ *
+ * FETCH completes with 0 once a request is outstanding in slot id, or with
+ * -EAGAIN if none came for a second or a new daemon attached, and must
+ * then be submitted again.
+ * COMMIT_AND_FETCH reaps the request the daemon completed in slot id, by
+ * setting its recv flag as usual, and fetches the next one.  Only one
+ * command may wait on a slot at a time.
+ */
+#define CHEEZE_URING_CMD_FETCH 0x01
+#define CHEEZE_URING_CMD_COMMIT_AND_FETCH 0x02
+
+struct cheeze_uring_cmd {
+	uint32_t id;
+	uint32_t reserved;
+};
+
+#define CHEEZE_SHM_MAGIC 0x657a65656863ULL // "cheeze"
 
 #define SKIP INT_MIN
 
@@ -46,21 +107,199 @@
   #define msleep_dbg(...) ((void)0)
 #endif
 
-#define ureq_print(u) \
-	do { \
-		pr_debug("%s:%d\n    id=%d\n    op=%d\n    pos=%u\n    len=%u\n", __func__, __LINE__, u.id, u.op, u.pos, u.len); \
-	} while (0);
+/*
+ * Request flags forwarded to the daemon.
+ * These are stable across kernel versions, unlike rq->cmd_flags.
+ */
+#define CHEEZE_REQ_SYNC		(1U << 0)
+#define CHEEZE_REQ_META		(1U << 1)
+#define CHEEZE_REQ_PRIO		(1U << 2)
+#define CHEEZE_REQ_FUA		(1U << 3)
+#define CHEEZE_REQ_PREFLUSH	(1U << 4)
+#define CHEEZE_REQ_BACKGROUND	(1U << 5)
+#define CHEEZE_REQ_RAHEAD	(1U << 6)
+#define CHEEZE_REQ_SWAP		(1U << 7)
+/*
+ * The slot's checksum area holds the CRC32C of each 4 KiB block.  Set by the
+ * kernel on writes, where it computed them while copying in.  On reads it
+ * asks the daemon to fill them, and the daemon sets CSUM_VALID if it did so
+ * the kernel verifies them while copying out.
+ */
+#define CHEEZE_REQ_CSUM		(1U << 8)
+#define CHEEZE_REQ_CSUM_VALID	(1U << 9)
+
+/*
+ * Zoned mode operations.  The kernel's REQ_OP_ZONE_* values changed across
+ * versions, these don't.  Reads, writes and discards keep REQ_OP_* values.
+ */
+#define CHEEZE_OP_ZONE_APPEND		64
+#define CHEEZE_OP_ZONE_RESET		65
+#define CHEEZE_OP_ZONE_RESET_ALL	66
+#define CHEEZE_OP_ZONE_OPEN		67
+#define CHEEZE_OP_ZONE_CLOSE		68
+#define CHEEZE_OP_ZONE_FINISH		69
+
+/*
+ * Key-value commands, submitted with the CHEEZE_IOC_KV ioctl on the disk
+ * and passed to the daemon in a slot laid out as a struct cheeze_kv_hdr,
+ * the key at CHEEZE_KV_KEY_OFF and the value at CHEEZE_KV_VALUE_OFF.
+ *
+ * PUT stores value under key, GET returns it and DELETE removes it, all
+ * failing with -ENOENT for a missing key.  ITER returns the pair after
+ * cursor, 0 to start with, and the cursor to continue from, or -ENOENT
+ * after the last one.  The order is up to the daemon and a cursor may
+ * skip or repeat pairs if the store changes in between.  GET and ITER fail
+ * with -ENOSPC, and set value_len to the needed size, if the value does
+ * not fit in value_len.  ITER needs room for CHEEZE_KV_MAX_KEY in key.
+ */
+#define CHEEZE_OP_KV_PUT		80
+#define CHEEZE_OP_KV_GET		81
+#define CHEEZE_OP_KV_DELETE		82
+#define CHEEZE_OP_KV_ITER		83
+
+#define CHEEZE_KV_MAX_KEY	1024
+#define CHEEZE_KV_KEY_OFF	64
+#define CHEEZE_KV_VALUE_OFF	4096
+#define CHEEZE_KV_MAX_VALUE	(CHEEZE_BUF_SIZE - CHEEZE_KV_VALUE_OFF)
+
+struct cheeze_kv_hdr {
+	uint64_t cursor;	// ITER, in and out
+	uint32_t key_len;	// out for ITER
+	uint32_t value_len;	// PUT: in, GET and ITER: room in, size out
+} __attribute__((aligned(8)));
+
+struct cheeze_kv_cmd {
+	uint32_t op;		// CHEEZE_OP_KV_*
+	uint32_t key_len;
+	uint32_t value_len;
+	uint32_t reserved;
+	uint64_t cursor;
+	uint64_t key;		// user pointers
+	uint64_t value;
+} __attribute__((aligned(8)));
+
+#define CHEEZE_IOC_KV _IOWR('C', 0x01, struct cheeze_kv_cmd)
 
 struct cheeze_req_user {
 	int id;
 	int op;
-	unsigned int pos; // sector_t but divided by 4096
+	unsigned int pos; // sector_t but divided by 4096, where a zone append landed on completion
 	unsigned int len;
+	unsigned int flags; // CHEEZE_REQ_*
+	unsigned int ioprio; // req_get_ioprio(), IOPRIO_PRIO_VALUE() encoded
+	int ret; // set by the daemon, 0 or -errno
 } __attribute__((aligned(8), packed));
 
+/* Same values as BLK_ZONE_COND_* */
+#define CHEEZE_ZONE_COND_NOT_WP		0x0
+#define CHEEZE_ZONE_COND_EMPTY		0x1
+#define CHEEZE_ZONE_COND_IMP_OPEN	0x2
+#define CHEEZE_ZONE_COND_EXP_OPEN	0x3
+#define CHEEZE_ZONE_COND_CLOSED		0x4
+#define CHEEZE_ZONE_COND_READONLY	0xD
+#define CHEEZE_ZONE_COND_FULL		0xE
+#define CHEEZE_ZONE_COND_OFFLINE	0xF
+
+/*
+ * A sequential-write-required zone, in 4 KiB blocks.  The kernel lays out
+ * the table when the zoned disk is sized, after that only the daemon
+ * updates it and the kernel reads it to report zones.
+ */
+struct cheeze_zone {
+	uint64_t start;
+	uint64_t len;
+	uint64_t wp;
+	uint32_t cond; // CHEEZE_ZONE_COND_*
+	uint32_t reserved;
+} __attribute__((aligned(8)));
+
+#define CHEEZE_ZLOG_NONE	0
+#define CHEEZE_ZLOG_PENDING	1 // being applied to the zone table
+#define CHEEZE_ZLOG_DONE	2
+
+/*
+ * The zone op of the request with seq in a slot, only used by the daemon.
+ * A slot served again after a restart must not move the zone twice, so
+ * an op that is DONE is skipped and one left PENDING is rolled back to
+ * wp and cond first.  The kernel never looks at it.
+ */
+struct cheeze_zone_log {
+	uint64_t seq;
+	uint64_t wp;	// of the zone before the op
+	uint32_t zone;	// index, CHEEZE_ZLOG_ALL for a reset all
+	uint32_t cond;
+	uint32_t state;	// CHEEZE_ZLOG_*
+	uint32_t reserved;
+} __attribute__((aligned(8)));
+
+#define CHEEZE_ZLOG_ALL	UINT32_MAX
+
+/*
+ * Control block shared with the daemon, at CTL_OFF.
+ *
+ * A slot is outstanding while its send flag is set and its recv flag is
+ * not.  The daemon commits a completion with a single store to recv, and
+ * the kernel clears send before recv when reaping it.  A daemon that
+ * (re)attaches bumps generation and simply serves every outstanding slot
+ * again, so nothing is lost when the previous one died mid-request.  A
+ * daemon whose generation is not the current one any more must not set
+ * recv flags: CHEEZE_IOC_ATTACH fences it out before bumping generation,
+ * while through /dev/mem nothing can, so only run one daemon at a time
+ * there.
+ */
+struct cheeze_shm_ctl {
+	uint64_t magic;		// CHEEZE_SHM_MAGIC once the kernel set up the layout
+	uint64_t generation;	// bumped by every daemon attach, by the kernel for /dev/cheeze-ctl
+	uint64_t heartbeat;	// bumped by the daemon on every scan
+	uint64_t daemon_pid;
+	uint64_t nr_zones;	// 0 unless the device is zoned
+	uint64_t zone_blocks;	// zone size in 4 KiB blocks
+} __attribute__((aligned(8)));
+
+#ifndef __KERNEL__
+
+enum req_opf {
+	/* read sectors from the device */
+	REQ_OP_READ		= 0,
+	/* write sectors to the device */
+	REQ_OP_WRITE		= 1,
+	/* flush the volatile write cache */
+	REQ_OP_FLUSH		= 2,
+	/* discard sectors */
+	REQ_OP_DISCARD		= 3,
+	/* get zone information */
+	REQ_OP_ZONE_REPORT	= 4,
+	/* securely erase sectors */
+	REQ_OP_SECURE_ERASE	= 5,
+	/* seset a zone write pointer */
+	REQ_OP_ZONE_RESET	= 6,
+	/* write the same sector many times */
+	REQ_OP_WRITE_SAME	= 7,
+	/* write the zero filled sector many times */
+	REQ_OP_WRITE_ZEROES	= 9,
+
+	/* SCSI passthrough using struct scsi_request */
+	REQ_OP_SCSI_IN		= 32,
+	REQ_OP_SCSI_OUT		= 33,
+	/* Driver private requests */
+	REQ_OP_DRV_IN		= 34,
+	REQ_OP_DRV_OUT		= 35,
+
+	REQ_OP_LAST,
+};
+
+#endif
+
 #ifdef __KERNEL__
 
+#define ureq_print(u) \
+	do { \
+		pr_debug("%s:%d\n    id=%d\n    op=%d\n    pos=%u\n    len=%u\n    flags=0x%x\n    ioprio=0x%x\n    ret=%d\n", __func__, __LINE__, u.id, u.op, u.pos, u.len, u.flags, u.ioprio, u.ret); \
+	} while (0);
+
 #include <linux/list.h>
+#include <linux/version.h>
+#include <linux/wait.h>
 
 struct cheeze_queue_item {
 	int id;
@@ -70,37 +309,101 @@ struct cheeze_queue_item {
 struct cheeze_req {
 	int ret;
 	bool is_rw;
+	bool polled; // queued on a HCTX_TYPE_POLL hctx
+	bool sync; // served by cheeze_rw_page() or cheeze_kv(), which reap it themselves
+	bool cancelled; // by cheeze_cancel_req(), the slot is parked until the daemon lets go of it
+	uint64_t cancel_gen; // daemon generation when cancelled
 	struct request *rq;
+	struct bio *bio; // set instead of rq in bio_mode
 	struct cheeze_req_user user;
 	struct completion acked;
 	struct cheeze_queue_item *item;
 	int id;
+	uint64_t seq;
+	ktime_t deadline; // emulated completion time, 0 if not emulated
 } __attribute__((aligned(8), packed));
 
 // blk.c
 void cheeze_io(struct cheeze_req_user *user); // Called by koo
-extern struct class *cheeze_chr_class;
 // extern struct mutex cheeze_mutex;
+
+// chr.c
+extern wait_queue_head_t cheeze_chr_wait;
 void cheeze_chr_cleanup_module(void);
 int cheeze_chr_init_module(void);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define CHEEZE_URING_CMD
+extern atomic_t cheeze_chr_nr_fetch;
+void cheeze_chr_fetch_done(int id);
+bool cheeze_chr_uring_tick(void);
+#else
+static inline bool cheeze_chr_uring_tick(void) { return false; }
+#endif
+
+/* Wake a daemon sleeping in poll() or on a fetch for slot id */
+static inline void cheeze_chr_wake(int id)
+{
+	// Order the send flag store before looking for waiters
+	smp_mb();
+	if (waitqueue_active(&cheeze_chr_wait))
+		wake_up_interruptible(&cheeze_chr_wait);
+#ifdef CHEEZE_URING_CMD
+	if (atomic_read(&cheeze_chr_nr_fetch))
+		cheeze_chr_fetch_done(id);
+#endif
+}
+
+// lat.c
+void cheeze_lat_start(struct cheeze_req *req);
+bool cheeze_lat_due(struct cheeze_req *req);
+void cheeze_lat_complete(struct cheeze_req *req);
+int cheeze_lat_init(void);
+void cheeze_lat_exit(void);
 
 // queue.c
 extern struct cheeze_req *reqs;
-uint64_t cheeze_push(struct request *rq, struct cheeze_req **req);
+uint64_t cheeze_push(struct request *rq, struct bio *bio, struct cheeze_req **req);
+struct cheeze_req *cheeze_push_sync(int op, sector_t sector, unsigned int len, bool wait,
+				    uint64_t *seq);
 struct cheeze_req *cheeze_peek(void);
 void cheeze_pop(int id);
 void cheeze_move_pop(int id);
 void cheeze_queue_init(void);
 void cheeze_queue_exit(void);
+int cheeze_queue_depth(void);
 
 //shm.c
-extern void *cheeze_data_addr[2];
+extern void *cheeze_slot_addr[CHEEZE_QUEUE_SIZE];
+extern bool cheeze_csum;
 int cheeze_do_request(struct cheeze_req *req);
+void cheeze_end_req(struct cheeze_req *req);
+int cheeze_copy_init(void);
+void cheeze_copy_exit(void);
 void __exit shm_exit(void);
 int send_req (struct cheeze_req *req, int id, uint64_t seq);
+bool cheeze_shm_ready(void);
+uint64_t cheeze_shm_attach(void);
+uint64_t cheeze_shm_generation(void);
+bool cheeze_shm_pending(void);
+bool cheeze_shm_slot_pending(int id);
+void cheeze_shm_reap(int id);
+int cheeze_shm_init(void *meta, struct page **slots);
+bool cheeze_daemon_alive(void);
+bool cheeze_cancel_req(struct cheeze_req *req);
+int cheeze_rw_page(struct page *page, sector_t sector, bool write);
+int cheeze_kv(struct cheeze_kv_cmd *cmd);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+int cheeze_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+int cheeze_poll(struct blk_mq_hw_ctx *hctx);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+int cheeze_zones_init(uint64_t nr_zones, uint64_t zone_blocks);
+int cheeze_report_zones(struct gendisk *disk, sector_t sector,
+			unsigned int nr_zones, report_zones_cb cb, void *data);
+#endif
 static inline void *get_buf_addr(int id) {
-	int idx = id / ITEMS_PER_HP;
-	return cheeze_data_addr[idx] + ((id % ITEMS_PER_HP) * CHEEZE_BUF_SIZE);
+	return cheeze_slot_addr[id];
 }
 
 #endif
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cheeze
+
+#if !defined(_CHEEZE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CHEEZE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "cheeze.h"
+
+/*
+ * Request lifecycle:
+ *   cheeze_push -> cheeze_send -> (daemon) -> cheeze_recv -> cheeze_end
+ * cheeze_copy fires for every bio <-> shm slot copy, writes before
+ * cheeze_send and reads after cheeze_recv.  depth is the number of slots
+ * in use when the event fired.
+ */
+DECLARE_EVENT_CLASS(cheeze_req_class,
+
+	TP_PROTO(struct cheeze_req *req),
+
+	TP_ARGS(req),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u64, seq)
+		__field(int, op)
+		__field(unsigned int, pos)
+		__field(unsigned int, len)
+		__field(int, depth)
+	),
+
+	TP_fast_assign(
+		__entry->id = req->id;
+		__entry->seq = req->seq;
+		__entry->op = req->user.op;
+		__entry->pos = req->user.pos;
+		__entry->len = req->user.len;
+		__entry->depth = cheeze_queue_depth();
+	),
+
+	TP_printk("id=%d seq=%llu op=%d pos=%u len=%u depth=%d",
+		  __entry->id, __entry->seq, __entry->op,
+		  __entry->pos, __entry->len, __entry->depth)
+);
+
+DEFINE_EVENT(cheeze_req_class, cheeze_push,
+	TP_PROTO(struct cheeze_req *req),
+	TP_ARGS(req)
+);
+
+DEFINE_EVENT(cheeze_req_class, cheeze_send,
+	TP_PROTO(struct cheeze_req *req),
+	TP_ARGS(req)
+);
+
+DEFINE_EVENT(cheeze_req_class, cheeze_recv,
+	TP_PROTO(struct cheeze_req *req),
+	TP_ARGS(req)
+);
+
+DEFINE_EVENT(cheeze_req_class, cheeze_copy,
+	TP_PROTO(struct cheeze_req *req),
+	TP_ARGS(req)
+);
+
+DEFINE_EVENT(cheeze_req_class, cheeze_end,
+	TP_PROTO(struct cheeze_req *req),
+	TP_ARGS(req)
+);
+
+#endif /* _CHEEZE_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE cheeze_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * iostat for the daemon: samples the stats segment every -i seconds and
+ * prints the rates over each interval, summed over the workers.
+ *
+ *	r/s w/s d/s f/s    requests per second per op
+ *	rMB/s wMB/s        data moved
+ *	occ                requests outstanding per scan, on average
+ *	busy%              share of the time the workers had requests to serve
+ *	cyc/io             busy cycles per request
+ *	r_us w_us          average read and write backend latency
+ *	r_p99 w_p99        99th percentile of it, rounded up to a power of two cycles
+ *
+ * The segment is only read, the daemon never knows it is being sampled.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "backend.h"
+
+struct sample {
+	uint64_t ops[CHEEZE_STATS_OPS];
+	uint64_t bytes[CHEEZE_STATS_OPS];
+	uint64_t cycles[CHEEZE_STATS_OPS];
+	uint64_t hist[CHEEZE_STATS_OPS][CHEEZE_STATS_BUCKETS];
+	uint64_t busy_cycles, idle_cycles, scans, occupancy;
+	uint64_t start_ns;
+};
+
+static void sample(const volatile struct cheeze_stats *st, struct sample *s)
+{
+	const volatile struct cheeze_stats_worker *w;
+	unsigned int i, op, b;
+
+	memset(s, 0, sizeof(*s));
+	s->start_ns = st->start_ns;
+
+	for (i = 0; i < st->nr_workers && i < CHEEZE_STATS_WORKERS; i++) {
+		w = &st->workers[i];
+		for (op = 0; op < CHEEZE_STATS_OPS; op++) {
+			s->ops[op] += w->ops[op];
+			s->bytes[op] += w->bytes[op];
+			s->cycles[op] += w->cycles[op];
+			for (b = 0; b < CHEEZE_STATS_BUCKETS; b++)
+				s->hist[op][b] += w->hist[op][b];
+		}
+		s->busy_cycles += w->busy_cycles;
+		s->idle_cycles += w->idle_cycles;
+		s->scans += w->scans;
+		s->occupancy += w->occupancy;
+	}
+}
+
+/* Upper bound of the bucket holding the p-th permille of the requests, in cycles */
+static uint64_t percentile(const struct sample *cur, const struct sample *prev,
+			   int op, unsigned int p)
+{
+	uint64_t n = cur->ops[op] - prev->ops[op], seen = 0;
+	unsigned int b;
+
+	if (!n)
+		return 0;
+
+	for (b = 0; b < CHEEZE_STATS_BUCKETS - 1; b++) {
+		seen += cur->hist[op][b] - prev->hist[op][b];
+		if (seen * 1000 >= n * p)
+			break;
+	}
+
+	return 2ULL << b;
+}
+
+static void report(const struct sample *cur, const struct sample *prev,
+		   double secs, double tsc_mhz)
+{
+	uint64_t d[CHEEZE_STATS_OPS], ops = 0, busy, all, scans;
+	double us[2];
+	int op;
+
+	for (op = 0; op < CHEEZE_STATS_OPS; op++) {
+		d[op] = cur->ops[op] - prev->ops[op];
+		ops += d[op];
+	}
+	for (op = CHEEZE_STATS_READ; op <= CHEEZE_STATS_WRITE; op++)
+		us[op] = d[op] ? (cur->cycles[op] - prev->cycles[op]) / tsc_mhz / d[op] : 0;
+
+	busy = cur->busy_cycles - prev->busy_cycles;
+	all = busy + cur->idle_cycles - prev->idle_cycles;
+	scans = cur->scans - prev->scans;
+
+	printf("%9.0f %9.0f %7.0f %7.0f %8.1f %8.1f %6.1f %6.1f %8.0f %7.1f %7.1f %7.1f %7.1f\n",
+	       d[CHEEZE_STATS_READ] / secs, d[CHEEZE_STATS_WRITE] / secs,
+	       d[CHEEZE_STATS_DISCARD] / secs, d[CHEEZE_STATS_FLUSH] / secs,
+	       (cur->bytes[CHEEZE_STATS_READ] - prev->bytes[CHEEZE_STATS_READ]) / secs / 1e6,
+	       (cur->bytes[CHEEZE_STATS_WRITE] - prev->bytes[CHEEZE_STATS_WRITE]) / secs / 1e6,
+	       scans ? (double)(cur->occupancy - prev->occupancy) / scans : 0,
+	       all ? 100.0 * busy / all : 0,
+	       ops ? (double)busy / ops : 0,
+	       us[CHEEZE_STATS_READ], percentile(cur, prev, CHEEZE_STATS_READ, 990) / tsc_mhz,
+	       us[CHEEZE_STATS_WRITE], percentile(cur, prev, CHEEZE_STATS_WRITE, 990) / tsc_mhz);
+	fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-i interval] [-c count]\n"
+		"    -i    seconds between reports (default: 1)\n"
+		"    -c    stop after count reports (default: never)\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const volatile struct cheeze_stats *st;
+	struct sample cur, prev;
+	double interval = 1;
+	long count = -1, n;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "i:c:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtod(optarg, NULL);
+			break;
+		case 'c':
+			count = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (interval <= 0)
+		usage(argv[0]);
+
+	fd = shm_open(CHEEZE_STATS_NAME, O_RDONLY, 0);
+	if (fd < 0) {
+		perror("Failed to open the stats segment, is the daemon running?");
+		return 1;
+	}
+	st = mmap(NULL, sizeof(*st), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (st == MAP_FAILED) {
+		perror("Failed to mmap the stats segment");
+		return 1;
+	}
+	if (st->magic != CHEEZE_STATS_MAGIC) {
+		fprintf(stderr, "The stats segment isn't initialized\n");
+		return 1;
+	}
+
+	sample(st, &prev);
+	for (n = 0; count < 0 || n < count; n++) {
+		usleep(interval * 1000000);
+		sample(st, &cur);
+
+		// The daemon was restarted and the counters with it
+		if (cur.start_ns != prev.start_ns) {
+			prev = cur;
+			continue;
+		}
+
+		if (n % 20 == 0)
+			printf("%9s %9s %7s %7s %8s %8s %6s %6s %8s %7s %7s %7s %7s\n",
+			       "r/s", "w/s", "d/s", "f/s", "rMB/s", "wMB/s", "occ", "busy%",
+			       "cyc/io", "r_us", "r_p99", "w_us", "w_p99");
+		report(&cur, &prev, interval, st->tsc_hz / 1e6);
+		prev = cur;
+	}
+
+	return 0;
+}
@@ -0,0 +1,375 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+#define pr_fmt(fmt) "cheeze: " fmt
+
+/*
+ * /dev/cheeze-ctl hands the shm regions to the daemon without reserving
+ * memory at boot and passing its physical address through page_addr0/1/2.
+ *
+ * The first open allocates the metadata and every data slot, each slot as
+ * a physically contiguous CHEEZE_BUF_SIZE chunk, on the NUMA node of the
+ * opener, which is normally the daemon.  They stay until the module is
+ * unloaded so that a restarted daemon finds its outstanding requests.
+ *
+ * The daemon attaches with CHEEZE_IOC_ATTACH, then mmap()s the metadata at 0
+ * and the slots at CHEEZE_CTL_DATA_OFF.  Attaching zaps every mapping made
+ * before, and as they have no ->fault, the superseded daemon gets SIGBUS
+ * the next time it touches them rather than completing anything.
+ * Instead of spinning while idle it can poll() for POLLIN, which is
+ * reported while any request is outstanding, or wait on io_uring commands,
+ * see CHEEZE_URING_CMD_FETCH.
+ */
+
+#include <linux/module.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/topology.h>
+#include <linux/rcupdate.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
+#include "cheeze.h"
+
+#ifdef CHEEZE_URING_CMD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+#define cheeze_poll_t __poll_t
+#define CHEEZE_POLLIN (EPOLLIN | EPOLLRDNORM)
+#else
+#define cheeze_poll_t unsigned int
+#define CHEEZE_POLLIN (POLLIN | POLLRDNORM)
+#endif
+
+#define CHEEZE_SLOT_ORDER get_order(CHEEZE_BUF_SIZE)
+#define CHEEZE_SLOT_PAGES (1UL << CHEEZE_SLOT_ORDER)
+
+DECLARE_WAIT_QUEUE_HEAD(cheeze_chr_wait);
+
+static DEFINE_MUTEX(chr_lock);
+static void *chr_meta;
+static struct page *chr_slots[CHEEZE_QUEUE_SIZE];
+
+static void chr_free(void)
+{
+	unsigned long j;
+	int i;
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++) {
+		if (chr_slots[i])
+			for (j = 0; j < CHEEZE_SLOT_PAGES; j++)
+				__free_page(chr_slots[i] + j);
+		chr_slots[i] = NULL;
+	}
+
+	vfree(chr_meta);
+	chr_meta = NULL;
+}
+
+static int chr_alloc(int node)
+{
+	int i, ret;
+
+	chr_meta = vmalloc_user(CHEEZE_CTL_META_SIZE);
+	if (!chr_meta)
+		return -ENOMEM;
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++) {
+		chr_slots[i] = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN,
+						CHEEZE_SLOT_ORDER);
+		if (!chr_slots[i]) {
+			pr_err("%s: out of %lluMB chunks at slot %d\n", __func__,
+			       CHEEZE_BUF_SIZE >> 20, i);
+			ret = -ENOMEM;
+			goto err;
+		}
+		// Refcount every page, so that they can be mapped and pinned one by one
+		split_page(chr_slots[i], CHEEZE_SLOT_ORDER);
+	}
+
+	ret = cheeze_shm_init(chr_meta, chr_slots);
+	if (ret)
+		goto err;
+
+	pr_info("allocated shm on node %d\n", node);
+	return 0;
+
+err:
+	chr_free();
+	return ret;
+}
+
+static int chr_open(struct inode *inode, struct file *file)
+{
+	int ret = 0;
+
+	// The generation it attached as, none yet
+	file->private_data = NULL;
+
+	mutex_lock(&chr_lock);
+	if (!chr_meta) {
+		// Set up through page_addr0/1/2 instead
+		if (cheeze_shm_ready())
+			ret = -EBUSY;
+		else
+			ret = chr_alloc(numa_node_id());
+	}
+	mutex_unlock(&chr_lock);
+
+	return ret;
+}
+
+static int chr_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned long addr, i, j;
+	int ret;
+
+	if (off == 0)
+		return remap_vmalloc_range(vma, chr_meta, 0);
+
+	if (off < CHEEZE_CTL_DATA_OFF || (off - CHEEZE_CTL_DATA_OFF) % CHEEZE_BUF_SIZE ||
+	    off - CHEEZE_CTL_DATA_OFF + len > CHEEZE_CTL_DATA_SIZE)
+		return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+
+	/*
+	 * Insert the pages rather than remap_pfn_range() them, a VM_PFNMAP
+	 * mapping can't be pinned and the daemon does O_DIRECT I/O on it.
+	 */
+	i = (off - CHEEZE_CTL_DATA_OFF) / CHEEZE_BUF_SIZE;
+	for (addr = vma->vm_start; addr < vma->vm_end; i++) {
+		for (j = 0; j < CHEEZE_SLOT_PAGES && addr < vma->vm_end; j++, addr += PAGE_SIZE) {
+			ret = vm_insert_page(vma, addr, chr_slots[i] + j);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* Whether file attached as an older generation, or never did */
+static inline bool chr_superseded(struct file *file)
+{
+	return !file->private_data ||
+	       (uintptr_t)file->private_data != (uintptr_t)cheeze_shm_generation();
+}
+
+#ifdef CHEEZE_URING_CMD
+/*
+ * One fetch may wait on each slot.  The publisher and the fetch take it
+ * with xchg() once they see the request, and cheeze_chr_wake() only looks
+ * while any fetch is armed.  Fetches that saw nothing for a second are
+ * completed with -EAGAIN, so that an exiting daemon never waits for them.
+ */
+#define CHEEZE_FETCH_TIMEOUT HZ
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#define chr_uring_cmd_payload(cmd) ((const struct cheeze_uring_cmd *)io_uring_sqe_cmd((cmd)->sqe))
+#else
+#define chr_uring_cmd_payload(cmd) ((const struct cheeze_uring_cmd *)(cmd)->cmd)
+#endif
+
+atomic_t cheeze_chr_nr_fetch;
+static struct io_uring_cmd *chr_fetch[CHEEZE_QUEUE_SIZE];
+static unsigned long chr_fetch_armed[CHEEZE_QUEUE_SIZE]; // jiffies
+
+static void chr_fetch_tw(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	io_uring_cmd_done(cmd, 0, 0, issue_flags);
+}
+
+static void chr_fetch_expired_tw(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	io_uring_cmd_done(cmd, -EAGAIN, 0, issue_flags);
+}
+
+static struct io_uring_cmd *chr_fetch_take(int id)
+{
+	struct io_uring_cmd *cmd = xchg(&chr_fetch[id], NULL);
+
+	if (cmd)
+		atomic_dec(&cheeze_chr_nr_fetch);
+
+	return cmd;
+}
+
+/* Called after publishing a request in slot id */
+void cheeze_chr_fetch_done(int id)
+{
+	struct io_uring_cmd *cmd = chr_fetch_take(id);
+
+	if (cmd)
+		io_uring_cmd_complete_in_task(cmd, chr_fetch_tw);
+}
+
+/* Called by kshm, returns whether a daemon waits on fetches */
+bool cheeze_chr_uring_tick(void)
+{
+	static unsigned long last;
+	struct io_uring_cmd *cmd;
+	int i;
+
+	if (!atomic_read(&cheeze_chr_nr_fetch))
+		return false;
+
+	if (time_before(jiffies, last + CHEEZE_FETCH_TIMEOUT / 10))
+		return true;
+	last = jiffies;
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++) {
+		if (!READ_ONCE(chr_fetch[i]) ||
+		    time_before(jiffies, READ_ONCE(chr_fetch_armed[i]) + CHEEZE_FETCH_TIMEOUT))
+			continue;
+		cmd = chr_fetch_take(i);
+		if (cmd)
+			io_uring_cmd_complete_in_task(cmd, chr_fetch_expired_tw);
+	}
+
+	return true;
+}
+
+static int chr_fetch_arm(struct io_uring_cmd *cmd, int id)
+{
+	WRITE_ONCE(chr_fetch_armed[id], jiffies);
+	atomic_inc(&cheeze_chr_nr_fetch);
+	if (cmpxchg(&chr_fetch[id], NULL, cmd)) {
+		atomic_dec(&cheeze_chr_nr_fetch);
+		return -EBUSY;
+	}
+
+	// Published before the fetch was armed, cmpxchg() orders against cheeze_chr_wake()
+	if (cheeze_shm_slot_pending(id))
+		cheeze_chr_fetch_done(id);
+
+	return -EIOCBQUEUED;
+}
+
+static int chr_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	const struct cheeze_uring_cmd *ucmd = chr_uring_cmd_payload(cmd);
+	u32 id = READ_ONCE(ucmd->id);
+	int ret = -EINVAL;
+
+	if (id >= CHEEZE_QUEUE_SIZE)
+		return -EINVAL;
+
+	// Pairs with synchronize_rcu() in chr_ioctl()
+	rcu_read_lock();
+	if (chr_superseded(cmd->file)) {
+		rcu_read_unlock();
+		return -ESTALE;
+	}
+
+	switch (cmd->cmd_op) {
+	case CHEEZE_URING_CMD_COMMIT_AND_FETCH:
+		cheeze_shm_reap(id);
+		fallthrough;
+	case CHEEZE_URING_CMD_FETCH:
+		ret = chr_fetch_arm(cmd, id);
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* Complete every armed fetch with -EAGAIN */
+static void chr_fetch_flush(void)
+{
+	struct io_uring_cmd *cmd;
+	int i;
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++) {
+		cmd = chr_fetch_take(i);
+		if (cmd)
+			io_uring_cmd_complete_in_task(cmd, chr_fetch_expired_tw);
+	}
+}
+#else
+static inline void chr_fetch_flush(void) { }
+#endif
+
+static long chr_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	uint64_t gen;
+
+	if (cmd != CHEEZE_IOC_ATTACH)
+		return -ENOTTY;
+
+	mutex_lock(&chr_lock);
+	if (!chr_meta) {
+		mutex_unlock(&chr_lock);
+		return -ENODEV;
+	}
+
+	// Fence out the previous daemon before anything can be served again
+	unmap_mapping_range(file->f_mapping, 0, 0, 1);
+	gen = cheeze_shm_attach();
+	file->private_data = (void *)(uintptr_t)gen;
+	// Its io_uring commands that saw the old generation are done after this
+	synchronize_rcu();
+	// And the fetches it left armed would make the new daemon's fail
+	chr_fetch_flush();
+	mutex_unlock(&chr_lock);
+
+	return put_user(gen, (uint64_t __user *)arg);
+}
+
+static cheeze_poll_t chr_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &cheeze_chr_wait, wait);
+	// Pairs with smp_mb() in cheeze_chr_wake()
+	smp_mb();
+
+	return cheeze_shm_pending() ? CHEEZE_POLLIN : 0;
+}
+
+static const struct file_operations chr_fops = {
+	.owner = THIS_MODULE,
+	.open = chr_open,
+	.mmap = chr_mmap,
+	.poll = chr_poll,
+	.unlocked_ioctl = chr_ioctl,
+#ifdef CHEEZE_URING_CMD
+	.uring_cmd = chr_uring_cmd,
+#endif
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice chr_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "cheeze-ctl",
+	.fops = &chr_fops,
+	.mode = 0600,
+};
+
+int cheeze_chr_init_module(void)
+{
+	return misc_register(&chr_dev);
+}
+
+/* Called once the disk is gone, nothing can use the regions anymore */
+void cheeze_chr_cleanup_module(void)
+{
+	misc_deregister(&chr_dev);
+	chr_free();
+}
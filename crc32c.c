@@ -38,6 +38,10 @@
    1.3  31 Dec 2015  Check for Intel architecture using compiler macro
                      Support big-endian processors in software calculation
                      Add header for external use
+   cheeze      Restore the table-driven crc32c_sw(), marked unused since
+                     not every includer calls it
+   cheeze      Add crc32c_copy() to checksum while copying, also unused
+                     by most includers
  */
 
 #ifndef _LINUX_CRC32C_C
@@ -45,10 +49,66 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 /* CRC-32C (iSCSI) polynomial in reversed bit order. */
 #define POLY 0x82f63b78
 
+/* Table for a 64-bits-at-a-time software CRC-32C calculation.  This table
+   has built into it the pre and post bit inversion of the CRC. */
+static uint32_t crc32c_table[8][256];
+
+/* Construct table for software CRC-32C calculation. */
+static void __attribute__((constructor)) crc32c_init_sw(void) {
+    uint32_t n, crc, k;
+
+    for (n = 0; n < 256; n++) {
+        crc = n;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++) {
+        crc = crc32c_table[0][n];
+        for (k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+}
+
+/* Table-driven software version as a fall-back and for speed comparisons.
+   Assumes a little-endian processor, as does the hardware version. */
+static __attribute__((unused))
+uint32_t crc32c_sw(uint32_t crci, void const *buf, size_t len) {
+    unsigned char const *next = buf;
+    uint64_t crc;
+
+    crc = crci ^ 0xffffffff;
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        crc ^= *(uint64_t const *)next;
+        crc = crc32c_table[7][crc & 0xff] ^
+              crc32c_table[6][(crc >> 8) & 0xff] ^
+              crc32c_table[5][(crc >> 16) & 0xff] ^
+              crc32c_table[4][(crc >> 24) & 0xff] ^
+              crc32c_table[3][(crc >> 32) & 0xff] ^
+              crc32c_table[2][(crc >> 40) & 0xff] ^
+              crc32c_table[1][(crc >> 48) & 0xff] ^
+              crc32c_table[0][crc >> 56];
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return (uint32_t)crc ^ 0xffffffff;
+}
+
 /* Hardware CRC-32C for Intel and compatible processors. */
 
 /* Multiply a matrix times a vector over the Galois field of two elements,
@@ -237,4 +297,81 @@ static uint32_t crc32c(uint32_t crc, void const *buf, size_t len) {
     return ~crc0;
 }
 
+/* Copy len bytes from src to dst and return their CRC-32C, in a single pass
+   over the data: every eight-byte word is loaded once into a register, then
+   stored to dst and fed to the crc instruction from there.  This uses the
+   three-way SHORT blocks of crc32c() for any length, since the daemon copies
+   4 KiB blocks at a time.  dst and src must not overlap. */
+static __attribute__((unused))
+uint32_t crc32c_copy(uint32_t crc, void *dst, void const *src, size_t len) {
+    /* pre-process the crc */
+    crc = ~crc;
+    uint64_t crc0 = crc;            /* 64-bits for crc32q instruction */
+    unsigned char const *next = src;
+    unsigned char *out = dst;
+    uint64_t w0, w1, w2;
+
+    /* bring the source pointer to an eight-byte boundary */
+    while (len && ((uintptr_t)next & 7) != 0) {
+        *out++ = *next;
+        __asm__("crc32b\t" "(%1), %0"
+                : "=r"(crc0)
+                : "r"(next), "0"(crc0));
+        next++;
+        len--;
+    }
+
+    /* three independent crcs on SHORT bytes each, as in crc32c() */
+    while (len >= SHORT*3) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        unsigned char const * const end = next + SHORT;
+        do {
+            memcpy(&w0, next, 8);
+            memcpy(&w1, next + SHORT, 8);
+            memcpy(&w2, next + SHORT*2, 8);
+            memcpy(out, &w0, 8);
+            memcpy(out + SHORT, &w1, 8);
+            memcpy(out + SHORT*2, &w2, 8);
+            __asm__("crc32q\t" "%3, %0\n\t"
+                    "crc32q\t" "%4, %1\n\t"
+                    "crc32q\t" "%5, %2"
+                    : "=r"(crc0), "=r"(crc1), "=r"(crc2)
+                    : "r"(w0), "r"(w1), "r"(w2), "0"(crc0), "1"(crc1), "2"(crc2));
+            next += 8;
+            out += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+        next += SHORT*2;
+        out += SHORT*2;
+        len -= SHORT*3;
+    }
+
+    /* the remaining eight-byte units */
+    while (len >= 8) {
+        memcpy(&w0, next, 8);
+        memcpy(out, &w0, 8);
+        __asm__("crc32q\t" "%1, %0"
+                : "=r"(crc0)
+                : "r"(w0), "0"(crc0));
+        next += 8;
+        out += 8;
+        len -= 8;
+    }
+
+    /* and up to seven trailing bytes */
+    while (len) {
+        *out++ = *next;
+        __asm__("crc32b\t" "(%1), %0"
+                : "=r"(crc0)
+                : "r"(next), "0"(crc0));
+        next++;
+        len--;
+    }
+
+    /* return a post-processed crc */
+    return ~crc0;
+}
+
 #endif	/* _LINUX_CRC32C_C */
@@ -0,0 +1,401 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Log-structured, page-mapped FTL emulation.
+ *
+ * The backend image is used as the physical flash array: it is carved into
+ * erase blocks of FTL_PAGE_SIZE pages and every host write is appended to the
+ * active block.  Only (100 - op)% of the physical pages are exported as
+ * logical capacity, the remainder is over-provisioning consumed by GC.
+ *
+ * All per-page and per-block metadata is kept in flat arrays (struct of
+ * arrays) so that a mapping update touches one 4-byte entry in l2p and p2l
+ * and one counter in valid_cnt.
+ *
+ * Closed blocks are kept on per valid count lists, each ordered by mtime
+ * since a block is appended whenever its count changes.  Greedy takes the
+ * head of the lowest non-empty list and cost-benefit only scores the head
+ * of each list, so picking a victim costs pages_per_block, not nr_blocks.
+ */
+
+#ifndef _CHEEZE_FTL_C
+#define _CHEEZE_FTL_C
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FTL_PAGE_SHIFT 12
+#define FTL_PAGE_SIZE (1 << FTL_PAGE_SHIFT)
+#define FTL_UNMAPPED UINT32_MAX
+
+/* Start GC when the free block pool drops to this many blocks */
+#define FTL_GC_THRESHOLD 2
+
+enum ftl_gc_policy {
+	FTL_GC_GREEDY,
+	FTL_GC_COST_BENEFIT,
+};
+
+enum ftl_block_state {
+	FTL_BLK_FREE,
+	FTL_BLK_OPEN,
+	FTL_BLK_CLOSED,
+};
+
+struct ftl_frontier {
+	uint32_t blk;
+	uint32_t off;
+};
+
+struct ftl {
+	char *flash;
+	enum ftl_gc_policy policy;
+
+	uint32_t nr_lpages;
+	uint32_t nr_ppages;
+	uint32_t nr_blocks;
+	uint32_t pages_per_block;
+
+	uint32_t *l2p;		// lpn -> ppn
+	uint32_t *p2l;		// ppn -> lpn, FTL_UNMAPPED once invalidated
+	uint32_t *valid_cnt;	// per block
+	uint64_t *mtime;	// per block, stamp of the last page invalidation
+	uint8_t *state;		// per block, enum ftl_block_state
+
+	/* Closed blocks by valid count, FTL_UNMAPPED terminated */
+	uint32_t *bucket_head;	// pages_per_block + 1 lists
+	uint32_t *bucket_tail;
+	uint32_t *blk_next;	// per block
+	uint32_t *blk_prev;
+	uint32_t min_bucket;	// no closed block has fewer valid pages
+
+	uint32_t *free_blocks;	// stack of erased blocks
+	uint32_t nr_free;
+
+	struct ftl_frontier host;
+	struct ftl_frontier gc;
+
+	uint64_t clock;		// logical time, bumped per page written
+
+	/* Statistics */
+	uint64_t host_pages;
+	uint64_t gc_pages;
+	uint64_t trim_pages;
+	uint64_t erases;
+	uint64_t gc_runs;
+	uint64_t gc_ns;
+	uint64_t gc_max_ns;
+};
+
+static inline uint64_t ftl_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline char *ftl_page(struct ftl *ftl, uint32_t ppn)
+{
+	return ftl->flash + ((uint64_t)ppn << FTL_PAGE_SHIFT);
+}
+
+static void ftl_bucket_add(struct ftl *ftl, uint32_t blk)
+{
+	uint32_t b = ftl->valid_cnt[blk];
+	uint32_t tail = ftl->bucket_tail[b];
+
+	ftl->blk_prev[blk] = tail;
+	ftl->blk_next[blk] = FTL_UNMAPPED;
+	if (tail == FTL_UNMAPPED)
+		ftl->bucket_head[b] = blk;
+	else
+		ftl->blk_next[tail] = blk;
+	ftl->bucket_tail[b] = blk;
+
+	if (b < ftl->min_bucket)
+		ftl->min_bucket = b;
+}
+
+static void ftl_bucket_del(struct ftl *ftl, uint32_t blk)
+{
+	uint32_t b = ftl->valid_cnt[blk];
+	uint32_t prev = ftl->blk_prev[blk], next = ftl->blk_next[blk];
+
+	if (prev == FTL_UNMAPPED)
+		ftl->bucket_head[b] = next;
+	else
+		ftl->blk_next[prev] = next;
+	if (next == FTL_UNMAPPED)
+		ftl->bucket_tail[b] = prev;
+	else
+		ftl->blk_prev[next] = prev;
+}
+
+static void ftl_open_block(struct ftl *ftl, struct ftl_frontier *f)
+{
+	f->blk = ftl->free_blocks[--ftl->nr_free];
+	f->off = 0;
+	ftl->state[f->blk] = FTL_BLK_OPEN;
+}
+
+static inline void ftl_invalidate(struct ftl *ftl, uint32_t ppn)
+{
+	uint32_t blk = ppn / ftl->pages_per_block;
+	int closed = ftl->state[blk] == FTL_BLK_CLOSED;
+
+	if (closed)
+		ftl_bucket_del(ftl, blk);
+	ftl->p2l[ppn] = FTL_UNMAPPED;
+	ftl->valid_cnt[blk]--;
+	ftl->mtime[blk] = ftl->clock;
+	if (closed)
+		ftl_bucket_add(ftl, blk);
+}
+
+/* Returns the next physical page of frontier f, the caller must map it */
+static inline uint32_t ftl_append(struct ftl *ftl, struct ftl_frontier *f)
+{
+	uint32_t ppn;
+
+	ppn = f->blk * ftl->pages_per_block + f->off;
+	ftl->valid_cnt[f->blk]++;
+	ftl->clock++;
+
+	if (++f->off == ftl->pages_per_block) {
+		ftl->state[f->blk] = FTL_BLK_CLOSED;
+		ftl->mtime[f->blk] = ftl->clock;
+		ftl_bucket_add(ftl, f->blk);
+		ftl_open_block(ftl, f);
+	}
+
+	return ppn;
+}
+
+static uint32_t ftl_pick_victim(struct ftl *ftl)
+{
+	uint32_t b, blk, victim = FTL_UNMAPPED;
+	uint32_t ppb = ftl->pages_per_block;
+	double score, best = -1.0;
+
+	while (ftl->min_bucket <= ppb && ftl->bucket_head[ftl->min_bucket] == FTL_UNMAPPED)
+		ftl->min_bucket++;
+	if (ftl->min_bucket > ppb)
+		return FTL_UNMAPPED;
+
+	if (ftl->policy == FTL_GC_GREEDY || ftl->min_bucket == 0)
+		return ftl->bucket_head[ftl->min_bucket];
+
+	/* cost-benefit: (1 - u) * age / 2u, the oldest block of each u wins */
+	for (b = ftl->min_bucket; b <= ppb; b++) {
+		blk = ftl->bucket_head[b];
+		if (blk == FTL_UNMAPPED)
+			continue;
+
+		score = (double)(ppb - b) *
+			(double)(ftl->clock - ftl->mtime[blk]) /
+			(2.0 * b);
+		if (score > best) {
+			best = score;
+			victim = blk;
+		}
+	}
+
+	return victim;
+}
+
+static void ftl_gc(struct ftl *ftl)
+{
+	uint32_t victim, ppn, end, lpn, new_ppn;
+	uint64_t start, elapsed;
+
+	start = ftl_now_ns();
+
+	while (ftl->nr_free <= FTL_GC_THRESHOLD) {
+		victim = ftl_pick_victim(ftl);
+		if (victim == FTL_UNMAPPED)
+			break;
+
+		/* Off the lists while its pages move out */
+		ftl_bucket_del(ftl, victim);
+		ftl->state[victim] = FTL_BLK_FREE;
+
+		ppn = victim * ftl->pages_per_block;
+		end = ppn + ftl->pages_per_block;
+		for (; ppn < end && ftl->valid_cnt[victim]; ppn++) {
+			lpn = ftl->p2l[ppn];
+			if (lpn == FTL_UNMAPPED)
+				continue;
+
+			new_ppn = ftl_append(ftl, &ftl->gc);
+			memcpy(ftl_page(ftl, new_ppn), ftl_page(ftl, ppn), FTL_PAGE_SIZE);
+			ftl_invalidate(ftl, ppn);
+			ftl->l2p[lpn] = new_ppn;
+			ftl->p2l[new_ppn] = lpn;
+			ftl->gc_pages++;
+		}
+
+		/* Erase */
+		ftl->free_blocks[ftl->nr_free++] = victim;
+		ftl->erases++;
+	}
+
+	elapsed = ftl_now_ns() - start;
+	ftl->gc_runs++;
+	ftl->gc_ns += elapsed;
+	if (elapsed > ftl->gc_max_ns)
+		ftl->gc_max_ns = elapsed;
+}
+
+static int ftl_init(struct ftl *ftl, char *flash, uint64_t flash_size,
+		    unsigned int op_percent, uint32_t pages_per_block,
+		    enum ftl_gc_policy policy)
+{
+	uint64_t usable;
+	uint32_t i, reserved;
+
+	memset(ftl, 0, sizeof(*ftl));
+
+	ftl->flash = flash;
+	ftl->policy = policy;
+	ftl->pages_per_block = pages_per_block;
+	ftl->nr_blocks = (flash_size >> FTL_PAGE_SHIFT) / pages_per_block;
+	ftl->nr_ppages = ftl->nr_blocks * pages_per_block;
+
+	/* Two open frontiers plus the GC threshold are never exported */
+	reserved = FTL_GC_THRESHOLD + 2;
+	if (op_percent >= 100 || ftl->nr_blocks <= reserved + 1) {
+		fprintf(stderr, "ftl: invalid geometry (%u blocks, op %u%%)\n",
+			ftl->nr_blocks, op_percent);
+		return -1;
+	}
+
+	usable = (uint64_t)ftl->nr_ppages * (100 - op_percent) / 100;
+	if (usable > (uint64_t)(ftl->nr_blocks - reserved - 1) * pages_per_block)
+		usable = (uint64_t)(ftl->nr_blocks - reserved - 1) * pages_per_block;
+	ftl->nr_lpages = usable;
+
+	ftl->l2p = malloc(sizeof(uint32_t) * ftl->nr_lpages);
+	ftl->p2l = malloc(sizeof(uint32_t) * ftl->nr_ppages);
+	ftl->valid_cnt = calloc(ftl->nr_blocks, sizeof(uint32_t));
+	ftl->mtime = calloc(ftl->nr_blocks, sizeof(uint64_t));
+	ftl->state = calloc(ftl->nr_blocks, sizeof(uint8_t));
+	ftl->free_blocks = malloc(sizeof(uint32_t) * ftl->nr_blocks);
+	ftl->bucket_head = malloc(sizeof(uint32_t) * (pages_per_block + 1));
+	ftl->bucket_tail = malloc(sizeof(uint32_t) * (pages_per_block + 1));
+	ftl->blk_next = malloc(sizeof(uint32_t) * ftl->nr_blocks);
+	ftl->blk_prev = malloc(sizeof(uint32_t) * ftl->nr_blocks);
+	if (!ftl->l2p || !ftl->p2l || !ftl->valid_cnt || !ftl->mtime ||
+	    !ftl->state || !ftl->free_blocks || !ftl->bucket_head ||
+	    !ftl->bucket_tail || !ftl->blk_next || !ftl->blk_prev) {
+		perror("ftl: failed to allocate mapping tables");
+		return -1;
+	}
+
+	memset(ftl->l2p, 0xff, sizeof(uint32_t) * ftl->nr_lpages);
+	memset(ftl->p2l, 0xff, sizeof(uint32_t) * ftl->nr_ppages);
+	memset(ftl->bucket_head, 0xff, sizeof(uint32_t) * (pages_per_block + 1));
+	memset(ftl->bucket_tail, 0xff, sizeof(uint32_t) * (pages_per_block + 1));
+	ftl->min_bucket = pages_per_block + 1;
+
+	/* Pop order is ascending block number */
+	for (i = 0; i < ftl->nr_blocks; i++)
+		ftl->free_blocks[i] = ftl->nr_blocks - 1 - i;
+	ftl->nr_free = ftl->nr_blocks;
+
+	ftl_open_block(ftl, &ftl->host);
+	ftl_open_block(ftl, &ftl->gc);
+
+	return 0;
+}
+
+static inline int ftl_check_range(struct ftl *ftl, uint32_t lpn, uint32_t nr)
+{
+	if (lpn >= ftl->nr_lpages || nr > ftl->nr_lpages - lpn) {
+		fprintf(stderr, "ftl: lpn %u+%u beyond capacity (%u pages)\n",
+			lpn, nr, ftl->nr_lpages);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void ftl_read(struct ftl *ftl, uint32_t lpn, char *buf, uint32_t len)
+{
+	uint32_t i, ppn, nr = len >> FTL_PAGE_SHIFT;
+
+	if (ftl_check_range(ftl, lpn, nr)) {
+		memset(buf, 0, len);
+		return;
+	}
+
+	for (i = 0; i < nr; i++, buf += FTL_PAGE_SIZE) {
+		ppn = ftl->l2p[lpn + i];
+		if (ppn == FTL_UNMAPPED)
+			memset(buf, 0, FTL_PAGE_SIZE);
+		else
+			memcpy(buf, ftl_page(ftl, ppn), FTL_PAGE_SIZE);
+	}
+}
+
+static void ftl_write(struct ftl *ftl, uint32_t lpn, const char *buf, uint32_t len)
+{
+	uint32_t i, ppn, old, nr = len >> FTL_PAGE_SHIFT;
+
+	if (ftl_check_range(ftl, lpn, nr))
+		return;
+
+	for (i = 0; i < nr; i++, lpn++, buf += FTL_PAGE_SIZE) {
+		if (ftl->nr_free <= FTL_GC_THRESHOLD)
+			ftl_gc(ftl);
+
+		old = ftl->l2p[lpn];
+		if (old != FTL_UNMAPPED)
+			ftl_invalidate(ftl, old);
+
+		ppn = ftl_append(ftl, &ftl->host);
+		memcpy(ftl_page(ftl, ppn), buf, FTL_PAGE_SIZE);
+		ftl->l2p[lpn] = ppn;
+		ftl->p2l[ppn] = lpn;
+	}
+
+	ftl->host_pages += nr;
+}
+
+static void ftl_trim(struct ftl *ftl, uint32_t lpn, uint32_t len)
+{
+	uint32_t i, old, nr = len >> FTL_PAGE_SHIFT;
+
+	if (ftl_check_range(ftl, lpn, nr))
+		return;
+
+	for (i = 0; i < nr; i++, lpn++) {
+		old = ftl->l2p[lpn];
+		if (old == FTL_UNMAPPED)
+			continue;
+
+		ftl_invalidate(ftl, old);
+		ftl->l2p[lpn] = FTL_UNMAPPED;
+		ftl->trim_pages++;
+	}
+}
+
+static void ftl_print_stats(struct ftl *ftl, FILE *fp)
+{
+	double waf = ftl->host_pages ?
+		(double)(ftl->host_pages + ftl->gc_pages) / ftl->host_pages : 0.0;
+
+	fprintf(fp, "ftl: host_pages=%lu gc_pages=%lu trim_pages=%lu erases=%lu waf=%.3f\n",
+		ftl->host_pages, ftl->gc_pages, ftl->trim_pages, ftl->erases, waf);
+	fprintf(fp, "ftl: gc_runs=%lu gc_stall_total_us=%lu gc_stall_max_us=%lu free_blocks=%u/%u\n",
+		ftl->gc_runs, ftl->gc_ns / 1000, ftl->gc_max_ns / 1000,
+		ftl->nr_free, ftl->nr_blocks);
+}
+
+#endif	/* _CHEEZE_FTL_C */
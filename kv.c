@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * In-memory key-value store serving the CHEEZE_OP_KV_* commands.
+ *
+ * An open addressing hash table with linear probing, hashed with crc32c.
+ * Deleted entries leave a tombstone so that probes for other keys go on,
+ * and the table is rebuilt without them, doubled if needed, once live
+ * entries and tombstones fill 70% of it.  An ITER cursor is the table
+ * index after the returned pair, which a rebuild invalidates.
+ *
+ * A key and its value are kept in a single allocation.
+ */
+
+#ifndef _CHEEZE_KV_C
+#define _CHEEZE_KV_C
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "backend.h"
+
+#define KV_MIN_CAP 1024
+#define KV_TOMBSTONE ((char *)1)
+
+struct kv_entry {
+	char *key;		// NULL if empty, KV_TOMBSTONE if deleted
+	char *value;		// right after the key
+	uint32_t key_len;
+	uint32_t value_len;
+	uint32_t hash;
+};
+
+struct kv {
+	struct kv_entry *tab;
+	uint64_t cap;		// a power of two
+	uint64_t count;		// live entries
+	uint64_t used;		// live entries and tombstones
+
+	uint64_t puts, gets, deletes, iters, misses;
+};
+
+static inline int kv_live(const struct kv_entry *e)
+{
+	return e->key && e->key != KV_TOMBSTONE;
+}
+
+/* The entry holding key, or NULL.  *slot gets where to put it either way */
+static struct kv_entry *kv_find(struct kv *kv, const char *key, uint32_t key_len,
+				uint32_t hash, struct kv_entry **slot)
+{
+	uint64_t mask = kv->cap - 1, i;
+	struct kv_entry *e, *tomb = NULL;
+
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		e = &kv->tab[i];
+		if (!e->key)
+			break;
+		if (e->key == KV_TOMBSTONE) {
+			if (!tomb)
+				tomb = e;
+			continue;
+		}
+		if (e->hash == hash && e->key_len == key_len && !memcmp(e->key, key, key_len)) {
+			if (slot)
+				*slot = e;
+			return e;
+		}
+	}
+
+	if (slot)
+		*slot = tomb ? tomb : e;
+	return NULL;
+}
+
+static int kv_resize(struct kv *kv, uint64_t cap)
+{
+	struct kv_entry *old = kv->tab, *slot;
+	uint64_t old_cap = kv->cap, i;
+
+	kv->tab = calloc(cap, sizeof(*kv->tab));
+	if (!kv->tab) {
+		kv->tab = old;
+		return -ENOMEM;
+	}
+	kv->cap = cap;
+	kv->used = kv->count;
+
+	for (i = 0; i < old_cap; i++) {
+		if (!kv_live(&old[i]))
+			continue;
+		kv_find(kv, old[i].key, old[i].key_len, old[i].hash, &slot);
+		*slot = old[i];
+	}
+	free(old);
+
+	return 0;
+}
+
+static int kv_put(struct kv *kv, const char *key, uint32_t key_len,
+		  const char *value, uint32_t value_len)
+{
+	uint32_t hash = crc32c(0, key, key_len);
+	struct kv_entry *e, *slot;
+	uint64_t cap;
+	char *mem;
+
+	kv->puts++;
+
+	if ((kv->used + 1) * 10 > kv->cap * 7) {
+		for (cap = kv->cap; (kv->count + 1) * 10 > cap * 5; cap *= 2)
+			;
+		if (kv_resize(kv, cap))
+			return -ENOMEM;
+	}
+
+	mem = malloc((size_t)key_len + value_len);
+	if (!mem)
+		return -ENOMEM;
+	memcpy(mem, key, key_len);
+	memcpy(mem + key_len, value, value_len);
+
+	e = kv_find(kv, key, key_len, hash, &slot);
+	if (e) {
+		free(e->key);
+	} else {
+		e = slot;
+		if (!e->key)
+			kv->used++;
+		kv->count++;
+	}
+
+	e->key = mem;
+	e->value = mem + key_len;
+	e->key_len = key_len;
+	e->value_len = value_len;
+	e->hash = hash;
+
+	return 0;
+}
+
+static int kv_delete(struct kv *kv, const char *key, uint32_t key_len)
+{
+	struct kv_entry *e = kv_find(kv, key, key_len, crc32c(0, key, key_len), NULL);
+
+	kv->deletes++;
+	if (!e) {
+		kv->misses++;
+		return -ENOENT;
+	}
+
+	free(e->key);
+	e->key = KV_TOMBSTONE;
+	kv->count--;
+
+	return 0;
+}
+
+/* Copy the value of e out, the kernel fails the command if it did not fit */
+static void kv_out(struct cheeze_kv_hdr *hdr, char *buf, const struct kv_entry *e)
+{
+	if (e->value_len <= hdr->value_len)
+		memcpy(buf + CHEEZE_KV_VALUE_OFF, e->value, e->value_len);
+	hdr->value_len = e->value_len;
+}
+
+/* Serve the command in buf, sets ureq->ret */
+static void kv_handle(struct kv *kv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct cheeze_kv_hdr *hdr = (struct cheeze_kv_hdr *)buf;
+	const char *key = buf + CHEEZE_KV_KEY_OFF;
+	struct kv_entry *e;
+	uint64_t i;
+
+	if (hdr->key_len > CHEEZE_KV_MAX_KEY || hdr->value_len > CHEEZE_KV_MAX_VALUE ||
+	    ureq->len < CHEEZE_KV_VALUE_OFF + hdr->value_len) {
+		ureq->ret = -EINVAL;
+		return;
+	}
+
+	switch (ureq->op) {
+	case CHEEZE_OP_KV_PUT:
+		ureq->ret = kv_put(kv, key, hdr->key_len, buf + CHEEZE_KV_VALUE_OFF, hdr->value_len);
+		break;
+	case CHEEZE_OP_KV_GET:
+		kv->gets++;
+		e = kv_find(kv, key, hdr->key_len, crc32c(0, key, hdr->key_len), NULL);
+		if (!e) {
+			kv->misses++;
+			ureq->ret = -ENOENT;
+			break;
+		}
+		kv_out(hdr, buf, e);
+		break;
+	case CHEEZE_OP_KV_DELETE:
+		ureq->ret = kv_delete(kv, key, hdr->key_len);
+		break;
+	case CHEEZE_OP_KV_ITER:
+		kv->iters++;
+		for (i = hdr->cursor; i < kv->cap && !kv_live(&kv->tab[i]); i++)
+			;
+		if (i >= kv->cap) {
+			ureq->ret = -ENOENT;
+			break;
+		}
+		e = &kv->tab[i];
+		memcpy(buf + CHEEZE_KV_KEY_OFF, e->key, e->key_len);
+		hdr->key_len = e->key_len;
+		hdr->cursor = i + 1;
+		kv_out(hdr, buf, e);
+		break;
+	default:
+		ureq->ret = -EOPNOTSUPP;
+	}
+}
+
+static int kv_init(struct kv *kv)
+{
+	memset(kv, 0, sizeof(*kv));
+
+	kv->tab = calloc(KV_MIN_CAP, sizeof(*kv->tab));
+	if (!kv->tab) {
+		perror("kv: calloc");
+		return -1;
+	}
+	kv->cap = KV_MIN_CAP;
+
+	return 0;
+}
+
+static void kv_exit(struct kv *kv)
+{
+	uint64_t i;
+
+	for (i = 0; i < kv->cap; i++)
+		if (kv_live(&kv->tab[i]))
+			free(kv->tab[i].key);
+	free(kv->tab);
+}
+
+static void kv_print_stats(struct kv *kv, FILE *out)
+{
+	fprintf(out, "kv: %lu keys in %lu buckets, %lu puts, %lu gets, %lu deletes, %lu iters, %lu misses\n",
+		kv->count, kv->cap, kv->puts, kv->gets, kv->deletes, kv->iters, kv->misses);
+}
+
+#endif
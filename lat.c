@@ -0,0 +1,205 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+#define pr_fmt(fmt) "cheeze: " fmt
+
+/*
+ * Device latency and bandwidth emulation.
+ *
+ * Every request gets a deadline when it is submitted:
+ *
+ *	latency = delay_us + {read,write}_lat_us + len * {read,write}_ns_per_kb / 1024
+ *
+ * spread uniformly by +-lat_jitter_pct percent, and multiplied by
+ * lat_tail_mult for lat_tail_permille of the requests.  With bw_mbps set,
+ * requests also queue up behind each other on a single channel of that
+ * bandwidth, shared by reads and writes, and the later of the two wins.
+ *
+ * A request the daemon completed before its deadline is held on a per-slot
+ * hrtimer instead of being completed right away, so nothing spins on the
+ * emulated delay.
+ */
+
+#include <linux/module.h>
+#include <linux/blk-mq.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+
+#include "cheeze.h"
+
+// Well below the blk-mq timeout, which would otherwise race with the timer
+#define CHEEZE_LAT_MAX_NS NSEC_PER_SEC
+
+static unsigned long delay_us;
+module_param(delay_us, ulong, 0644);
+static unsigned int read_lat_us;
+module_param(read_lat_us, uint, 0644);
+static unsigned int write_lat_us;
+module_param(write_lat_us, uint, 0644);
+static unsigned int read_ns_per_kb;
+module_param(read_ns_per_kb, uint, 0644);
+static unsigned int write_ns_per_kb;
+module_param(write_ns_per_kb, uint, 0644);
+static unsigned int lat_jitter_pct;
+module_param(lat_jitter_pct, uint, 0644);
+static unsigned int lat_tail_permille;
+module_param(lat_tail_permille, uint, 0644);
+static unsigned int lat_tail_mult = 10;
+module_param(lat_tail_mult, uint, 0644);
+static unsigned int bw_mbps;
+module_param(bw_mbps, uint, 0644);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#define cheeze_rand() get_random_u32()
+#else
+#define cheeze_rand() prandom_u32()
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+#define CHEEZE_LAT_MODE HRTIMER_MODE_ABS_SOFT
+#else
+#define CHEEZE_LAT_MODE HRTIMER_MODE_ABS
+#endif
+
+static struct hrtimer *lat_timers; // CHEEZE_QUEUE_SIZE entries
+static atomic64_t bw_next; // ktime the channel is free again
+
+static u64 cheeze_lat_ns(int op, unsigned int len)
+{
+	unsigned int pct = min(READ_ONCE(lat_jitter_pct), 100U);
+	u64 ns = READ_ONCE(delay_us) * NSEC_PER_USEC;
+	u32 r;
+
+	switch (op) {
+	case REQ_OP_READ:
+		ns += (u64)READ_ONCE(read_lat_us) * NSEC_PER_USEC +
+		      (((u64)len * READ_ONCE(read_ns_per_kb)) >> 10);
+		break;
+	case REQ_OP_WRITE:
+	case CHEEZE_OP_ZONE_APPEND:
+		ns += (u64)READ_ONCE(write_lat_us) * NSEC_PER_USEC +
+		      (((u64)len * READ_ONCE(write_ns_per_kb)) >> 10);
+		break;
+	}
+
+	if (!ns)
+		return 0;
+
+	if (pct) {
+		// Uniform in [ns * (100 - pct), ns * (100 + pct)] / 100
+		r = cheeze_rand() % (2 * pct + 1);
+		ns = div_u64(ns * (100 - pct + r), 100);
+	}
+
+	if (lat_tail_permille && cheeze_rand() % 1000 < lat_tail_permille)
+		ns *= lat_tail_mult;
+
+	return ns;
+}
+
+/* Book len bytes on the channel, returns when the transfer is done */
+static ktime_t cheeze_bw_book(ktime_t now, unsigned int len, unsigned int mbps)
+{
+	s64 old, start, end;
+
+	// 1 MB/s moves 1000 bytes per microsecond
+	do {
+		old = atomic64_read(&bw_next);
+		start = max_t(s64, old, ktime_to_ns(now));
+		end = start + div_u64((u64)len * 1000, mbps);
+	} while (atomic64_cmpxchg(&bw_next, old, end) != old);
+
+	return ns_to_ktime(end);
+}
+
+/* Set req->deadline, called on submission */
+void cheeze_lat_start(struct cheeze_req *req)
+{
+	unsigned int mbps = READ_ONCE(bw_mbps);
+	ktime_t now, deadline;
+	u64 ns;
+
+	ns = cheeze_lat_ns(req->user.op, req->user.len);
+	if (!ns && !mbps) {
+		req->deadline = 0;
+		return;
+	}
+
+	now = ktime_get();
+	deadline = ktime_add_ns(now, ns);
+	if (mbps && req->is_rw)
+		deadline = max(deadline, cheeze_bw_book(now, req->user.len, mbps));
+
+	req->deadline = min(deadline, ktime_add_ns(now, CHEEZE_LAT_MAX_NS));
+}
+
+bool cheeze_lat_due(struct cheeze_req *req)
+{
+	return !req->deadline || ktime_after(ktime_get(), req->deadline);
+}
+
+static void cheeze_lat_done(struct cheeze_req *req)
+{
+	// No blk-mq to bounce the completion to the submitting CPU
+	if (req->bio)
+		cheeze_end_req(req);
+	else
+		blk_mq_complete_request(req->rq);
+}
+
+/* Complete a reaped request, now or once its deadline passed */
+void cheeze_lat_complete(struct cheeze_req *req)
+{
+	if (cheeze_lat_due(req)) {
+		cheeze_lat_done(req);
+		return;
+	}
+
+	hrtimer_start(&lat_timers[req->id], req->deadline, CHEEZE_LAT_MODE);
+}
+
+static enum hrtimer_restart cheeze_lat_fn(struct hrtimer *timer)
+{
+	cheeze_lat_done(&reqs[timer - lat_timers]);
+
+	return HRTIMER_NORESTART;
+}
+
+int cheeze_lat_init(void)
+{
+	int i;
+
+	lat_timers = kcalloc(CHEEZE_QUEUE_SIZE, sizeof(*lat_timers), GFP_KERNEL);
+	if (!lat_timers)
+		return -ENOMEM;
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+		hrtimer_setup(&lat_timers[i], cheeze_lat_fn, CLOCK_MONOTONIC, CHEEZE_LAT_MODE);
+#else
+		hrtimer_init(&lat_timers[i], CLOCK_MONOTONIC, CHEEZE_LAT_MODE);
+		lat_timers[i].function = cheeze_lat_fn;
+#endif
+	}
+
+	return 0;
+}
+
+void cheeze_lat_exit(void)
+{
+	int i;
+
+	if (!lat_timers)
+		return;
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++)
+		hrtimer_cancel(&lat_timers[i]);
+
+	kfree(lat_timers);
+	lat_timers = NULL;
+}
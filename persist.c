@@ -0,0 +1,453 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Persistence of the memory backend image across reboots.
+ *
+ * The image is checkpointed to a file that mirrors it offset for offset,
+ * followed by a header and a per-extent "present" map.  Extents that are
+ * all zeroes are punched out of the file instead of written.
+ *
+ * On stop, only the extents written to since they were restored or last
+ * checkpointed are written, by PERSIST_THREADS threads with O_DIRECT.
+ *
+ * On start, if the image did not survive since the checkpoint, it is
+ * restored lazily: the device serves I/O at once, an access to an extent
+ * that is not loaded yet loads it first, and PERSIST_THREADS threads load
+ * the rest in the background.  Extents that are not present are zeroes
+ * in a new hugepage image already.
+ *
+ * Whether the image survived is decided from the boot id: image_boot in
+ * the header is the boot during which the image was last known complete.
+ * The header state says whether the file holds a complete checkpoint and
+ * whether a daemon may have modified the image since.
+ */
+
+#ifndef _CHEEZE_PERSIST_C
+#define _CHEEZE_PERSIST_C
+
+/* O_DIRECT and fallocate() need _GNU_SOURCE, defined by the including file */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "backend.h"
+
+#define PERSIST_EXT_SHIFT 21
+#define PERSIST_EXT_SIZE (1UL << PERSIST_EXT_SHIFT) // 2 MiB
+#define PERSIST_MAGIC 0x74736973726570ULL // "persist"
+#define PERSIST_VERSION 1
+#define PERSIST_HDR_SIZE 4096
+#define PERSIST_THREADS 4
+#define PERSIST_BOOT_ID "/proc/sys/kernel/random/boot_id"
+
+enum {
+	PERSIST_CLEAN,		// complete checkpoint, no daemon since
+	PERSIST_IN_USE,		// complete checkpoint, a daemon may have changed the image since
+	PERSIST_WRITING,	// checkpoint in progress, the file is inconsistent
+};
+
+enum {
+	PERSIST_UNLOADED,
+	PERSIST_LOADING,
+	PERSIST_LOADED,
+};
+
+struct persist_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t state;
+	uint64_t size;
+	uint64_t ext_size;
+	char image_boot[40];
+};
+
+struct persist {
+	struct cheeze_mem *mem;
+	int fd;			// header and present map
+	int dfd;		// extents, O_DIRECT
+	uint64_t nr_ext;
+	uint64_t meta_off;	// header offset in the file
+	struct persist_hdr hdr;
+	char boot_id[40];
+
+	uint8_t *present;	// per extent, stored in the file
+	uint8_t *state;		// per extent, PERSIST_UNLOADED..LOADED
+	uint8_t *dirty;		// per extent, to be written by the next checkpoint
+
+	pthread_t threads[PERSIST_THREADS];
+	int nr_threads;
+	volatile int stop;
+	uint64_t next;		// next extent for the prefetch or checkpoint threads
+	int running;		// prefetch threads not done yet
+
+	uint64_t faults;	// extents loaded on access
+	uint64_t written, punched;
+};
+
+static inline uint64_t persist_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t persist_ext_len(struct persist *p, uint64_t ext)
+{
+	uint64_t off = ext << PERSIST_EXT_SHIFT;
+
+	return p->mem->size - off < PERSIST_EXT_SIZE ? p->mem->size - off : PERSIST_EXT_SIZE;
+}
+
+static int persist_read_boot_id(char *buf, size_t len)
+{
+	ssize_t ret;
+	int fd;
+
+	memset(buf, 0, len);
+	fd = open(PERSIST_BOOT_ID, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ret = read(fd, buf, len - 1);
+	close(fd);
+	if (ret <= 0)
+		return -1;
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return 0;
+}
+
+/* Write the header, and the present map with it if map is set */
+static int persist_write_hdr(struct persist *p, int map)
+{
+	char hdr[PERSIST_HDR_SIZE] = { 0 };
+
+	memcpy(hdr, &p->hdr, sizeof(p->hdr));
+	if (pwrite(p->fd, hdr, sizeof(hdr), p->meta_off) != sizeof(hdr))
+		return -1;
+	if (map && pwrite(p->fd, p->present, p->nr_ext, p->meta_off + PERSIST_HDR_SIZE) !=
+		   (ssize_t)p->nr_ext)
+		return -1;
+
+	return fdatasync(p->fd);
+}
+
+static void persist_load(struct persist *p, uint64_t ext)
+{
+	uint64_t off = ext << PERSIST_EXT_SHIFT, len = persist_ext_len(p, ext);
+	ssize_t ret;
+
+	ret = pread(p->dfd, p->mem->mem + off, len, off);
+	if (ret < 0) {
+		fprintf(stderr, "persist: failed to load extent %lu: %s\n", ext, strerror(errno));
+		ret = 0;
+	}
+	if ((uint64_t)ret < len)
+		memset(p->mem->mem + off + ret, 0, len - ret);
+}
+
+/* Make sure ext is loaded, by loading it or waiting for whoever does */
+static inline void persist_get(struct persist *p, uint64_t ext, int fault)
+{
+	uint8_t expected = PERSIST_UNLOADED;
+
+	if (__builtin_expect(__atomic_load_n(&p->state[ext], __ATOMIC_ACQUIRE) == PERSIST_LOADED, 1))
+		return;
+
+	if (__atomic_compare_exchange_n(&p->state[ext], &expected, PERSIST_LOADING, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		persist_load(p, ext);
+		__atomic_store_n(&p->state[ext], PERSIST_LOADED, __ATOMIC_RELEASE);
+		if (fault)
+			p->faults++;
+		return;
+	}
+
+	while (__atomic_load_n(&p->state[ext], __ATOMIC_ACQUIRE) != PERSIST_LOADED)
+		sched_yield();
+}
+
+/* Called before serving ureq, write is set if it modifies the image */
+static inline void persist_access(struct persist *p, struct cheeze_req_user *ureq, int write)
+{
+	uint64_t first = ((uint64_t)ureq->pos << CHEEZE_LOGICAL_BLOCK_SHIFT) >> PERSIST_EXT_SHIFT;
+	uint64_t last = (((uint64_t)ureq->pos << CHEEZE_LOGICAL_BLOCK_SHIFT) + ureq->len - 1) >>
+			PERSIST_EXT_SHIFT;
+	uint64_t ext;
+
+	if (!ureq->len)
+		return;
+
+	for (ext = first; ext <= last && ext < p->nr_ext; ext++) {
+		persist_get(p, ext, 1);
+		if (write)
+			p->dirty[ext] = 1;
+	}
+}
+
+static void *persist_prefetch_fn(void *arg)
+{
+	struct persist *p = arg;
+	uint64_t ext;
+
+	while (!p->stop) {
+		ext = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+		if (ext >= p->nr_ext)
+			break;
+		persist_get(p, ext, 0);
+	}
+
+	/* The last one to finish the whole image records it */
+	if (__atomic_sub_fetch(&p->running, 1, __ATOMIC_ACQ_REL) == 0 && !p->stop) {
+		strcpy(p->hdr.image_boot, p->boot_id);
+		if (persist_write_hdr(p, 0))
+			perror("persist: failed to write header");
+		printf("persist: image restored, %lu extents loaded on access\n", p->faults);
+		fflush(stdout);
+	}
+
+	return NULL;
+}
+
+static int persist_is_zero(const char *buf, uint64_t len)
+{
+	const uint64_t *w = (const uint64_t *)buf;
+	uint64_t i;
+
+	for (i = 0; i < len / sizeof(*w); i++)
+		if (w[i])
+			return 0;
+
+	return 1;
+}
+
+static void *persist_checkpoint_fn(void *arg)
+{
+	struct persist *p = arg;
+	uint64_t ext, off, len;
+
+	while ((ext = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->nr_ext) {
+		if (!p->dirty[ext])
+			continue;
+
+		off = ext << PERSIST_EXT_SHIFT;
+		len = persist_ext_len(p, ext);
+		if (persist_is_zero(p->mem->mem + off, len)) {
+			if (p->present[ext])
+				fallocate(p->dfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+			p->present[ext] = 0;
+			__atomic_add_fetch(&p->punched, 1, __ATOMIC_RELAXED);
+		} else {
+			if (pwrite(p->dfd, p->mem->mem + off, len, off) != (ssize_t)len) {
+				fprintf(stderr, "persist: failed to write extent %lu: %s\n",
+					ext, strerror(errno));
+				/* Leave the checkpoint marked as in progress */
+				p->stop = 1;
+				break;
+			}
+			p->present[ext] = 1;
+			__atomic_add_fetch(&p->written, 1, __ATOMIC_RELAXED);
+		}
+		p->dirty[ext] = 0;
+	}
+
+	return NULL;
+}
+
+static int persist_start_threads(struct persist *p, void *(*fn)(void *))
+{
+	int i;
+
+	p->next = 0;
+	p->running = PERSIST_THREADS;
+	for (i = 0; i < PERSIST_THREADS; i++) {
+		if (pthread_create(&p->threads[i], NULL, fn, p)) {
+			perror("persist: pthread_create");
+			p->running -= PERSIST_THREADS - i;
+			break;
+		}
+	}
+	p->nr_threads = i;
+
+	return i ? 0 : -1;
+}
+
+static void persist_join_threads(struct persist *p)
+{
+	int i;
+
+	for (i = 0; i < p->nr_threads; i++)
+		pthread_join(p->threads[i], NULL);
+	p->nr_threads = 0;
+}
+
+/* Open or create the checkpoint at path and restore the image from it if needed */
+static int persist_open(struct persist *p, struct cheeze_mem *mem, const char *path)
+{
+	int valid, restore;
+	uint64_t ext;
+
+	memset(p, 0, sizeof(*p));
+	p->mem = mem;
+	p->nr_ext = (mem->size + PERSIST_EXT_SIZE - 1) >> PERSIST_EXT_SHIFT;
+	p->meta_off = (mem->size + PERSIST_HDR_SIZE - 1) & ~(PERSIST_HDR_SIZE - 1ULL);
+
+	if (mem->size % 4096) {
+		fprintf(stderr, "persist: image size %lu is not a multiple of 4 KiB\n", mem->size);
+		return -1;
+	}
+
+	p->present = calloc(p->nr_ext, 1);
+	p->state = calloc(p->nr_ext, 1);
+	p->dirty = calloc(p->nr_ext, 1);
+	if (!p->present || !p->state || !p->dirty) {
+		perror("persist: calloc");
+		return -1;
+	}
+
+	p->fd = open(path, O_RDWR | O_CREAT, 0600);
+	p->dfd = open(path, O_RDWR | O_DIRECT);
+	/* Not every filesystem supports O_DIRECT, e.g. tmpfs */
+	if (p->dfd < 0 && errno == EINVAL)
+		p->dfd = open(path, O_RDWR);
+	if (p->fd < 0 || p->dfd < 0) {
+		fprintf(stderr, "persist: failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (persist_read_boot_id(p->boot_id, sizeof(p->boot_id)))
+		fprintf(stderr, "persist: no boot id, the image is always restored\n");
+
+	valid = pread(p->fd, &p->hdr, sizeof(p->hdr), p->meta_off) == sizeof(p->hdr) &&
+		p->hdr.magic == PERSIST_MAGIC && p->hdr.version == PERSIST_VERSION &&
+		p->hdr.size == mem->size && p->hdr.ext_size == PERSIST_EXT_SIZE &&
+		pread(p->fd, p->present, p->nr_ext, p->meta_off + PERSIST_HDR_SIZE) ==
+		(ssize_t)p->nr_ext;
+	if (valid && p->hdr.state == PERSIST_WRITING) {
+		fprintf(stderr, "persist: %s holds an interrupted checkpoint, ignoring it\n", path);
+		valid = 0;
+	}
+
+	if (!valid) {
+		/* Start over from the image as it is */
+		memset(&p->hdr, 0, sizeof(p->hdr));
+		p->hdr.magic = PERSIST_MAGIC;
+		p->hdr.version = PERSIST_VERSION;
+		p->hdr.size = mem->size;
+		p->hdr.ext_size = PERSIST_EXT_SIZE;
+		memset(p->present, 1, p->nr_ext);
+		if (ftruncate(p->fd, p->meta_off + PERSIST_HDR_SIZE + p->nr_ext)) {
+			perror("persist: ftruncate");
+			return -1;
+		}
+	}
+
+	restore = valid && (!p->boot_id[0] || strcmp(p->hdr.image_boot, p->boot_id));
+	for (ext = 0; ext < p->nr_ext; ext++) {
+		/* Extents missing from the checkpoint are zeroes in a new image */
+		p->state[ext] = restore && p->present[ext] ? PERSIST_UNLOADED : PERSIST_LOADED;
+		/* Without a clean checkpoint, the image may differ anywhere */
+		p->dirty[ext] = !valid || (!restore && p->hdr.state != PERSIST_CLEAN);
+	}
+
+	if (!valid || !restore)
+		strcpy(p->hdr.image_boot, p->boot_id);
+	p->hdr.state = PERSIST_IN_USE;
+	if (persist_write_hdr(p, 0)) {
+		perror("persist: failed to write header");
+		return -1;
+	}
+
+	if (restore) {
+		printf("persist: restoring the image from %s in the background\n", path);
+		if (persist_start_threads(p, persist_prefetch_fn))
+			return -1;
+	} else {
+		printf("persist: %s, image is up to date\n", valid ? path : "new checkpoint");
+	}
+
+	return 0;
+}
+
+/* Write the extents changed since the last checkpoint, once the daemon stopped */
+static int persist_checkpoint(struct persist *p)
+{
+	uint64_t start = persist_now_ns(), ns;
+
+	p->stop = 1;
+	persist_join_threads(p);
+
+	p->hdr.state = PERSIST_WRITING;
+	if (persist_write_hdr(p, 0)) {
+		perror("persist: failed to write header");
+		return -1;
+	}
+
+	p->stop = 0;
+	p->written = p->punched = 0;
+	if (persist_start_threads(p, persist_checkpoint_fn))
+		return -1;
+	persist_join_threads(p);
+	if (p->stop || fdatasync(p->dfd)) {
+		fprintf(stderr, "persist: checkpoint failed\n");
+		return -1;
+	}
+
+	p->hdr.state = PERSIST_CLEAN;
+	if (persist_write_hdr(p, 1)) {
+		perror("persist: failed to write header");
+		return -1;
+	}
+
+	ns = persist_now_ns() - start;
+	printf("persist: checkpoint wrote %lu extents, punched %lu, in %lu ms (%.1f MB/s)\n",
+	       p->written, p->punched, ns / 1000000,
+	       (double)(p->written << PERSIST_EXT_SHIFT) / ns * 1000);
+
+	return 0;
+}
+
+/*
+ * Backend handlers, wrapping the memory backend
+ */
+static int persist_be_read(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct persist *p = priv;
+
+	persist_access(p, ureq, 0);
+	return cheeze_mem_read(p->mem, ureq, buf);
+}
+
+static int persist_be_write(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct persist *p = priv;
+
+	persist_access(p, ureq, 1);
+	return cheeze_mem_write(p->mem, ureq, buf);
+}
+
+static int persist_be_discard(void *priv, struct cheeze_req_user *ureq)
+{
+	struct persist *p = priv;
+
+	persist_access(p, ureq, 1);
+	return cheeze_mem_discard(p->mem, ureq);
+}
+
+static const struct cheeze_backend persist_backend = {
+	.read = persist_be_read,
+	.write = persist_be_write,
+	.discard = persist_be_discard,
+};
+
+#endif
@@ -7,12 +7,16 @@
 #include <linux/delay.h>
 #include <linux/semaphore.h>
 #include <linux/blkdev.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
 #include <linux/genhd.h>
+#endif
 #include <linux/backing-dev.h>
 #include <linux/blk-mq.h>
 #include <linux/spinlock.h>
 
 #include "cheeze.h"
+#include "cheeze_trace.h"
 
 //static int front, rear;
 //static struct semaphore mutex, slots, items;
@@ -20,24 +24,56 @@ static struct semaphore slots, items;
 static struct list_head free_tag_list, processing_tag_list; 
 static spinlock_t queue_spin;
 static uint64_t seq;
+static int depth; // under queue_spin
 
 
 // Protect with lock
 struct cheeze_req *reqs = NULL;
 
-// Lock must be held and freed before and after push()
-uint64_t cheeze_push(struct request *rq, struct cheeze_req **preq) {
+/* opf is rq->cmd_flags or bio->bi_opf, they share the REQ_* flags */
+static unsigned int cheeze_rq_flags(unsigned int opf)
+{
+	unsigned int flags = 0;
+
+	if (op_is_sync(opf))
+		flags |= CHEEZE_REQ_SYNC;
+	if (opf & REQ_META)
+		flags |= CHEEZE_REQ_META;
+	if (opf & REQ_PRIO)
+		flags |= CHEEZE_REQ_PRIO;
+	if (opf & REQ_FUA)
+		flags |= CHEEZE_REQ_FUA;
+	if (opf & REQ_PREFLUSH)
+		flags |= CHEEZE_REQ_PREFLUSH;
+	if (opf & REQ_BACKGROUND)
+		flags |= CHEEZE_REQ_BACKGROUND;
+	if (opf & REQ_RAHEAD)
+		flags |= CHEEZE_REQ_RAHEAD;
+#ifdef REQ_SWAP
+	if (opf & REQ_SWAP)
+		flags |= CHEEZE_REQ_SWAP;
+#endif
+
+	return flags;
+}
+
+/*
+ * Lock must be held and freed before and after push()
+ * Exactly one of rq and bio is set, bio in bio_mode.
+ */
+uint64_t cheeze_push(struct request *rq, struct bio *bio, struct cheeze_req **preq) {
 	struct cheeze_req *req;
 	int id, op;
 	bool is_rw = true;
 	unsigned long irqflags;
 	uint64_t _seq;
 	struct cheeze_queue_item *item; 
+	unsigned int opf = rq ? rq->cmd_flags : bio->bi_opf;
 
-	op = req_op(rq);
+	op = opf & REQ_OP_MASK;
 	if (unlikely(op > 1)) {
 		is_rw = false;
-		switch (op = req_op(rq)) {
+		switch (op) {
 		case REQ_OP_FLUSH:
 			pr_warn("ignoring REQ_OP_FLUSH\n");
 			return SKIP;
@@ -50,6 +86,27 @@ uint64_t cheeze_push(struct request *rq, struct cheeze_req **preq) {
 		case REQ_OP_DISCARD:
 			pr_debug("REQ_OP_DISCARD\n");
 			break;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+		case REQ_OP_ZONE_APPEND:
+			is_rw = true;
+			op = CHEEZE_OP_ZONE_APPEND;
+			break;
+		case REQ_OP_ZONE_RESET:
+			op = CHEEZE_OP_ZONE_RESET;
+			break;
+		case REQ_OP_ZONE_RESET_ALL:
+			op = CHEEZE_OP_ZONE_RESET_ALL;
+			break;
+		case REQ_OP_ZONE_OPEN:
+			op = CHEEZE_OP_ZONE_OPEN;
+			break;
+		case REQ_OP_ZONE_CLOSE:
+			op = CHEEZE_OP_ZONE_CLOSE;
+			break;
+		case REQ_OP_ZONE_FINISH:
+			op = CHEEZE_OP_ZONE_FINISH;
+			break;
+#endif
 		default:
 			pr_warn("unsupported operation: %d\n", op);
 			return -EOPNOTSUPP;
@@ -69,24 +126,101 @@ uint64_t cheeze_push(struct request *rq, struct cheeze_req **preq) {
 	*preq = req;
 
 	req->rq = rq;
+	req->bio = bio;
+	req->ret = 0;
 	req->is_rw = is_rw;
+	req->sync = false;
+	req->cancelled = false;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	req->polled = rq && rq->mq_hctx->type == HCTX_TYPE_POLL;
+#else
+	req->polled = false;
+#endif
 
 	req->user.op = op;
-	req->user.pos = (blk_rq_pos(rq) << SECTOR_SHIFT) >> CHEEZE_LOGICAL_BLOCK_SHIFT;
-	req->user.len = blk_rq_bytes(rq);
+	if (rq) {
+		req->user.pos = (blk_rq_pos(rq) << SECTOR_SHIFT) >> CHEEZE_LOGICAL_BLOCK_SHIFT;
+		req->user.len = blk_rq_bytes(rq);
+		req->user.ioprio = req_get_ioprio(rq);
+	} else {
+		req->user.pos = (bio->bi_iter.bi_sector << SECTOR_SHIFT) >> CHEEZE_LOGICAL_BLOCK_SHIFT;
+		req->user.len = bio->bi_iter.bi_size;
+		req->user.ioprio = bio_prio(bio);
+	}
+	req->user.flags = cheeze_rq_flags(opf);
+	if (is_rw && READ_ONCE(cheeze_csum))
+		req->user.flags |= CHEEZE_REQ_CSUM;
+	req->user.ret = 0;
 	req->user.id = id;
+	req->id = id;
 	reinit_completion(&req->acked);
 	req->item = item;
 	_seq = seq++;
+	req->seq = _seq;
+	WRITE_ONCE(depth, depth + 1);
 
 	spin_unlock_irqrestore(&queue_spin, irqflags);
 
+	trace_cheeze_push(req);
+
 	//up(&mutex);	/* Unlock the buffer */
 	up(&items);	/* Announce available item */
 
 	return _seq;
 }
 
+/*
+ * Take a slot for cheeze_rw_page() or cheeze_kv(), which reap it
+ * themselves.  Without wait, NULL if all are busy and the caller falls
+ * back to a bio, with wait NULL only if interrupted.
+ */
+struct cheeze_req *cheeze_push_sync(int op, sector_t sector, unsigned int len, bool wait,
+				    uint64_t *pseq) {
+	struct cheeze_req *req;
+	unsigned long irqflags;
+	struct cheeze_queue_item *item;
+	bool is_rw = op == REQ_OP_READ || op == REQ_OP_WRITE;
+
+	if (wait ? down_interruptible(&slots) : down_trylock(&slots))
+		return NULL;
+
+	spin_lock_irqsave(&queue_spin, irqflags);
+
+	item = list_first_entry(&free_tag_list, struct cheeze_queue_item, tag_list);
+	list_move_tail(&item->tag_list, &processing_tag_list);
+
+	req = reqs + item->id;
+	req->rq = NULL;
+	req->bio = NULL;
+	req->ret = 0;
+	req->is_rw = is_rw;
+	req->polled = false;
+	req->sync = true;
+	req->cancelled = false;
+
+	req->user.op = op;
+	req->user.pos = (sector << SECTOR_SHIFT) >> CHEEZE_LOGICAL_BLOCK_SHIFT;
+	req->user.len = len;
+	req->user.flags = CHEEZE_REQ_SYNC;
+	if (is_rw && READ_ONCE(cheeze_csum))
+		req->user.flags |= CHEEZE_REQ_CSUM;
+	req->user.ioprio = 0;
+	req->user.ret = 0;
+	req->user.id = item->id;
+	req->id = item->id;
+	req->item = item;
+	req->seq = *pseq = seq++;
+	WRITE_ONCE(depth, depth + 1);
+
+	spin_unlock_irqrestore(&queue_spin, irqflags);
+
+	trace_cheeze_push(req);
+
+	up(&items);	/* Announce available item */
+
+	return req;
+}
+
 // Queue is locked until pop
 struct cheeze_req *cheeze_peek(void) {
 	int id, ret;
@@ -118,6 +252,7 @@ void cheeze_pop(int id) {
 	
 	item = req->item;
 	list_add_tail(&item->tag_list, &free_tag_list);
+	WRITE_ONCE(depth, depth - 1);
 
 	spin_unlock_irqrestore(&queue_spin, irqflags);
 
@@ -135,6 +270,7 @@ void cheeze_move_pop(int id) {
 	
 	item = req->item;
 	list_move_tail(&item->tag_list, &free_tag_list);
+	WRITE_ONCE(depth, depth - 1);
 
 	spin_unlock_irqrestore(&queue_spin, irqflags);
 
@@ -158,6 +294,12 @@ void cheeze_queue_init(void) {
 	sema_init(&slots, CHEEZE_QUEUE_SIZE);	/* Initially, buf has n empty slots */
 	sema_init(&items, 0);	/* Initially, buf has zero data items */
 	seq = 0;
+	depth = 0;
+}
+
+/* Number of slots currently handed out, unlocked so only a snapshot */
+int cheeze_queue_depth(void) {
+	return READ_ONCE(depth);
 }
 
 
@@ -13,6 +13,9 @@ struct cheeze_req_user {
 	int op;
 	unsigned int pos; // sector_t
 	unsigned int len;
+	unsigned int flags;
+	unsigned int ioprio;
+	int ret;
 } __attribute__((aligned(8), packed));
 
 #define TRACE_TARGET "/trace"
@@ -30,7 +33,7 @@ int main() {
 	}
 
 	while (read(dumpfd, &ureq, sizeof(ureq)) == sizeof(ureq)) {
-		printf("id=%d\n    op=%d\n    pos=%u\n    len=%u\n\n", ureq.id, ureq.op, ureq.pos, ureq.len);
+		printf("id=%d\n    op=%d\n    pos=%u\n    len=%u\n    flags=0x%x\n    ioprio=0x%x\n    ret=%d\n\n", ureq.id, ureq.op, ureq.pos, ureq.len, ureq.flags, ureq.ioprio, ureq.ret);
 		if (ureq.len) {
 			printf("    crc {\n");
 			for (i = 0; i < ureq.len; i += 4096) {
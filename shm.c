@@ -4,15 +4,23 @@
  */
 
 #include <linux/blkdev.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
 #include <linux/genhd.h>
+#endif
 #include <linux/backing-dev.h>
 #include <linux/blk-mq.h>
 
 #include <linux/crc32.h>
+#include <linux/crc32c.h>
 #include <linux/module.h>
-#include <linux/delay.h>
 #include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <linux/bitops.h>
+#include <linux/uaccess.h>
 #include "cheeze.h"
+#include "cheeze_trace.h"
 
 static void *page_addr[3];
 //static void *meta_addr; // page_addr[0] ==> send_event_addr, recv_event_addr, seq_addr, ureq_addr
@@ -20,73 +28,299 @@ static uint8_t *send_event_addr; // CHEEZE_QUEUE_SIZE ==> 16B
 static uint8_t *recv_event_addr; // 16B
 static uint64_t *seq_addr; // 8KB
 static struct cheeze_req_user *ureq_addr; // sizeof(req) * 1024
-void *cheeze_data_addr[2]; // page_addr[1]: 1GB, page_addr[2]: 1GB
+static struct cheeze_shm_ctl *ctl_addr;
+static uint32_t *csum_addr; // CSUMS_PER_SLOT * 1024
+void *cheeze_slot_addr[CHEEZE_QUEUE_SIZE]; // CHEEZE_BUF_SIZE each
 
 static struct task_struct *shm_task = NULL;
 
-static void shm_meta_init(void *ppage_addr);
+static struct cheeze_shm_ctl *shm_meta_init(void *ppage_addr);
 static void shm_data_init(void **ppage_addr);
+static int shm_start(void);
 
-static unsigned long delay_us;
-module_param(delay_us, ulong, 0644);
+/*
+ * Checksum every 4 KiB block while it is hot in the cache from the copy,
+ * so that the daemon never has to read it again for its own CRC.
+ */
+bool cheeze_csum;
+module_param_named(csum, cheeze_csum, bool, 0644);
 
-int cheeze_do_request(struct cheeze_req *req)
+static inline uint32_t cheeze_block_crc(const void *p)
+{
+	// Same as crc32c(0, p, len) in the userspace crc32c.c
+	return ~crc32c(~0U, p, CHEEZE_LOGICAL_BLOCK_SIZE);
+}
+
+/* Copy one segment at off in the slot */
+static int cheeze_copy_bvec(struct cheeze_req *req, struct bio_vec *bvec, loff_t off,
+			    void *ubuf, uint32_t *csums)
+{
+	/* Get pointer to the data */
+	void *bbuf = page_address(bvec->bv_page) + bvec->bv_offset;
+
+	pr_debug("off: %lld, len: %u, dest_buf: %px, user_buf: %px\n", off, bvec->bv_len, bbuf, ubuf);
+
+	switch (req->user.op) {
+	case REQ_OP_WRITE:
+	case CHEEZE_OP_ZONE_APPEND:
+		// Write
+		memcpy(ubuf + off, bbuf, 1 << CHEEZE_LOGICAL_BLOCK_SHIFT);
+		if (csums)
+			csums[off >> CHEEZE_LOGICAL_BLOCK_SHIFT] = cheeze_block_crc(bbuf);
+		break;
+	case REQ_OP_READ:
+		// Read
+		memcpy(bbuf, ubuf + off, 1 << CHEEZE_LOGICAL_BLOCK_SHIFT);
+		if (csums && unlikely(cheeze_block_crc(bbuf) !=
+				      READ_ONCE(csums[off >> CHEEZE_LOGICAL_BLOCK_SHIFT]))) {
+			pr_err_ratelimited("checksum mismatch at block %llu\n",
+					   (unsigned long long)req->user.pos +
+					   (off >> CHEEZE_LOGICAL_BLOCK_SHIFT));
+			return -EILSEQ;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+/* Copy the segments of req starting within [start, end) */
+static int cheeze_copy_range(struct cheeze_req *req, loff_t start, loff_t end)
 {
-	unsigned long b_len = 0;
 	struct bio_vec bvec;
 	struct req_iterator iter;
+	struct bvec_iter biter;
 	loff_t off = 0;
-	void *bbuf, *ubuf;
-	struct request *rq;
-
-	if (delay_us)
-		udelay(delay_us);
+	void *ubuf;
+	uint32_t *csums = NULL;
+	int ret = 0;
 
-	rq = req->rq;
 	ubuf = get_buf_addr(req->user.id);
 
-	pr_debug("%s++\n", __func__);
+	if ((req->user.op != REQ_OP_READ && (req->user.flags & CHEEZE_REQ_CSUM)) ||
+	    (req->user.op == REQ_OP_READ && (req->user.flags & CHEEZE_REQ_CSUM_VALID)))
+		csums = csum_addr + req->user.id * CSUMS_PER_SLOT;
 
 	/* Iterate over all requests segments */
-	rq_for_each_segment(bvec, rq, iter) {
-		b_len = bvec.bv_len;
-
-		/* Get pointer to the data */
-		bbuf = page_address(bvec.bv_page) + bvec.bv_offset;
-
-		pr_debug("off: %lld, len: %ld, dest_buf: %px, user_buf: %px\n", off, b_len, bbuf, ubuf);
-
-		switch (req->user.op) {
-		case REQ_OP_WRITE:
-			// Write
-			memcpy(ubuf + off, bbuf, 1 << CHEEZE_LOGICAL_BLOCK_SHIFT);
-			break;
-		case REQ_OP_READ:
-			// Read
-			memcpy(bbuf, ubuf + off, 1 << CHEEZE_LOGICAL_BLOCK_SHIFT);
-			break;
+	if (req->bio) {
+		bio_for_each_segment(bvec, req->bio, biter) {
+			if (off >= end)
+				break;
+			if (off >= start && cheeze_copy_bvec(req, &bvec, off, ubuf, csums))
+				ret = -EILSEQ;
+			off += bvec.bv_len;
+		}
+	} else {
+		rq_for_each_segment(bvec, req->rq, iter) {
+			if (off >= end)
+				break;
+			if (off >= start && cheeze_copy_bvec(req, &bvec, off, ubuf, csums))
+				ret = -EILSEQ;
+			off += bvec.bv_len;
 		}
-
-		/* Increment counters */
-		off += b_len;
 	}
 
+	return ret;
+}
+
+int cheeze_do_request(struct cheeze_req *req)
+{
+	int ret;
+
+	pr_debug("%s++\n", __func__);
+
+	trace_cheeze_copy(req);
+	ret = cheeze_copy_range(req, 0, LLONG_MAX);
+
 	pr_debug("%s--\n", __func__);
 
-	return 0;
+	return ret;
+}
+
+/*
+ * Large reads are copied out of the shm slot by up to CHEEZE_COPY_CHUNKS
+ * CPUs in parallel.  The completing CPU takes the first chunk, the rest are
+ * queued on cheeze_copy_wq and the last chunk to finish ends the request.
+ */
+#define CHEEZE_COPY_CHUNKS 8
+
+static unsigned int copy_split_kb = 256;
+module_param(copy_split_kb, uint, 0644);
+
+struct cheeze_copy_work {
+	struct work_struct work;
+	struct cheeze_req *req;
+	loff_t start, end;
+};
+
+struct cheeze_copy_ctx {
+	atomic_t pending;
+	int ret;
+	struct cheeze_copy_work works[CHEEZE_COPY_CHUNKS];
+};
+
+static struct cheeze_copy_ctx *copy_ctx; // CHEEZE_QUEUE_SIZE entries
+static struct workqueue_struct *cheeze_copy_wq;
+
+/*
+ * A daemon that stalled rather than died may have read a cancelled request
+ * and still set its recv flag later.  The slot of a cancelled request is
+ * therefore not handed out again once the request ended, but parked until
+ * kshm sees that late completion, or a new daemon generation that never
+ * saw the request, see cheeze_release_parked().
+ */
+static DECLARE_BITMAP(cheeze_parked, CHEEZE_QUEUE_SIZE);
+
+/* Hand the slot of a request that ended back */
+static void cheeze_put_slot(struct cheeze_req *req)
+{
+	if (unlikely(req->cancelled)) {
+		// Done with req, kshm may reuse it from now on
+		smp_mb__before_atomic();
+		set_bit(req->id, cheeze_parked);
+		return;
+	}
+
+	cheeze_move_pop(req->id);
+}
+
+static void __cheeze_end_req(struct cheeze_req *req)
+{
+	blk_status_t status = req->ret < 0 ? BLK_STS_IOERR : BLK_STS_OK;
+
+	trace_cheeze_end(req);
+
+	if (req->bio) {
+		req->bio->bi_status = status;
+		bio_endio(req->bio);
+		cheeze_put_slot(req);
+		return;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	/* The daemon reported where the data landed in pos */
+	if (req->user.op == CHEEZE_OP_ZONE_APPEND && req->ret == 0)
+		req->rq->__sector = (sector_t)req->user.pos <<
+				    (CHEEZE_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT);
+#endif
+	blk_mq_end_request(req->rq, status);
+	cheeze_put_slot(req);
+	//complete(&req->acked);
+}
+
+static void cheeze_copy_workfn(struct work_struct *work)
+{
+	struct cheeze_copy_work *cw = container_of(work, struct cheeze_copy_work, work);
+	struct cheeze_req *req = cw->req;
+	struct cheeze_copy_ctx *ctx = &copy_ctx[req->id];
+	int ret;
+
+	ret = cheeze_copy_range(req, cw->start, cw->end);
+	if (ret)
+		WRITE_ONCE(ctx->ret, ret);
+
+	if (atomic_dec_and_test(&ctx->pending)) {
+		req->ret = READ_ONCE(ctx->ret);
+		__cheeze_end_req(req);
+	}
+}
+
+static bool cheeze_copy_split(struct cheeze_req *req)
+{
+	struct cheeze_copy_ctx *ctx;
+	struct cheeze_copy_work *cw;
+	unsigned int len = req->user.len;
+	unsigned int chunk, n, i;
+
+	if (!cheeze_copy_wq || !copy_split_kb || len < copy_split_kb * 1024)
+		return false;
+
+	n = min_t(unsigned int, CHEEZE_COPY_CHUNKS, num_online_cpus());
+	chunk = round_up(DIV_ROUND_UP(len, n), PAGE_SIZE);
+	n = DIV_ROUND_UP(len, chunk);
+	if (n < 2)
+		return false;
+
+	trace_cheeze_copy(req);
+
+	ctx = &copy_ctx[req->id];
+	ctx->ret = 0;
+	atomic_set(&ctx->pending, n);
+
+	for (i = 0; i < n; i++) {
+		cw = &ctx->works[i];
+		cw->req = req;
+		cw->start = (loff_t)i * chunk;
+		cw->end = min_t(loff_t, len, (loff_t)(i + 1) * chunk);
+		if (i)
+			queue_work(cheeze_copy_wq, &cw->work);
+	}
+
+	cheeze_copy_workfn(&ctx->works[0].work);
+
+	return true;
 }
 
-static void do_request(struct cheeze_req *req)
+/*
+ * Called on the submitting CPU through blk_mq_ops->complete, or right
+ * where the request was reaped in bio_mode
+ */
+void cheeze_end_req(struct cheeze_req *req)
 {
+	// Cancelled by the timeout handler
+	if (unlikely(req->ret < 0))
+		goto end;
+
+	// Failed by the daemon
+	if (unlikely(req->user.ret < 0)) {
+		req->ret = req->user.ret;
+		goto end;
+	}
+
 	// Process bio
-	if (likely(req->is_rw) && req->user.op == READ)
+	if (likely(req->is_rw) && req->user.op == READ) {
+		if (cheeze_copy_split(req))
+			return;
 		req->ret = cheeze_do_request(req);
-	else
+	} else {
 		req->ret = 0;
+	}
 
-	blk_mq_end_request(req->rq, req->ret < 0 ? BLK_STS_IOERR : BLK_STS_OK);
-	cheeze_move_pop(req->id);
-	//complete(&req->acked);
+end:
+	__cheeze_end_req(req);
+}
+
+int cheeze_copy_init(void)
+{
+	int i, j;
+
+	// kvcalloc() is 4.18+
+	copy_ctx = kvzalloc(CHEEZE_QUEUE_SIZE * sizeof(*copy_ctx), GFP_KERNEL);
+	if (!copy_ctx)
+		return -ENOMEM;
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++)
+		for (j = 0; j < CHEEZE_COPY_CHUNKS; j++)
+			INIT_WORK(&copy_ctx[i].works[j].work, cheeze_copy_workfn);
+
+	cheeze_copy_wq = alloc_workqueue("cheeze_copy", WQ_UNBOUND | WQ_HIGHPRI, 0);
+	if (!cheeze_copy_wq) {
+		kvfree(copy_ctx);
+		copy_ctx = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void cheeze_copy_exit(void)
+{
+	if (cheeze_copy_wq)
+		destroy_workqueue(cheeze_copy_wq);
+	cheeze_copy_wq = NULL;
+
+	kvfree(copy_ctx);
+	copy_ctx = NULL;
 }
 
 int send_req (struct cheeze_req *req, int id, uint64_t seq) {
@@ -98,42 +332,497 @@ int send_req (struct cheeze_req *req, int id, uint64_t seq) {
 	// ??? memcpy(ureq, req->user, sizeof(*ureq));
 	seq_addr[id] = seq;
 	pr_debug("%s: id = %d, seq = %llu\n", __func__, id, seq);
+	trace_cheeze_send(req);
 	/* memory barrier XXX:Arm */
 	//*send = *send | (1ULL << (id % BITS_PER_EVENT));
 	barrier();
 	*send = 1;
 	/* memory barrier XXX:Arm */
+	cheeze_chr_wake(id);
 	return 0;
 }
 
+/* Set up once the layout is in place, either from page_addr2 or the chr device */
+bool cheeze_shm_ready(void)
+{
+	return smp_load_acquire(&ctl_addr) != NULL;
+}
+
+/* Whether a request is published in slot id and not completed by the daemon yet */
+/* A daemon attaches through /dev/cheeze-ctl, called once it was fenced out */
+uint64_t cheeze_shm_attach(void)
+{
+	uint64_t gen = READ_ONCE(ctl_addr->generation) + 1;
+
+	WRITE_ONCE(ctl_addr->generation, gen);
+
+	return gen;
+}
+
+uint64_t cheeze_shm_generation(void)
+{
+	return READ_ONCE(ctl_addr->generation);
+}
+
+bool cheeze_shm_slot_pending(int id)
+{
+	return READ_ONCE(send_event_addr[id]) && !READ_ONCE(recv_event_addr[id]);
+}
+
+bool cheeze_shm_pending(void)
+{
+	int i;
+
+	if (!cheeze_shm_ready())
+		return false;
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++)
+		if (cheeze_shm_slot_pending(i))
+			return true;
+
+	return false;
+}
+
+/*
+ * Both kshm and the .poll callback scan recv_event_addr, so a slot is
+ * claimed through cheeze_reaping before it is completed.  The recv flag is
+ * re-checked under the claim as the previous owner clears it first.  A
+ * cancelled request was already failed, its late completion only releases
+ * the parked slot.
+ */
+static DECLARE_BITMAP(cheeze_reaping, CHEEZE_QUEUE_SIZE);
+
+static inline bool claim_recv(int id)
+{
+	if (test_and_set_bit_lock(id, cheeze_reaping))
+		return false;
+
+	if (!READ_ONCE(recv_event_addr[id]) || READ_ONCE(reqs[id].cancelled)) {
+		clear_bit_unlock(id, cheeze_reaping);
+		return false;
+	}
+
+	return true;
+}
+
+static void reap_req(int id)
+{
+	struct cheeze_req *req = reqs + id;
+
+	pr_debug("%s: id = %d\n", __func__, id);
+	// XXX: Optimize with zerocopy
+	memcpy(&req->user, ureq_addr + id, sizeof(struct cheeze_req_user));
+	ureq_print(req->user);
+	trace_cheeze_recv(req);
+	/* memory barrier XXX:Arm */
+	barrier();
+	/* id may be handed out again by cheeze_push() once cheeze_end_req() pops it */
+	send_event_addr[id] = 0;
+	barrier();
+	recv_event_addr[id] = 0;
+	clear_bit_unlock(id, cheeze_reaping);
+	/* memory barrier XXX:Arm */
+}
+
 static void recv_req (void) {
-	uint8_t *recv;
-	int i, id, j;
+	int i, nr = 0;
+	static int done[CHEEZE_QUEUE_SIZE];
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++) {
+		/*
+		 * Requests on poll queues are reaped by cheeze_poll(), sync
+		 * ones by the cheeze_rw_page() spinning on them
+		 */
+		if (recv_event_addr[i] && !reqs[i].polled && !reqs[i].sync && claim_recv(i)) {
+			reap_req(i);
+			done[nr++] = i;
+		}
+	}
+
+	/*
+	 * Hand the whole scan to blk-mq back to back.  The read copy and
+	 * blk_mq_end_request() run on the submitting CPU (or one sharing its
+	 * cache), and kernels that queue remote completions on a per-CPU list
+	 * send one IPI per CPU for the batch.
+	 */
+	for (i = 0; i < nr; i++)
+		cheeze_lat_complete(reqs + done[i]);
+}
+
+/* Reap slot id right away if the daemon completed it, without waiting for kshm */
+void cheeze_shm_reap(int id)
+{
+	if (reqs[id].polled || reqs[id].sync || !claim_recv(id))
+		return;
+
+	reap_req(id);
+	cheeze_lat_complete(reqs + id);
+}
+
+/*
+ * A daemon counts as alive while its heartbeat or generation moved within
+ * the last restart_grace_ms, which gives a restarted daemon time to attach.
+ */
+static unsigned int restart_grace_ms = 10000;
+module_param(restart_grace_ms, uint, 0644);
+
+bool cheeze_daemon_alive(void)
+{
+	static DEFINE_SPINLOCK(alive_lock);
+	static uint64_t last_beat, last_gen;
+	static unsigned long last_seen = INITIAL_JIFFIES;
+	unsigned long flags;
+	uint64_t beat, gen;
+	bool alive;
+
+	if (!ctl_addr)
+		return false;
+
+	beat = READ_ONCE(ctl_addr->heartbeat);
+	gen = READ_ONCE(ctl_addr->generation);
+
+	spin_lock_irqsave(&alive_lock, flags);
+	if (beat != last_beat || gen != last_gen) {
+		last_beat = beat;
+		last_gen = gen;
+		last_seen = jiffies;
+	}
+	alive = time_before(jiffies, last_seen + msecs_to_jiffies(restart_grace_ms));
+	spin_unlock_irqrestore(&alive_lock, flags);
+
+	return alive;
+}
+
+/*
+ * Take back an outstanding slot from the shm ring so that it can be failed.
+ * Returns false if the daemon already completed it, kshm will reap it then.
+ */
+bool cheeze_cancel_req(struct cheeze_req *req)
+{
+	int id = req->id;
+
+	if (test_and_set_bit_lock(id, cheeze_reaping))
+		return false;
+
+	if (READ_ONCE(recv_event_addr[id])) {
+		clear_bit_unlock(id, cheeze_reaping);
+		return false;
+	}
+
+	send_event_addr[id] = 0;
+	req->cancel_gen = READ_ONCE(ctl_addr->generation);
+	WRITE_ONCE(req->cancelled, true);
+	clear_bit_unlock(id, cheeze_reaping);
+
+	req->ret = -ETIMEDOUT;
+
+	return true;
+}
+
+/*
+ * Hand parked slots back once the daemon set their recv flag after all,
+ * or a new daemon attached.  The daemon of an older generation can no
+ * longer complete anything, see CHEEZE_IOC_ATTACH.
+ */
+static void cheeze_release_parked(void)
+{
+	struct cheeze_req *req;
+	int id;
+
+	for_each_set_bit(id, cheeze_parked, CHEEZE_QUEUE_SIZE) {
+		req = reqs + id;
+		if (!READ_ONCE(recv_event_addr[id]) &&
+		    READ_ONCE(ctl_addr->generation) == req->cancel_gen)
+			continue;
+
+		if (test_and_set_bit_lock(id, cheeze_reaping))
+			continue;
+		send_event_addr[id] = 0;
+		barrier();
+		recv_event_addr[id] = 0;
+		clear_bit_unlock(id, cheeze_reaping);
+
+		pr_info_ratelimited("released cancelled slot id=%d\n", id);
+		clear_bit(id, cheeze_parked);
+		cheeze_move_pop(id);
+	}
+}
+
+/*
+ * Publish a slot taken by cheeze_push_sync() and spin on its recv flag
+ * until the daemon completed it, then reap it.  Returns req->ret, which is
+ * -ETIMEDOUT if the daemon is gone, the daemon's result is in req->user.
+ */
+static int cheeze_sync_wait(struct cheeze_req *req, uint64_t seq)
+{
+	unsigned long next_check;
+	int id = req->id;
+
+	cheeze_lat_start(req);
+	send_req(req, id, seq);
+
+	next_check = jiffies + HZ / 10;
+	while (!READ_ONCE(recv_event_addr[id]) || !cheeze_lat_due(req)) {
+		cpu_relax();
+		if (time_before(jiffies, next_check))
+			continue;
+		next_check = jiffies + HZ / 10;
+		if (!cheeze_daemon_alive() && cheeze_cancel_req(req)) {
+			pr_warn_ratelimited("no daemon, failing sync request id=%d\n", id);
+			return req->ret;
+		}
+		cond_resched();
+	}
+
+	// Nobody else reaps sync slots, but cheeze_cancel_req() may hold the claim
+	while (!claim_recv(id))
+		cpu_relax();
+	reap_req(id);
+
+	return 0;
+}
+
+/*
+ * Serve a single page synchronously: publish it, spin on its recv flag and
+ * copy it in place, all on the calling CPU.  Returns -EBUSY when no slot
+ * is free and -EIO once the daemon is gone, the page then goes through
+ * the regular path.
+ */
+int cheeze_rw_page(struct page *page, sector_t sector, bool write)
+{
+	struct cheeze_req *req;
+	uint32_t *csum;
+	void *buf;
+	uint64_t seq;
+	int id, ret;
+
+	if (unlikely(!cheeze_shm_ready()))
+		return -EIO;
+
+	req = cheeze_push_sync(write ? REQ_OP_WRITE : REQ_OP_READ, sector, PAGE_SIZE, false, &seq);
+	if (!req)
+		return -EBUSY;
+
+	id = req->id;
+	buf = get_buf_addr(id);
+	csum = csum_addr + id * CSUMS_PER_SLOT;
+
+	if (write) {
+		trace_cheeze_copy(req);
+		memcpy(buf, page_address(page), PAGE_SIZE);
+		if (req->user.flags & CHEEZE_REQ_CSUM)
+			*csum = cheeze_block_crc(buf);
+	}
+
+	ret = cheeze_sync_wait(req, seq);
+	if (ret)
+		goto out;
+
+	ret = req->user.ret;
+	if (!write && !ret) {
+		trace_cheeze_copy(req);
+		memcpy(page_address(page), buf, PAGE_SIZE);
+		if ((req->user.flags & CHEEZE_REQ_CSUM_VALID) &&
+		    unlikely(cheeze_block_crc(page_address(page)) != READ_ONCE(*csum))) {
+			pr_err_ratelimited("checksum mismatch at block %u\n", req->user.pos);
+			ret = -EILSEQ;
+		}
+	}
+
+out:
+	trace_cheeze_end(req);
+	cheeze_put_slot(req);
+
+	return ret;
+}
+
+/*
+ * Serve a key-value command through a slot, the same way as
+ * cheeze_rw_page() but waiting for a free slot.  See CHEEZE_OP_KV_PUT.
+ */
+int cheeze_kv(struct cheeze_kv_cmd *cmd)
+{
+	struct cheeze_kv_hdr *hdr;
+	struct cheeze_req *req;
+	uint32_t value_len;
+	uint64_t seq;
+	char *buf;
+	int ret;
+
+	switch (cmd->op) {
+	case CHEEZE_OP_KV_PUT:
+	case CHEEZE_OP_KV_GET:
+	case CHEEZE_OP_KV_DELETE:
+		if (!cmd->key_len)
+			return -EINVAL;
+		break;
+	case CHEEZE_OP_KV_ITER:
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (cmd->key_len > CHEEZE_KV_MAX_KEY || cmd->value_len > CHEEZE_KV_MAX_VALUE)
+		return -EINVAL;
+
+	if (unlikely(!cheeze_shm_ready()))
+		return -ENODEV;
+
+	req = cheeze_push_sync(cmd->op, 0, CHEEZE_KV_VALUE_OFF + cmd->value_len, true, &seq);
+	if (!req)
+		return -EINTR;
+
+	buf = get_buf_addr(req->id);
+	hdr = (struct cheeze_kv_hdr *)buf;
+	hdr->cursor = cmd->cursor;
+	hdr->key_len = cmd->key_len;
+	hdr->value_len = cmd->value_len;
+
+	ret = -EFAULT;
+	if (cmd->op != CHEEZE_OP_KV_ITER &&
+	    copy_from_user(buf + CHEEZE_KV_KEY_OFF, u64_to_user_ptr(cmd->key), cmd->key_len))
+		goto out;
+	if (cmd->op == CHEEZE_OP_KV_PUT &&
+	    copy_from_user(buf + CHEEZE_KV_VALUE_OFF, u64_to_user_ptr(cmd->value), cmd->value_len))
+		goto out;
+
+	ret = cheeze_sync_wait(req, seq);
+	if (ret)
+		goto out;
+	ret = req->user.ret;
+	if (ret || cmd->op == CHEEZE_OP_KV_PUT || cmd->op == CHEEZE_OP_KV_DELETE)
+		goto out;
+
+	// Don't trust the daemon with the sizes, it can change them under us
+	value_len = READ_ONCE(hdr->value_len);
+	if (value_len > cmd->value_len) {
+		cmd->value_len = value_len;
+		ret = -ENOSPC;
+		goto out;
+	}
+	cmd->value_len = value_len;
+	if (copy_to_user(u64_to_user_ptr(cmd->value), buf + CHEEZE_KV_VALUE_OFF, cmd->value_len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	if (cmd->op == CHEEZE_OP_KV_ITER) {
+		cmd->cursor = READ_ONCE(hdr->cursor);
+		cmd->key_len = min_t(uint32_t, READ_ONCE(hdr->key_len), CHEEZE_KV_MAX_KEY);
+		if (copy_to_user(u64_to_user_ptr(cmd->key), buf + CHEEZE_KV_KEY_OFF, cmd->key_len))
+			ret = -EFAULT;
+	}
+
+out:
+	trace_cheeze_end(req);
+	cheeze_put_slot(req);
+
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+/* Reap completions of hctx in the caller's context */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+int cheeze_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+#else
+int cheeze_poll(struct blk_mq_hw_ctx *hctx)
+#endif
+{
+	int i, found = 0;
 	struct cheeze_req *req;
 
 	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++) {
-		recv = recv_event_addr + i;
-		if (*recv) {
-			id = i;
-			pr_debug("%s: id = %d (i: %d, j: %d)\n", __func__, id, i, j);
-			req = reqs + id;
-			// XXX: Optimize with zerocopy
-			memcpy(&req->user, ureq_addr + id, sizeof(struct cheeze_req_user));
-			ureq_print(req->user);
-			do_request(req);
-				/* memory barrier XXX:Arm */
-			barrier();
-			*recv = 0;
-			/* memory barrier XXX:Arm */
+		if (!recv_event_addr[i])
+			continue;
+
+		req = reqs + i;
+		if (!req->polled || req->rq->mq_hctx != hctx)
+			continue;
+
+		/* Keep the poller spinning until the emulated completion */
+		if (!cheeze_lat_due(req))
+			continue;
+
+		if (claim_recv(i)) {
+			reap_req(i);
+			/* Already on the submitting CPU */
+			cheeze_end_req(req);
+			found++;
 		}
 	}
+
+	return found;
 }
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+static struct cheeze_zone *zones_addr; // CHEEZE_MAX_ZONES
+
+/* Lay out an empty zone table, the daemon owns it from then on */
+int cheeze_zones_init(uint64_t nr_zones, uint64_t zone_blocks)
+{
+	uint64_t i;
+
+	if (!ctl_addr)
+		return -ENODEV;
+	if (nr_zones > CHEEZE_MAX_ZONES)
+		return -E2BIG;
+
+	for (i = 0; i < nr_zones; i++) {
+		zones_addr[i].start = i * zone_blocks;
+		zones_addr[i].len = zone_blocks;
+		zones_addr[i].wp = zones_addr[i].start;
+		zones_addr[i].cond = CHEEZE_ZONE_COND_EMPTY;
+	}
+
+	WRITE_ONCE(ctl_addr->zone_blocks, zone_blocks);
+	smp_wmb();
+	WRITE_ONCE(ctl_addr->nr_zones, nr_zones);
+
+	return 0;
+}
+
+int cheeze_report_zones(struct gendisk *disk, sector_t sector,
+			unsigned int nr_zones, report_zones_cb cb, void *data)
+{
+	const unsigned int shift = CHEEZE_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT;
+	uint64_t total = READ_ONCE(ctl_addr->nr_zones);
+	uint64_t i, zone_blocks = READ_ONCE(ctl_addr->zone_blocks);
+	struct blk_zone blkz;
+	unsigned int nr = 0;
+	int ret;
+
+	if (!total)
+		return -EINVAL;
+
+	for (i = (sector >> shift) / zone_blocks; i < total && nr < nr_zones; i++, nr++) {
+		memset(&blkz, 0, sizeof(blkz));
+		blkz.type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+		blkz.start = zones_addr[i].start << shift;
+		blkz.len = zones_addr[i].len << shift;
+		blkz.capacity = blkz.len;
+		blkz.wp = READ_ONCE(zones_addr[i].wp) << shift;
+		blkz.cond = READ_ONCE(zones_addr[i].cond);
+
+		ret = cb(&blkz, nr, data);
+		if (ret)
+			return ret;
+	}
+
+	return nr;
+}
+#endif
 
 static int shm_kthread(void *unused)
 {
 	while (!kthread_should_stop()) {
 		recv_req();
-		cond_resched();
+		if (unlikely(!bitmap_empty(cheeze_parked, CHEEZE_QUEUE_SIZE)))
+			cheeze_release_parked();
+		// A daemon on io_uring commands reaps its own completions
+		if (cheeze_chr_uring_tick())
+			schedule_timeout_interruptible(msecs_to_jiffies(10));
+		else
+			cond_resched();
 	}
 
 	return 0;
@@ -204,11 +893,16 @@ static int set_page_addr2(const char *val, const struct kernel_param *kp)
 	if (ret < 0)
 		return ret;
 
+	// Already served through /dev/cheeze-ctl
+	if (cheeze_shm_ready())
+		return -EBUSY;
+
 	page_addr[2] = phys_to_virt(dst);;
 	pr_info("page_addr[2]: 0x%px\n", page_addr[2]);
 
-	shm_meta_init(page_addr[0]);
 	shm_data_init(page_addr);
+	// Published right away, kshm only starts once enabled is set
+	smp_store_release(&ctl_addr, shm_meta_init(page_addr[0]));
 
 	return ret;
 }
@@ -225,16 +919,16 @@ static int enable_param_set(const char *val, const struct kernel_param *kp)
 {
 	int ret;
 
-	if (page_addr[0] == NULL)
+	if (!cheeze_shm_ready())
 		return -EINVAL;
 
 	ret = param_set_bool(val, kp);
 
 	if (enable) {
 		pr_info("Enabling shm\n");
-		shm_task = kthread_run(shm_kthread, NULL, "kshm");
+		ret = shm_start();
 		pr_info("Enabled shm\n");
-	} else {
+	} else if (shm_task) {
 		pr_info("Disabling shm\n");
 		kthread_stop(shm_task);
 		shm_task = NULL;
@@ -251,17 +945,74 @@ static struct kernel_param_ops enable_param_ops = {
 
 module_param_cb(enabled, &enable_param_ops, &enable, 0644);
 
-static void shm_meta_init(void *ppage_addr) {
-	memset(ppage_addr, 0, HP_SIZE);
+/* Lay out the metadata, the caller publishes the returned ctl_addr when ready */
+static struct cheeze_shm_ctl *shm_meta_init(void *ppage_addr) {
+	struct cheeze_shm_ctl *ctl = ppage_addr + CTL_OFF;
+
+	memset(ppage_addr, 0, META_SIZE);
 	send_event_addr = ppage_addr + SEND_OFF; // CHEEZE_QUEUE_SIZE ==> 16B
 	recv_event_addr = ppage_addr + RECV_OFF; // 16B
 	seq_addr = ppage_addr + SEQ_OFF; // 8KB
 	ureq_addr = ppage_addr + REQS_OFF; // sizeof(req) * 1024
+	csum_addr = ppage_addr + CSUM_OFF;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	zones_addr = ppage_addr + ZONES_OFF;
+#endif
+	ctl->magic = CHEEZE_SHM_MAGIC;
+
+	return ctl;
 }
 
+// page_addr[1] and page_addr[2] are 1GB each, slots are laid out in that order
 static void shm_data_init(void **ppage_addr) {
-	cheeze_data_addr[0] = ppage_addr[1];
-	cheeze_data_addr[1] = ppage_addr[2];
+	int i;
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++)
+		cheeze_slot_addr[i] = ppage_addr[1 + i / ITEMS_PER_HP] +
+				      (i % ITEMS_PER_HP) * CHEEZE_BUF_SIZE;
+}
+
+static int shm_start(void)
+{
+	struct task_struct *task;
+
+	if (shm_task)
+		return 0;
+
+	task = kthread_run(shm_kthread, NULL, "kshm");
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	shm_task = task;
+	enable = true;
+	return 0;
+}
+
+/* Serve requests through regions allocated by /dev/cheeze-ctl */
+int cheeze_shm_init(void *meta, struct page **slots)
+{
+	struct cheeze_shm_ctl *ctl;
+	int i, ret;
+
+	if (cheeze_shm_ready())
+		return -EBUSY;
+
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++)
+		cheeze_slot_addr[i] = page_address(slots[i]);
+	ctl = shm_meta_init(meta);
+
+	/*
+	 * Publish the layout only once kshm runs, see cheeze_shm_ready().
+	 * Nothing saw the regions if it failed, the caller can free them.
+	 */
+	ret = shm_start();
+	if (ret) {
+		memset(cheeze_slot_addr, 0, sizeof(cheeze_slot_addr));
+		return ret;
+	}
+	smp_store_release(&ctl_addr, ctl);
+
+	return 0;
 }
 
 void __exit shm_exit(void)
@@ -0,0 +1,483 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Copy-on-write snapshots of the memory backend.
+ *
+ * The image is split into SNAP_CHUNK_SIZE chunks.  Taking a snapshot only
+ * bumps the epoch, and the first write to a chunk whose chunk_epoch is older
+ * than the current epoch copies the chunk into the newest snapshot before
+ * modifying it.  Every later write to that chunk sees a matching epoch and
+ * goes straight to the image.
+ *
+ * Snapshots are kept oldest first.  A snapshot owns only the chunks that
+ * changed after it was taken, so the content of a chunk in snapshot i is
+ * the first copy found in snapshots i..newest, or the live image if none
+ * has one.  Dropping a snapshot hands its copies to the next older one when
+ * that one relies on them.
+ *
+ * Snapshots are managed through a FIFO, one command per line:
+ *
+ *	snapshot <name>
+ *	export <name> <path>
+ *	drop <name>
+ *	list
+ *
+ * Commands run from the tick handler, between two scans of the send flags,
+ * so a snapshot covers exactly the writes completed before it.  Exports run
+ * on their own thread and copy one chunk at a time under snap->lock, which
+ * the copy-on-write path also takes, so a chunk can't be modified between
+ * resolving it and reading it out.
+ */
+
+#ifndef _CHEEZE_SNAP_C
+#define _CHEEZE_SNAP_C
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "backend.h"
+
+#define SNAP_CHUNK_SHIFT 21
+#define SNAP_CHUNK_SIZE (1UL << SNAP_CHUNK_SHIFT) // 2 MiB
+#define SNAP_MAX 16
+#define SNAP_NAME_LEN 32
+#define SNAP_POLL_TICKS 256
+
+struct snap_image {
+	char name[SNAP_NAME_LEN];
+	uint32_t epoch;
+	int exporting;
+	char **chunks;		// per chunk, NULL while shared with newer ones
+	uint64_t nr_owned;
+};
+
+struct snap {
+	struct cheeze_mem *mem;
+	uint64_t nr_chunks;
+
+	uint32_t epoch;
+	uint32_t *chunk_epoch;	// per chunk, epoch of the last copy-on-write
+
+	pthread_mutex_t lock;	// snapshot list and chunk copies
+	struct snap_image *images[SNAP_MAX]; // oldest first
+	int nr_images;
+
+	int ctl_fd;
+	char cmd[256];
+	int cmd_len;
+	uint32_t ticks;
+
+	/* Statistics */
+	uint64_t cow_chunks;
+	uint64_t cow_ns;
+};
+
+struct snap_export {
+	struct snap *snap;
+	struct snap_image *img;
+	char path[PATH_MAX];
+};
+
+static inline uint64_t snap_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t snap_chunk_len(struct snap *snap, uint64_t c)
+{
+	uint64_t off = c << SNAP_CHUNK_SHIFT;
+
+	return snap->mem->size - off < SNAP_CHUNK_SIZE ? snap->mem->size - off : SNAP_CHUNK_SIZE;
+}
+
+/* Must be called with snap->lock held */
+static int snap_find(struct snap *snap, const char *name)
+{
+	int i;
+
+	for (i = 0; i < snap->nr_images; i++)
+		if (!strcmp(snap->images[i]->name, name))
+			return i;
+
+	return -1;
+}
+
+/* Must be called with snap->lock held */
+static const char *snap_resolve(struct snap *snap, int i, uint64_t c)
+{
+	for (; i < snap->nr_images; i++)
+		if (snap->images[i]->chunks[c])
+			return snap->images[i]->chunks[c];
+
+	return snap->mem->mem + (c << SNAP_CHUNK_SHIFT);
+}
+
+/* Slow path of the first write to chunk c in the current epoch */
+static void snap_cow(struct snap *snap, uint64_t c)
+{
+	struct snap_image *img;
+	uint64_t start = snap_now_ns();
+	char *copy;
+
+	pthread_mutex_lock(&snap->lock);
+
+	if (snap->nr_images) {
+		img = snap->images[snap->nr_images - 1];
+		/* A dropped newer snapshot may have left its copy here */
+		if (!img->chunks[c]) {
+			copy = malloc(SNAP_CHUNK_SIZE);
+			if (!copy) {
+				/* Keep serving I/O, the snapshot can't be trusted anymore */
+				fprintf(stderr, "snap: out of memory, snapshot %s is incomplete\n",
+					img->name);
+				goto out;
+			}
+			memcpy(copy, snap->mem->mem + (c << SNAP_CHUNK_SHIFT),
+			       snap_chunk_len(snap, c));
+			img->chunks[c] = copy;
+			img->nr_owned++;
+			snap->cow_chunks++;
+		}
+	}
+
+out:
+	snap->chunk_epoch[c] = snap->epoch;
+	pthread_mutex_unlock(&snap->lock);
+
+	snap->cow_ns += snap_now_ns() - start;
+}
+
+static inline void snap_prepare_write(struct snap *snap, struct cheeze_req_user *ureq)
+{
+	uint64_t off = (uint64_t)ureq->pos << CHEEZE_LOGICAL_BLOCK_SHIFT;
+	uint64_t c, last;
+
+	if (!ureq->len || off + ureq->len > snap->mem->size)
+		return;
+
+	last = (off + ureq->len - 1) >> SNAP_CHUNK_SHIFT;
+	for (c = off >> SNAP_CHUNK_SHIFT; c <= last; c++)
+		if (snap->chunk_epoch[c] != snap->epoch)
+			snap_cow(snap, c);
+}
+
+static int snap_take(struct snap *snap, const char *name)
+{
+	struct snap_image *img;
+
+	pthread_mutex_lock(&snap->lock);
+
+	if (snap_find(snap, name) >= 0) {
+		pthread_mutex_unlock(&snap->lock);
+		fprintf(stderr, "snap: %s already exists\n", name);
+		return -EEXIST;
+	}
+	if (snap->nr_images == SNAP_MAX) {
+		pthread_mutex_unlock(&snap->lock);
+		fprintf(stderr, "snap: too many snapshots\n");
+		return -ENOSPC;
+	}
+
+	img = calloc(1, sizeof(*img));
+	if (img)
+		img->chunks = calloc(snap->nr_chunks, sizeof(*img->chunks));
+	if (!img || !img->chunks) {
+		pthread_mutex_unlock(&snap->lock);
+		free(img);
+		fprintf(stderr, "snap: out of memory\n");
+		return -ENOMEM;
+	}
+
+	snprintf(img->name, sizeof(img->name), "%s", name);
+	img->epoch = ++snap->epoch;
+	snap->images[snap->nr_images++] = img;
+
+	pthread_mutex_unlock(&snap->lock);
+
+	printf("snap: took %s at epoch %u\n", name, img->epoch);
+
+	return 0;
+}
+
+static int snap_drop(struct snap *snap, const char *name)
+{
+	struct snap_image *img, *older;
+	uint64_t c;
+	int i;
+
+	pthread_mutex_lock(&snap->lock);
+
+	i = snap_find(snap, name);
+	if (i < 0 || snap->images[i]->exporting) {
+		pthread_mutex_unlock(&snap->lock);
+		fprintf(stderr, "snap: %s %s\n", name, i < 0 ? "not found" : "is being exported");
+		return i < 0 ? -ENOENT : -EBUSY;
+	}
+
+	img = snap->images[i];
+	older = i ? snap->images[i - 1] : NULL;
+	for (c = 0; c < snap->nr_chunks; c++) {
+		if (!img->chunks[c])
+			continue;
+		if (older && !older->chunks[c]) {
+			older->chunks[c] = img->chunks[c];
+			older->nr_owned++;
+		} else {
+			free(img->chunks[c]);
+		}
+	}
+
+	memmove(&snap->images[i], &snap->images[i + 1],
+		(snap->nr_images - i - 1) * sizeof(*snap->images));
+	snap->nr_images--;
+
+	pthread_mutex_unlock(&snap->lock);
+
+	free(img->chunks);
+	free(img);
+	printf("snap: dropped %s\n", name);
+
+	return 0;
+}
+
+static void *snap_export_fn(void *arg)
+{
+	struct snap_export *ex = arg;
+	struct snap *snap = ex->snap;
+	uint64_t c, len;
+	char *buf;
+	int fd, i, ret = 0;
+
+	buf = malloc(SNAP_CHUNK_SIZE);
+	fd = open(ex->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (!buf || fd < 0) {
+		fprintf(stderr, "snap: failed to export %s to %s: %s\n",
+			ex->img->name, ex->path, strerror(errno));
+		ret = -1;
+		goto out;
+	}
+
+	for (c = 0; c < snap->nr_chunks && !ret; c++) {
+		len = snap_chunk_len(snap, c);
+
+		/* The image may be written to once the lock is dropped */
+		pthread_mutex_lock(&snap->lock);
+		i = snap_find(snap, ex->img->name);
+		memcpy(buf, snap_resolve(snap, i, c), len);
+		pthread_mutex_unlock(&snap->lock);
+
+		if (pwrite(fd, buf, len, c << SNAP_CHUNK_SHIFT) != (ssize_t)len) {
+			fprintf(stderr, "snap: failed to write %s: %s\n",
+				ex->path, strerror(errno));
+			ret = -1;
+		}
+	}
+
+	if (!ret && fsync(fd))
+		ret = -1;
+	if (!ret)
+		printf("snap: exported %s to %s\n", ex->img->name, ex->path);
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+
+	pthread_mutex_lock(&snap->lock);
+	ex->img->exporting = 0;
+	pthread_mutex_unlock(&snap->lock);
+	free(ex);
+
+	return NULL;
+}
+
+static int snap_export(struct snap *snap, const char *name, const char *path)
+{
+	struct snap_export *ex;
+	pthread_t thread;
+	int i;
+
+	ex = calloc(1, sizeof(*ex));
+	if (!ex)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&snap->lock);
+	i = snap_find(snap, name);
+	if (i < 0 || snap->images[i]->exporting) {
+		pthread_mutex_unlock(&snap->lock);
+		fprintf(stderr, "snap: %s %s\n", name, i < 0 ? "not found" : "is being exported");
+		free(ex);
+		return i < 0 ? -ENOENT : -EBUSY;
+	}
+	ex->snap = snap;
+	ex->img = snap->images[i];
+	ex->img->exporting = 1;
+	snprintf(ex->path, sizeof(ex->path), "%s", path);
+	pthread_mutex_unlock(&snap->lock);
+
+	if (pthread_create(&thread, NULL, snap_export_fn, ex)) {
+		pthread_mutex_lock(&snap->lock);
+		ex->img->exporting = 0;
+		pthread_mutex_unlock(&snap->lock);
+		free(ex);
+		return -EAGAIN;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+static void snap_list(struct snap *snap, FILE *fp)
+{
+	struct snap_image *img;
+	int i;
+
+	pthread_mutex_lock(&snap->lock);
+	for (i = 0; i < snap->nr_images; i++) {
+		img = snap->images[i];
+		fprintf(fp, "snap: %-*s epoch %u, %lu MiB owned%s\n", SNAP_NAME_LEN, img->name,
+			img->epoch, (img->nr_owned << SNAP_CHUNK_SHIFT) >> 20,
+			img->exporting ? ", exporting" : "");
+	}
+	fprintf(fp, "snap: %lu chunks copied, %.2f us per copy\n", snap->cow_chunks,
+		snap->cow_chunks ? snap->cow_ns / 1000.0 / snap->cow_chunks : 0.0);
+	pthread_mutex_unlock(&snap->lock);
+}
+
+static void snap_command(struct snap *snap, char *line)
+{
+	char *cmd, *name, *path, *save;
+
+	cmd = strtok_r(line, " \t", &save);
+	name = strtok_r(NULL, " \t", &save);
+	path = strtok_r(NULL, " \t", &save);
+
+	if (!cmd)
+		return;
+
+	if (!strcmp(cmd, "snapshot") && name)
+		snap_take(snap, name);
+	else if (!strcmp(cmd, "export") && name && path)
+		snap_export(snap, name, path);
+	else if (!strcmp(cmd, "drop") && name)
+		snap_drop(snap, name);
+	else if (!strcmp(cmd, "list"))
+		snap_list(snap, stdout);
+	else
+		fprintf(stderr, "snap: unknown command %s\n", cmd);
+
+	fflush(stdout);
+}
+
+/* Called between scans, runs every complete command line in the FIFO */
+static void snap_poll(struct snap *snap)
+{
+	char *nl, *line;
+	ssize_t ret;
+
+	/* Keep the syscall off most scans */
+	if (++snap->ticks % SNAP_POLL_TICKS)
+		return;
+
+	ret = read(snap->ctl_fd, snap->cmd + snap->cmd_len,
+		   sizeof(snap->cmd) - 1 - snap->cmd_len);
+	if (ret <= 0)
+		return;
+
+	snap->cmd_len += ret;
+	snap->cmd[snap->cmd_len] = '\0';
+
+	line = snap->cmd;
+	while ((nl = strchr(line, '\n'))) {
+		*nl = '\0';
+		snap_command(snap, line);
+		line = nl + 1;
+	}
+
+	snap->cmd_len -= line - snap->cmd;
+	memmove(snap->cmd, line, snap->cmd_len);
+	/* Drop overlong lines */
+	if (snap->cmd_len == sizeof(snap->cmd) - 1)
+		snap->cmd_len = 0;
+}
+
+static int snap_init(struct snap *snap, struct cheeze_mem *mem, const char *fifo)
+{
+	memset(snap, 0, sizeof(*snap));
+
+	snap->mem = mem;
+	snap->nr_chunks = (mem->size + SNAP_CHUNK_SIZE - 1) >> SNAP_CHUNK_SHIFT;
+	snap->chunk_epoch = calloc(snap->nr_chunks, sizeof(*snap->chunk_epoch));
+	if (!snap->chunk_epoch) {
+		perror("snap: calloc");
+		return -1;
+	}
+	pthread_mutex_init(&snap->lock, NULL);
+
+	if (mkfifo(fifo, 0600) && errno != EEXIST) {
+		fprintf(stderr, "snap: failed to create %s: %s\n", fifo, strerror(errno));
+		return -1;
+	}
+	/* O_RDWR keeps the FIFO open, so writers coming and going never hit EOF */
+	snap->ctl_fd = open(fifo, O_RDWR | O_NONBLOCK);
+	if (snap->ctl_fd < 0) {
+		fprintf(stderr, "snap: failed to open %s: %s\n", fifo, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Backend handlers, wrapping the memory backend
+ */
+static int snap_be_write(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct snap *snap = priv;
+
+	snap_prepare_write(snap, ureq);
+	return cheeze_mem_write(snap->mem, ureq, buf);
+}
+
+static int snap_be_read(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct snap *snap = priv;
+
+	return cheeze_mem_read(snap->mem, ureq, buf);
+}
+
+static int snap_be_discard(void *priv, struct cheeze_req_user *ureq)
+{
+	struct snap *snap = priv;
+
+	snap_prepare_write(snap, ureq);
+	return cheeze_mem_discard(snap->mem, ureq);
+}
+
+static void snap_be_tick(void *priv)
+{
+	snap_poll(priv);
+}
+
+static const struct cheeze_backend snap_backend = {
+	.read = snap_be_read,
+	.write = snap_be_write,
+	.discard = snap_be_discard,
+	.tick = snap_be_tick,
+};
+
+#endif
@@ -0,0 +1,326 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Striped backend: the device is laid out RAID-0 style over several files
+ * or block devices, in chunks of chunk_size bytes.  Chunk i lives on member
+ * i % nr_devs, at (i / nr_devs) * chunk_size.
+ *
+ * A request is split per member.  The pieces of a request that land on the
+ * same member are contiguous there, so each member gets a single readv or
+ * writev whose iovecs gather the pieces from the slot.  All of them are
+ * submitted through one io_uring and the request is completed with
+ * cheeze_complete() once the last one is done, so members transfer in
+ * parallel and the daemon keeps serving other slots meanwhile.
+ *
+ * Members are opened with O_DIRECT where supported, so the kernel pins the
+ * slot pages for the transfer.  Slots mapped through /dev/mem are VM_PFNMAP
+ * and can't be pinned, members go through the page cache then.  The device
+ * is nr_devs times the smallest member, rounded down to whole chunks.
+ */
+
+#ifndef _CHEEZE_STRIPE_C
+#define _CHEEZE_STRIPE_C
+
+/* O_DIRECT and fallocate() need _GNU_SOURCE, defined by the including file */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "backend.h"
+
+#define STRIPE_MAX_DEVS 16
+#define STRIPE_RING_SIZE 4096
+
+struct stripe_slot {
+	int pending;		// member I/Os not completed yet
+	int ret;		// first error, 0 or -errno
+	struct iovec *iov;	// nr_iov entries, only touched by this slot
+};
+
+struct stripe {
+	struct cheeze_shm *shm;
+	struct cheeze_uring ring;
+
+	int fds[STRIPE_MAX_DEVS];
+	int nr_devs;
+	uint64_t chunk;		// bytes, a multiple of 4 KiB
+	uint64_t dev_size;	// used bytes of every member
+	uint64_t size;
+
+	unsigned int nr_iov;	// per slot
+	struct stripe_slot slots[CHEEZE_QUEUE_SIZE];
+
+	uint64_t ios, short_ios;
+};
+
+/* Grab an SQE, submitting the queued ones if the SQ is full */
+static struct io_uring_sqe *stripe_get_sqe(struct stripe *s)
+{
+	struct io_uring_sqe *sqe;
+
+	while (!(sqe = cheeze_uring_get_sqe(&s->ring)))
+		cheeze_uring_submit(&s->ring, 0);
+
+	return sqe;
+}
+
+/* user_data of a member I/O: the slot, and the bytes it has to transfer */
+static inline uint64_t stripe_user_data(int id, uint32_t len)
+{
+	return (uint64_t)len << 32 | (uint32_t)id;
+}
+
+static int stripe_rw(struct stripe *s, struct cheeze_req_user *ureq, char *buf, int write)
+{
+	struct stripe_slot *slot = &s->slots[ureq->id];
+	uint64_t off = (uint64_t)ureq->pos << CHEEZE_LOGICAL_BLOCK_SHIFT;
+	uint64_t end = off + ureq->len, first, last, i, start, stop, dev_off;
+	struct io_uring_sqe *sqe;
+	unsigned int nr = 0, iov_start, k;
+	uint32_t len;
+
+	if (end > s->size || !ureq->len) {
+		ureq->ret = -EIO;
+		return CHEEZE_DONE;
+	}
+
+	first = off / s->chunk;
+	last = (end - 1) / s->chunk;
+
+	slot->pending = 0;
+	slot->ret = 0;
+
+	for (k = 0; k < (unsigned int)s->nr_devs && first + k <= last; k++) {
+		iov_start = nr;
+		len = 0;
+		dev_off = 0;
+
+		for (i = first + k; i <= last; i += s->nr_devs) {
+			start = i * s->chunk > off ? i * s->chunk : off;
+			stop = (i + 1) * s->chunk < end ? (i + 1) * s->chunk : end;
+			if (i == first + k)
+				dev_off = (i / s->nr_devs) * s->chunk + start - i * s->chunk;
+			slot->iov[nr].iov_base = buf + (start - off);
+			slot->iov[nr].iov_len = stop - start;
+			len += stop - start;
+			nr++;
+		}
+
+		sqe = stripe_get_sqe(s);
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = s->fds[(first + k) % s->nr_devs];
+		sqe->addr = (uintptr_t)(slot->iov + iov_start);
+		sqe->len = nr - iov_start;
+		sqe->off = dev_off;
+		if (write && (ureq->flags & CHEEZE_REQ_FUA))
+			sqe->rw_flags = RWF_DSYNC;
+		sqe->user_data = stripe_user_data(ureq->id, len);
+		slot->pending++;
+	}
+
+	s->ios += slot->pending;
+
+	return CHEEZE_ASYNC;
+}
+
+static int stripe_read(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	return stripe_rw(priv, ureq, buf, 0);
+}
+
+static int stripe_write(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	return stripe_rw(priv, ureq, buf, 1);
+}
+
+/* Punch the pieces out of every member, synchronously as discards are rare */
+static int stripe_discard(void *priv, struct cheeze_req_user *ureq)
+{
+	struct stripe *s = priv;
+	uint64_t off = (uint64_t)ureq->pos << CHEEZE_LOGICAL_BLOCK_SHIFT;
+	uint64_t end = off + ureq->len, i, start, stop;
+
+	if (end > s->size) {
+		ureq->ret = -EIO;
+		return CHEEZE_DONE;
+	}
+
+	for (i = off / s->chunk; i * s->chunk < end; i++) {
+		start = i * s->chunk > off ? i * s->chunk : off;
+		stop = (i + 1) * s->chunk < end ? (i + 1) * s->chunk : end;
+		fallocate(s->fds[i % s->nr_devs], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  (i / s->nr_devs) * s->chunk + start - i * s->chunk, stop - start);
+	}
+
+	return CHEEZE_DONE;
+}
+
+static int stripe_flush(void *priv, struct cheeze_req_user *ureq)
+{
+	struct stripe *s = priv;
+	struct stripe_slot *slot = &s->slots[ureq->id];
+	struct io_uring_sqe *sqe;
+	int i;
+
+	slot->pending = s->nr_devs;
+	slot->ret = 0;
+	for (i = 0; i < s->nr_devs; i++) {
+		sqe = stripe_get_sqe(s);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = s->fds[i];
+		sqe->user_data = stripe_user_data(ureq->id, 0);
+	}
+
+	return CHEEZE_ASYNC;
+}
+
+/* Submit what the handlers queued and complete the slots whose member I/Os are all done */
+static void stripe_tick(void *priv)
+{
+	struct stripe *s = priv;
+	struct stripe_slot *slot;
+	struct io_uring_cqe *cqe;
+	uint32_t len;
+	int id, res;
+
+	cheeze_uring_submit(&s->ring, 0);
+
+	while ((cqe = cheeze_uring_peek_cqe(&s->ring))) {
+		id = (uint32_t)cqe->user_data;
+		len = cqe->user_data >> 32;
+		res = cqe->res;
+		cheeze_uring_cqe_seen(&s->ring);
+
+		slot = &s->slots[id];
+		if (res < 0) {
+			if (!slot->ret)
+				slot->ret = res;
+		} else if ((uint32_t)res != len) {
+			// Past the end of a member that shrank, or a partial transfer
+			s->short_ios++;
+			if (!slot->ret)
+				slot->ret = -EIO;
+		}
+
+		if (--slot->pending)
+			continue;
+		s->shm->ureq_addr[id].ret = slot->ret;
+		cheeze_complete(s->shm, id);
+	}
+}
+
+static void stripe_exit(struct stripe *s)
+{
+	int i;
+
+	for (i = 0; i < s->nr_devs; i++)
+		close(s->fds[i]);
+	free(s->slots[0].iov);
+	cheeze_uring_exit(&s->ring);
+}
+
+/* Stripe over the comma-separated paths in devs, in chunk-byte chunks */
+static int stripe_init(struct stripe *s, struct cheeze_shm *shm, const char *devs,
+		       uint64_t chunk)
+{
+	char *list, *path, *save;
+	struct iovec *iov;
+	off_t len;
+	int i, ret, flags = O_RDWR | O_DIRECT;
+
+	memset(s, 0, sizeof(*s));
+	s->shm = shm;
+	s->chunk = chunk;
+	s->dev_size = UINT64_MAX;
+
+	if (!chunk || chunk % CHEEZE_LOGICAL_BLOCK_SIZE) {
+		fprintf(stderr, "stripe: chunk size must be a multiple of %d bytes\n",
+			CHEEZE_LOGICAL_BLOCK_SIZE);
+		return -1;
+	}
+
+	if (shm->ctl_fd < 0) {
+		printf("stripe: slots are mapped through /dev/mem, not using O_DIRECT\n");
+		flags = O_RDWR;
+	}
+
+	list = strdup(devs);
+	for (path = strtok_r(list, ",", &save); path; path = strtok_r(NULL, ",", &save)) {
+		if (s->nr_devs == STRIPE_MAX_DEVS) {
+			fprintf(stderr, "stripe: at most %d members\n", STRIPE_MAX_DEVS);
+			goto err;
+		}
+
+		s->fds[s->nr_devs] = open(path, flags);
+		/* Not every filesystem supports O_DIRECT, e.g. tmpfs */
+		if (s->fds[s->nr_devs] < 0 && errno == EINVAL)
+			s->fds[s->nr_devs] = open(path, O_RDWR);
+		if (s->fds[s->nr_devs] < 0) {
+			fprintf(stderr, "Failed to open %s: ", path);
+			perror(NULL);
+			goto err;
+		}
+
+		len = fdlength(s->fds[s->nr_devs]);
+		s->nr_devs++;
+		if (len < 0) {
+			perror(path);
+			goto err;
+		}
+		if ((uint64_t)len < s->dev_size)
+			s->dev_size = len;
+	}
+	free(list);
+	list = NULL;
+
+	if (!s->nr_devs)
+		goto err;
+
+	s->dev_size -= s->dev_size % chunk;
+	s->size = s->dev_size * s->nr_devs;
+	if (!s->size) {
+		fprintf(stderr, "stripe: members are smaller than a chunk\n");
+		goto err;
+	}
+
+	/* A slot spans at most this many chunks, even when not chunk aligned */
+	s->nr_iov = CHEEZE_BUF_SIZE / chunk + 2;
+	iov = calloc((size_t)CHEEZE_QUEUE_SIZE * s->nr_iov, sizeof(*iov));
+	if (!iov) {
+		perror("stripe: calloc");
+		goto err;
+	}
+	for (i = 0; i < CHEEZE_QUEUE_SIZE; i++)
+		s->slots[i].iov = iov + (size_t)i * s->nr_iov;
+
+	ret = cheeze_uring_init(&s->ring, STRIPE_RING_SIZE, 0);
+	if (ret) {
+		fprintf(stderr, "stripe: io_uring_setup: %s\n", strerror(-ret));
+		free(iov);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	free(list);
+	for (i = 0; i < s->nr_devs; i++)
+		close(s->fds[i]);
+	return -1;
+}
+
+static void stripe_print_stats(struct stripe *s, FILE *out)
+{
+	fprintf(out, "stripe: %d members, %lu KiB chunks, %lu member I/Os, %lu short\n",
+		s->nr_devs, s->chunk >> 10, s->ios, s->short_ios);
+}
+
+#endif
@@ -0,0 +1,514 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Two-tier backend: a hot tier in the hugepage image and a cold tier in a
+ * regular file.
+ *
+ * The device is as large as the cold file and is managed in TIER_EXT_SIZE
+ * extents.  An extent lives either in the cold file, at its own offset, or
+ * in one of the hot slots carved out of the hugepage image.  Every access
+ * bumps the extent's frequency counter, and a migration thread periodically
+ * halves all counters and swaps the hottest cold extents with the coldest
+ * hot ones.  Hot slots are written back to the cold file on demotion only if
+ * they were written to since their promotion.
+ *
+ * The slot map lives in a struct tier_map at the tail of the image, which
+ * outlives the daemon, so hot extents are adopted again after a crash or a
+ * restart instead of losing what was never written back.  A slot is marked
+ * dirty before it is written and only unmapped after its write-back.
+ *
+ * The daemon and the migration thread serialize on a per-extent mutex, so
+ * the I/O path only pays for an uncontended lock unless it hits an extent
+ * that is being moved.
+ *
+ * Sequential read streams are detected from pos/len and, once a stream has
+ * run for TIER_SEQ_RUN requests, the cold file is read ahead with
+ * POSIX_FADV_WILLNEED so that cold reads hit the page cache.
+ */
+
+#ifndef _CHEEZE_TIER_C
+#define _CHEEZE_TIER_C
+
+/* fallocate() needs _GNU_SOURCE, defined by the including file */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "backend.h"
+
+#define TIER_EXT_SHIFT 21
+#define TIER_EXT_SIZE (1UL << TIER_EXT_SHIFT) // 2 MiB
+#define TIER_NONE UINT32_MAX
+#define TIER_MAP_MAGIC 0x70616d7265697463ULL // "ctiermap"
+
+/* Migration pass interval, and every how many passes the counters decay */
+#define TIER_MIGRATE_MS 50
+#define TIER_DECAY_PASSES 20
+/* Extents moved per pass, and the minimum gain to swap two extents */
+#define TIER_MIGRATE_BATCH 16
+#define TIER_MIN_FREQ 4
+#define TIER_HYSTERESIS 4
+
+/* Sequential stream detection */
+#define TIER_STREAMS 8
+#define TIER_SEQ_RUN 4
+#define TIER_RA_SIZE (4UL << 20)
+
+struct tier_stream {
+	uint64_t next;		// expected byte offset of the next read
+	uint64_t ra_end;	// end of the last readahead window
+	uint32_t run;
+	uint32_t last_use;
+};
+
+/* At the tail of the hot image, after the last slot */
+struct tier_map {
+	uint64_t magic;
+	uint64_t size;		// of the cold file
+	uint32_t nr_slots;
+	uint32_t nr_extents;
+	uint32_t owner[];	// per slot, followed by the dirty flags
+};
+
+struct tier {
+	char *hot;
+	uint32_t nr_slots;
+
+	int cold_fd;
+	uint64_t size;
+	uint32_t nr_extents;
+
+	uint32_t *slot;		// per extent, hot slot or TIER_NONE
+	uint32_t *freq;		// per extent, decayed access count
+	pthread_mutex_t *locks;	// per extent
+	struct tier_map *map;
+	uint32_t *owner;	// per slot, extent or TIER_NONE, in map
+	uint8_t *dirty;		// per slot, in map
+
+	struct tier_stream streams[TIER_STREAMS];
+	uint32_t stream_clock;
+
+	pthread_t migrator;
+	volatile int stop;
+
+	/* Statistics, I/O path */
+	uint64_t hot_bytes;
+	uint64_t cold_bytes;
+	uint64_t readaheads;
+	/* Statistics, migration thread */
+	uint64_t promotions;
+	uint64_t demotions;
+	uint64_t writebacks;
+};
+
+static inline char *tier_slot_addr(struct tier *t, uint32_t s)
+{
+	return t->hot + ((uint64_t)s << TIER_EXT_SHIFT);
+}
+
+static inline uint64_t tier_ext_len(struct tier *t, uint32_t e)
+{
+	uint64_t off = (uint64_t)e << TIER_EXT_SHIFT;
+
+	return t->size - off < TIER_EXT_SIZE ? t->size - off : TIER_EXT_SIZE;
+}
+
+static int tier_cold_io(struct tier *t, int write, char *buf, uint64_t len, uint64_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write ? pwrite(t->cold_fd, buf, len, off) : pread(t->cold_fd, buf, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			perror("tier: cold I/O");
+			return -1;
+		}
+		/* Sparse or short cold file, reads past EOF are zeroes */
+		if (ret == 0) {
+			memset(buf, 0, len);
+			break;
+		}
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Must be called with the lock of the slot's extent held */
+static void tier_demote(struct tier *t, uint32_t s)
+{
+	uint32_t e = t->owner[s];
+
+	if (t->dirty[s]) {
+		tier_cold_io(t, 1, tier_slot_addr(t, s), tier_ext_len(t, e),
+			     (uint64_t)e << TIER_EXT_SHIFT);
+		t->writebacks++;
+	}
+
+	barrier();
+	t->slot[e] = TIER_NONE;
+	t->owner[s] = TIER_NONE;
+	t->dirty[s] = 0;
+	t->demotions++;
+}
+
+/* Must be called with the lock of extent e held */
+static void tier_promote(struct tier *t, uint32_t e, uint32_t s)
+{
+	if (tier_cold_io(t, 0, tier_slot_addr(t, s), tier_ext_len(t, e),
+			 (uint64_t)e << TIER_EXT_SHIFT))
+		return;
+
+	t->dirty[s] = 0;
+	barrier();
+	t->slot[e] = s;
+	t->owner[s] = e;
+	t->promotions++;
+}
+
+/* Returns a free slot, or the slot of the coldest hot extent */
+static uint32_t tier_pick_victim(struct tier *t)
+{
+	uint32_t s, victim = TIER_NONE, min = UINT32_MAX;
+
+	for (s = 0; s < t->nr_slots; s++) {
+		if (t->owner[s] == TIER_NONE)
+			return s;
+		if (t->freq[t->owner[s]] < min) {
+			min = t->freq[t->owner[s]];
+			victim = s;
+		}
+	}
+
+	return victim;
+}
+
+static void tier_migrate(struct tier *t)
+{
+	uint32_t cand[TIER_MIGRATE_BATCH];
+	uint32_t e, s, v, i, nr = 0;
+
+	/* Hottest cold extents, kept sorted in cand */
+	for (e = 0; e < t->nr_extents; e++) {
+		if (t->slot[e] != TIER_NONE || t->freq[e] < TIER_MIN_FREQ)
+			continue;
+		if (nr == TIER_MIGRATE_BATCH && t->freq[e] <= t->freq[cand[nr - 1]])
+			continue;
+
+		i = nr < TIER_MIGRATE_BATCH ? nr++ : nr - 1;
+		for (; i > 0 && t->freq[cand[i - 1]] < t->freq[e]; i--)
+			cand[i] = cand[i - 1];
+		cand[i] = e;
+	}
+
+	for (i = 0; i < nr && !t->stop; i++) {
+		e = cand[i];
+		s = tier_pick_victim(t);
+		if (s == TIER_NONE)
+			break;
+
+		v = t->owner[s];
+		if (v != TIER_NONE) {
+			if (t->freq[e] <= t->freq[v] + TIER_HYSTERESIS)
+				break;
+
+			pthread_mutex_lock(&t->locks[v]);
+			tier_demote(t, s);
+			pthread_mutex_unlock(&t->locks[v]);
+		}
+
+		pthread_mutex_lock(&t->locks[e]);
+		tier_promote(t, e, s);
+		pthread_mutex_unlock(&t->locks[e]);
+
+		/* The cold copy is only read again after a demotion */
+		posix_fadvise(t->cold_fd, (uint64_t)e << TIER_EXT_SHIFT, tier_ext_len(t, e),
+			      POSIX_FADV_DONTNEED);
+	}
+}
+
+static void *tier_migrate_fn(void *arg)
+{
+	struct tier *t = arg;
+	struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = TIER_MIGRATE_MS * 1000000L,
+	};
+	uint32_t e, pass = 0;
+
+	while (!t->stop) {
+		nanosleep(&ts, NULL);
+
+		tier_migrate(t);
+
+		if (++pass % TIER_DECAY_PASSES == 0)
+			for (e = 0; e < t->nr_extents; e++)
+				t->freq[e] >>= 1;
+	}
+
+	return NULL;
+}
+
+/* Track sequential read streams and read ahead of them in the cold file */
+static void tier_readahead(struct tier *t, uint64_t off, uint64_t len)
+{
+	struct tier_stream *st, *lru = &t->streams[0];
+	uint64_t ra;
+	int i;
+
+	t->stream_clock++;
+
+	for (i = 0; i < TIER_STREAMS; i++) {
+		st = &t->streams[i];
+		if (st->next == off && st->run)
+			goto found;
+		if (st->last_use < lru->last_use)
+			lru = st;
+	}
+
+	/* New stream, replace the least recently used one */
+	st = lru;
+	st->run = 0;
+	st->ra_end = 0;
+
+found:
+	st->run++;
+	st->next = off + len;
+	st->last_use = t->stream_clock;
+
+	if (st->run < TIER_SEQ_RUN || st->ra_end >= st->next + TIER_RA_SIZE / 2)
+		return;
+
+	ra = st->ra_end > st->next ? st->ra_end : st->next;
+	if (ra >= t->size)
+		return;
+	st->ra_end = ra + TIER_RA_SIZE < t->size ? ra + TIER_RA_SIZE : t->size;
+
+	/* Only cold extents need it, hot ones are already in memory */
+	if (t->slot[ra >> TIER_EXT_SHIFT] == TIER_NONE ||
+	    t->slot[(st->ra_end - 1) >> TIER_EXT_SHIFT] == TIER_NONE) {
+		posix_fadvise(t->cold_fd, ra, st->ra_end - ra, POSIX_FADV_WILLNEED);
+		t->readaheads++;
+	}
+}
+
+static void tier_io(struct tier *t, int write, uint32_t pos, char *buf, uint32_t len)
+{
+	uint64_t off = (uint64_t)pos << CHEEZE_LOGICAL_BLOCK_SHIFT;
+	uint64_t ext_off, n;
+	uint32_t e, s;
+
+	if (off + len > t->size) {
+		fprintf(stderr, "tier: pos %u+%u beyond %lu bytes\n", pos, len, t->size);
+		return;
+	}
+
+	if (!write)
+		tier_readahead(t, off, len);
+
+	while (len) {
+		e = off >> TIER_EXT_SHIFT;
+		ext_off = off & (TIER_EXT_SIZE - 1);
+		n = TIER_EXT_SIZE - ext_off < len ? TIER_EXT_SIZE - ext_off : len;
+
+		pthread_mutex_lock(&t->locks[e]);
+		s = t->slot[e];
+		if (s != TIER_NONE) {
+			if (write) {
+				t->dirty[s] = 1;
+				barrier();
+				memcpy(tier_slot_addr(t, s) + ext_off, buf, n);
+			} else {
+				memcpy(buf, tier_slot_addr(t, s) + ext_off, n);
+			}
+			t->hot_bytes += n;
+		} else {
+			tier_cold_io(t, write, buf, n, off);
+			t->cold_bytes += n;
+		}
+		pthread_mutex_unlock(&t->locks[e]);
+
+		t->freq[e]++;
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+static inline void tier_read(struct tier *t, uint32_t pos, char *buf, uint32_t len)
+{
+	tier_io(t, 0, pos, buf, len);
+}
+
+static inline void tier_write(struct tier *t, uint32_t pos, const char *buf, uint32_t len)
+{
+	tier_io(t, 1, pos, (char *)buf, len);
+}
+
+static void tier_trim(struct tier *t, uint32_t pos, uint32_t len)
+{
+	uint64_t off = (uint64_t)pos << CHEEZE_LOGICAL_BLOCK_SHIFT;
+	uint64_t ext_off, n;
+	uint32_t e, s;
+
+	if (off + len > t->size)
+		return;
+
+	while (len) {
+		e = off >> TIER_EXT_SHIFT;
+		ext_off = off & (TIER_EXT_SIZE - 1);
+		n = TIER_EXT_SIZE - ext_off < len ? TIER_EXT_SIZE - ext_off : len;
+
+		pthread_mutex_lock(&t->locks[e]);
+		s = t->slot[e];
+		if (s != TIER_NONE) {
+			t->dirty[s] = 1;
+			barrier();
+			memset(tier_slot_addr(t, s) + ext_off, 0, n);
+		} else {
+			fallocate(t->cold_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, n);
+		}
+		pthread_mutex_unlock(&t->locks[e]);
+
+		off += n;
+		len -= n;
+	}
+}
+
+/* Adopt the slot map left in the image by the last daemon, or start empty */
+static void tier_map_load(struct tier *t)
+{
+	struct tier_map *map = t->map;
+	uint32_t s, e, hot = 0, dirty = 0;
+
+	if (map->magic == TIER_MAP_MAGIC && map->size == t->size &&
+	    map->nr_slots == t->nr_slots && map->nr_extents == t->nr_extents) {
+		for (s = 0; s < t->nr_slots; s++) {
+			e = t->owner[s];
+			if (e == TIER_NONE)
+				continue;
+			if (e >= t->nr_extents || t->slot[e] != TIER_NONE) {
+				fprintf(stderr, "tier: slot map is corrupted, starting empty\n");
+				goto reset;
+			}
+			t->slot[e] = s;
+			hot++;
+			dirty += t->dirty[s];
+		}
+		if (hot)
+			printf("tier: adopted %u hot extents, %u dirty\n", hot, dirty);
+		return;
+	}
+
+	if (map->magic == TIER_MAP_MAGIC)
+		fprintf(stderr, "tier: slot map is for another geometry, starting empty\n");
+
+reset:
+	for (e = 0; e < t->nr_extents; e++)
+		t->slot[e] = TIER_NONE;
+	for (s = 0; s < t->nr_slots; s++)
+		t->owner[s] = TIER_NONE;
+	memset(t->dirty, 0, t->nr_slots);
+	map->size = t->size;
+	map->nr_slots = t->nr_slots;
+	map->nr_extents = t->nr_extents;
+	barrier();
+	map->magic = TIER_MAP_MAGIC;
+}
+
+static int tier_init(struct tier *t, char *hot, uint64_t hot_size, const char *cold_path)
+{
+	uint32_t i, total, map_slots;
+
+	memset(t, 0, sizeof(*t));
+
+	t->cold_fd = open(cold_path, O_RDWR);
+	if (t->cold_fd < 0) {
+		fprintf(stderr, "tier: failed to open %s: %s\n", cold_path, strerror(errno));
+		return -1;
+	}
+
+	/* The map takes whole slots at the end */
+	total = hot_size >> TIER_EXT_SHIFT;
+	map_slots = (sizeof(struct tier_map) + (uint64_t)total * 5 + TIER_EXT_SIZE - 1) >> TIER_EXT_SHIFT;
+
+	t->hot = hot;
+	t->nr_slots = total > map_slots ? total - map_slots : 0;
+	t->size = fdlength(t->cold_fd) & ~((1ULL << CHEEZE_LOGICAL_BLOCK_SHIFT) - 1);
+	t->nr_extents = (t->size + TIER_EXT_SIZE - 1) >> TIER_EXT_SHIFT;
+	if (!t->nr_slots || !t->nr_extents) {
+		fprintf(stderr, "tier: hot tier or %s is too small\n", cold_path);
+		return -1;
+	}
+
+	t->map = (struct tier_map *)tier_slot_addr(t, t->nr_slots);
+	t->owner = t->map->owner;
+	t->dirty = (uint8_t *)(t->owner + t->nr_slots);
+
+	t->slot = malloc(t->nr_extents * sizeof(*t->slot));
+	t->freq = calloc(t->nr_extents, sizeof(*t->freq));
+	t->locks = malloc(t->nr_extents * sizeof(*t->locks));
+	if (!t->slot || !t->freq || !t->locks) {
+		perror("tier: malloc");
+		return -1;
+	}
+
+	for (i = 0; i < t->nr_extents; i++) {
+		t->slot[i] = TIER_NONE;
+		pthread_mutex_init(&t->locks[i], NULL);
+	}
+	tier_map_load(t);
+
+	if (pthread_create(&t->migrator, NULL, tier_migrate_fn, t)) {
+		perror("tier: pthread_create");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Stop migrating and write every dirty hot extent back to the cold file */
+static void tier_exit(struct tier *t)
+{
+	uint32_t s;
+
+	t->stop = 1;
+	pthread_join(t->migrator, NULL);
+
+	for (s = 0; s < t->nr_slots; s++)
+		if (t->owner[s] != TIER_NONE)
+			tier_demote(t, s);
+	fdatasync(t->cold_fd);
+}
+
+static void tier_print_stats(struct tier *t, FILE *fp)
+{
+	uint64_t total = t->hot_bytes + t->cold_bytes;
+	uint32_t s, used = 0;
+
+	for (s = 0; s < t->nr_slots; s++)
+		if (t->owner[s] != TIER_NONE)
+			used++;
+
+	fprintf(fp, "tier: %u/%u hot slots used, %u extents\n", used, t->nr_slots, t->nr_extents);
+	fprintf(fp, "tier: hot %lu MiB, cold %lu MiB, hit ratio %.2f%%\n",
+		t->hot_bytes >> 20, t->cold_bytes >> 20,
+		total ? 100.0 * t->hot_bytes / total : 0.0);
+	fprintf(fp, "tier: %lu promotions, %lu demotions, %lu writebacks, %lu readaheads\n",
+		t->promotions, t->demotions, t->writebacks, t->readaheads);
+}
+
+#endif
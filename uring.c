@@ -0,0 +1,134 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Minimal io_uring on raw system calls, so that the daemons need no
+ * liburing: one ring, SQEs handed out in order and published on submit.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct cheeze_uring {
+	int fd;
+	unsigned int sq_entries;
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int sqe_tail; // handed out, published to sq_tail on submit
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+};
+
+static inline int cheeze_uring_init(struct cheeze_uring *r, unsigned int entries,
+				    unsigned int flags)
+{
+	struct io_uring_params p;
+	unsigned int i;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	p.flags = flags;
+
+	r->fd = syscall(SYS_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -errno;
+
+	r->sq_entries = p.sq_entries;
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+		close(r->fd);
+		return -ENOMEM;
+	}
+
+	r->sq_head = r->sq_ring + p.sq_off.head;
+	r->sq_tail = r->sq_ring + p.sq_off.tail;
+	r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ring + p.sq_off.array;
+	r->cq_head = r->cq_ring + p.cq_off.head;
+	r->cq_tail = r->cq_ring + p.cq_off.tail;
+	r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+	r->cqes = r->cq_ring + p.cq_off.cqes;
+
+	// SQEs are always used in ring order
+	for (i = 0; i < p.sq_entries; i++)
+		r->sq_array[i] = i;
+	r->sqe_tail = *r->sq_tail;
+
+	return 0;
+}
+
+static inline void cheeze_uring_exit(struct cheeze_uring *r)
+{
+	munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+	munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+}
+
+/* A zeroed SQE, or NULL if the SQ is full until the next submit */
+static inline struct io_uring_sqe *cheeze_uring_get_sqe(struct cheeze_uring *r)
+{
+	unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (r->sqe_tail - head >= r->sq_entries)
+		return NULL;
+
+	sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+	r->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+/* Submit every SQE handed out so far and wait for wait_nr completions */
+static inline int cheeze_uring_submit(struct cheeze_uring *r, unsigned int wait_nr)
+{
+	unsigned int to_submit;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if (!to_submit && !wait_nr)
+		return 0;
+
+	ret = syscall(SYS_io_uring_enter, r->fd, to_submit, wait_nr,
+		      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+	return ret < 0 ? -errno : ret;
+}
+
+/* The oldest completion, or NULL, to be released with cheeze_uring_cqe_seen() */
+static inline struct io_uring_cqe *cheeze_uring_peek_cqe(struct cheeze_uring *r)
+{
+	unsigned int head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &r->cqes[head & *r->cq_mask];
+}
+
+static inline void cheeze_uring_cqe_seen(struct cheeze_uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -3,6 +3,7 @@
  * Copyright (C) 2020 Park Ju Hyung
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -14,97 +15,27 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
+#include <getopt.h>
 
-#include "crc32c.c"
-
-#define PHYS_ADDR 0x3ec0000000
-#define CHEEZE_QUEUE_SIZE 1024
-#define CHEEZE_BUF_SIZE (2ULL * 1024 * 1024)
-#define ITEMS_PER_HP ((1ULL * 1024 * 1024 * 1024) / CHEEZE_BUF_SIZE)
-#define BITS_PER_EVENT (sizeof(uint64_t) * 8)
-
-#define EVENT_BYTES (CHEEZE_QUEUE_SIZE / BITS_PER_EVENT)
-
-#define SEND_OFF 0
-#define SEND_SIZE (CHEEZE_QUEUE_SIZE * sizeof(uint8_t))
-
-#define RECV_OFF (SEND_OFF + SEND_SIZE)
-#define RECV_SIZE (CHEEZE_QUEUE_SIZE * sizeof(uint8_t))
-
-#define SEQ_OFF (RECV_OFF + RECV_SIZE)
-#define SEQ_SIZE (CHEEZE_QUEUE_SIZE * sizeof(uint64_t))
-
-#define REQS_OFF (SEQ_OFF + SEQ_SIZE)
-#define REQS_SIZE (CHEEZE_QUEUE_SIZE * sizeof(struct cheeze_req))
-
-#define barrier() __asm__ __volatile__("": : :"memory")
+#include "backend.h"
+#include "ftl.c"
+#include "snap.c"
+#include "tier.c"
+#include "persist.c"
+#include "stripe.c"
+#include "kv.c"
 
 #define ureq_print(u) \
 	do { \
-		printf("%s:%d\n    id=%d\n    op=%d\n    pos=%u\n    len=%u\n", __func__, __LINE__, u->id, u->op, u->pos, u->len); \
+		printf("%s:%d\n    id=%d\n    op=%d\n    pos=%u\n    len=%u\n    flags=0x%x\n    ioprio=0x%x\n    ret=%d\n", __func__, __LINE__, u->id, u->op, u->pos, u->len, u->flags, u->ioprio, u->ret); \
 	} while (0);
 
-static void *page_addr;
-//static void *meta_addr; // page_addr[0] ==> send_event_addr, recv_event_addr, seq_addr, ureq_addr
-static uint8_t *send_event_addr; // CHEEZE_QUEUE_SIZE ==> 16B
-static uint8_t *recv_event_addr; // 16B
-static uint64_t *seq_addr; // 8KB
-struct cheeze_req_user *ureq_addr; // sizeof(req) * 1024
-static char *data_addr[2]; // page_addr[1]: 1GB, page_addr[2]: 1GB
-static uint64_t seq = 0; 
-
-enum req_opf {
-	/* read sectors from the device */
-	REQ_OP_READ		= 0,
-	/* write sectors to the device */
-	REQ_OP_WRITE		= 1,
-	/* flush the volatile write cache */
-	REQ_OP_FLUSH		= 2,
-	/* discard sectors */
-	REQ_OP_DISCARD		= 3,
-	/* get zone information */
-	REQ_OP_ZONE_REPORT	= 4,
-	/* securely erase sectors */
-	REQ_OP_SECURE_ERASE	= 5,
-	/* seset a zone write pointer */
-	REQ_OP_ZONE_RESET	= 6,
-	/* write the same sector many times */
-	REQ_OP_WRITE_SAME	= 7,
-	/* write the zero filled sector many times */
-	REQ_OP_WRITE_ZEROES	= 9,
-
-	/* SCSI passthrough using struct scsi_request */
-	REQ_OP_SCSI_IN		= 32,
-	REQ_OP_SCSI_OUT		= 33,
-	/* Driver private requests */
-	REQ_OP_DRV_IN		= 34,
-	REQ_OP_DRV_OUT		= 35,
-
-	REQ_OP_LAST,
-};
-
-struct cheeze_req_user {
-	int id;
-	int op;
-	unsigned int pos; // sector_t
-	unsigned int len;
-} __attribute__((aligned(8), packed));
-
 #define COPY_TARGET "/dev/hugepages/disk"
 #define TRACE_TARGET "/trace"
 
-static inline char *get_buf_addr(char **pdata_addr, int id) {
-	int idx = id / ITEMS_PER_HP;
-	return pdata_addr[idx] + ((id % ITEMS_PER_HP) * CHEEZE_BUF_SIZE);
-}
-
-static void shm_meta_init(void *ppage_addr) {
-	//memset(ppage_addr, 0, (1ULL * 1024 * 1024 * 1024));
-	send_event_addr = ppage_addr + SEND_OFF; // CHEEZE_QUEUE_SIZE ==> 16B
-	recv_event_addr = ppage_addr + RECV_OFF; // 16B
-	seq_addr = ppage_addr + SEQ_OFF; // 8KB
-	ureq_addr = ppage_addr + REQS_OFF; // sizeof(req) * 1024
-}
+static volatile sig_atomic_t stop;
+static volatile sig_atomic_t dump_stats;
 
 #if 0
 // Warning, output is static so this function is not reentrant
@@ -130,78 +61,338 @@ static const char *humanSize(uint64_t bytes)
 }
 #endif
 
-static off_t fdlength(int fd)
+static inline uint64_t ts_to_ns(struct timespec* ts) {
+	return ts->tv_sec * (uint64_t)1000000000L + ts->tv_nsec;
+}
+
+/*
+ * FTL backend, see ftl.c
+ */
+struct ftl_backend {
+	struct ftl ftl;
+	int trace_fd;
+};
+
+static int ftl_be_read(void *priv, struct cheeze_req_user *ureq, char *buf)
 {
-	struct stat st;
-	off_t cur, ret;
+	struct ftl_backend *fb = priv;
 
-	if (!fstat(fd, &st) && S_ISREG(st.st_mode))
-		return st.st_size;
+	ftl_read(&fb->ftl, ureq->pos, buf, ureq->len);
+	cheeze_trace(fb->trace_fd, ureq, buf);
 
-	cur = lseek(fd, 0, SEEK_CUR);
-	ret = lseek(fd, 0, SEEK_END);
-	lseek(fd, cur, SEEK_SET);
+	return CHEEZE_DONE;
+}
+
+static int ftl_be_write(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct ftl_backend *fb = priv;
+
+	ftl_write(&fb->ftl, ureq->pos, buf, ureq->len);
+	cheeze_trace(fb->trace_fd, ureq, buf);
 
-	return ret;
+	return CHEEZE_DONE;
 }
 
-static inline uint64_t ts_to_ns(struct timespec* ts) {
-	return ts->tv_sec * (uint64_t)1000000000L + ts->tv_nsec;
+static int ftl_be_discard(void *priv, struct cheeze_req_user *ureq)
+{
+	struct ftl_backend *fb = priv;
+
+	ftl_trim(&fb->ftl, ureq->pos, ureq->len);
+	cheeze_trace(fb->trace_fd, ureq, NULL);
+
+	return CHEEZE_DONE;
+}
+
+static void ftl_be_tick(void *priv)
+{
+	struct ftl_backend *fb = priv;
+
+	if (dump_stats) {
+		dump_stats = 0;
+		ftl_print_stats(&fb->ftl, stdout);
+		fflush(stdout);
+	}
 }
 
-#define TOTAL_SIZE (3ULL * 1024L * 1024L * 1024L) // 3 GB
+static const struct cheeze_backend ftl_backend = {
+	.read = ftl_be_read,
+	.write = ftl_be_write,
+	.discard = ftl_be_discard,
+	.tick = ftl_be_tick,
+};
+
+/*
+ * Tiered backend, see tier.c
+ */
+struct tier_backend {
+	struct tier tier;
+	int trace_fd;
+};
+
+static int tier_be_read(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct tier_backend *tb = priv;
+
+	tier_read(&tb->tier, ureq->pos, buf, ureq->len);
+	cheeze_trace(tb->trace_fd, ureq, buf);
+
+	return CHEEZE_DONE;
+}
+
+static int tier_be_write(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct tier_backend *tb = priv;
+
+	tier_write(&tb->tier, ureq->pos, buf, ureq->len);
+	cheeze_trace(tb->trace_fd, ureq, buf);
+
+	return CHEEZE_DONE;
+}
+
+static int tier_be_discard(void *priv, struct cheeze_req_user *ureq)
+{
+	struct tier_backend *tb = priv;
+
+	tier_trim(&tb->tier, ureq->pos, ureq->len);
+	cheeze_trace(tb->trace_fd, ureq, NULL);
+
+	return CHEEZE_DONE;
+}
 
-static void mem_init()
+static void tier_be_tick(void *priv)
 {
-	uint64_t pagesize, addr, len;
-	int fd;
+	struct tier_backend *tb = priv;
 
-	fd = open("/dev/mem", O_RDWR);
-	if (fd == -1) {
-		perror("Failed to open /dev/mem");
-		exit(1);
+	if (dump_stats) {
+		dump_stats = 0;
+		tier_print_stats(&tb->tier, stdout);
+		fflush(stdout);
 	}
+}
+
+static const struct cheeze_backend tier_backend = {
+	.read = tier_be_read,
+	.write = tier_be_write,
+	.discard = tier_be_discard,
+	.tick = tier_be_tick,
+};
+
+/*
+ * Striped backend, see stripe.c
+ */
+static void stripe_be_tick(void *priv)
+{
+	struct stripe *s = priv;
 
-	pagesize = getpagesize();
-	addr = PHYS_ADDR & (~(pagesize - 1));
-	len = (PHYS_ADDR & (pagesize - 1)) + TOTAL_SIZE;
-	page_addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, addr);
-	if (page_addr == MAP_FAILED) {
-		perror("Failed to mmap plain device path");
-		exit(1);
+	stripe_tick(s);
+	if (dump_stats) {
+		dump_stats = 0;
+		stripe_print_stats(s, stdout);
+		fflush(stdout);
 	}
+}
+
+static const struct cheeze_backend stripe_backend = {
+	.read = stripe_read,
+	.write = stripe_write,
+	.discard = stripe_discard,
+	.flush = stripe_flush,
+	.tick = stripe_be_tick,
+};
+
+/*
+ * Key-value backend: the mem backend, plus key-value commands served from
+ * the table in kv.c
+ */
+struct kv_backend {
+	struct cheeze_mem *mem;
+	struct kv kv;
+};
 
-	close(fd);
+static int kv_be_read(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct kv_backend *kb = priv;
+
+	return cheeze_mem_read(kb->mem, ureq, buf);
 }
 
-int main() {
-	int copyfd, dumpfd;
-	char *mem;
-	uint8_t *send, *recv;
-	int i, id;
-	unsigned int j;
-	uint32_t crc;
-	struct cheeze_req_user *ureq;
-	char *buf, *page_buf;
-
-	mem_init();
-	shm_meta_init(((char*)page_addr) + (2ULL * 1024 * 1024 * 1024));
-	data_addr[0] = ((char *)page_addr) + (1ULL * 1024 * 1024 * 1024);
-	data_addr[1] = ((char *)page_addr);
-
-	copyfd = open(COPY_TARGET, O_RDWR);
-	if (copyfd < 0) {
-		perror("Failed to open " COPY_TARGET);
-		return 1;
+static int kv_be_write(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct kv_backend *kb = priv;
+
+	return cheeze_mem_write(kb->mem, ureq, buf);
+}
+
+static int kv_be_discard(void *priv, struct cheeze_req_user *ureq)
+{
+	struct kv_backend *kb = priv;
+
+	return cheeze_mem_discard(kb->mem, ureq);
+}
+
+static int kv_be_kv(void *priv, struct cheeze_req_user *ureq, char *buf)
+{
+	struct kv_backend *kb = priv;
+
+	kv_handle(&kb->kv, ureq, buf);
+
+	return CHEEZE_DONE;
+}
+
+static void kv_be_tick(void *priv)
+{
+	struct kv_backend *kb = priv;
+
+	if (dump_stats) {
+		dump_stats = 0;
+		kv_print_stats(&kb->kv, stdout);
+		fflush(stdout);
 	}
+}
+
+static const struct cheeze_backend kv_backend = {
+	.read = kv_be_read,
+	.write = kv_be_write,
+	.discard = kv_be_discard,
+	.kv = kv_be_kv,
+	.tick = kv_be_tick,
+};
+
+static void sigusr1_handler(int sig)
+{
+	dump_stats = 1;
+}
+
+static void stop_handler(int sig)
+{
+	stop = 1;
+}
 
-	mem = mmap(NULL, fdlength(copyfd), PROT_READ | PROT_WRITE, MAP_SHARED, copyfd, 0);
-	if (mem == MAP_FAILED) {
-		perror("Failed to mmap copy path");
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-b mem|null|ftl|tier|stripe|kv] [-o op_percent] [-p pages_per_block] [-g greedy|cb]\n"
+		"          [-s fifo] [-c cold_file] [-P checkpoint] [-d dev,...] [-k chunk_kb] [-u]\n"
+		"    -b    backend (default: mem)\n"
+		"          mem:  serve I/O from " COPY_TARGET "\n"
+		"          null: complete I/O without touching data\n"
+		"          ftl:  emulate a page-mapped FTL on top of " COPY_TARGET "\n"
+		"          tier: keep hot extents in " COPY_TARGET " and the rest in cold_file\n"
+		"          stripe: stripe I/O over the files or devices given with -d\n"
+		"          kv:   mem, plus key-value commands kept in memory\n"
+		"    -o    FTL over-provisioning in percent (default: 7)\n"
+		"    -p    FTL pages per erase block (default: 512)\n"
+		"    -g    FTL GC victim policy (default: greedy)\n"
+		"    -s    take snapshots of the mem backend, controlled through fifo, see snap.c\n"
+		"    -c    cold tier file, its size is the device size\n"
+		"    -P    checkpoint the mem backend to checkpoint on exit, and restore it lazily on start\n"
+		"    -d    comma-separated stripe members\n"
+		"    -k    stripe chunk size in KiB (default: 128)\n"
+		"    -u    wait for requests on io_uring commands to " CHEEZE_CTL_PATH "\n"
+		"Send SIGUSR1 to print FTL, tier, stripe or kv statistics.\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	static struct cheeze_shm shm;
+	struct cheeze_mem mem;
+	struct ftl_backend fb;
+	struct tier_backend tb;
+	static struct kv_backend kb;
+	struct snap snap;
+	struct persist persist;
+	static struct stripe stripe;
+	const char *backend = "mem", *snap_fifo = NULL, *cold = NULL, *checkpoint = NULL;
+	const char *stripe_devs = NULL;
+	uint64_t chunk_kb = 128;
+	int dumpfd = -1, opt, use_uring = 0;
+	unsigned int op_percent = 7;
+	uint32_t pages_per_block = 512;
+	enum ftl_gc_policy policy = FTL_GC_GREEDY;
+
+	while ((opt = getopt(argc, argv, "b:o:p:g:s:c:P:d:k:u")) != -1) {
+		switch (opt) {
+		case 'b':
+			backend = optarg;
+			break;
+		case 'o':
+			op_percent = atoi(optarg);
+			break;
+		case 'p':
+			pages_per_block = atoi(optarg);
+			break;
+		case 'g':
+			if (!strcmp(optarg, "greedy"))
+				policy = FTL_GC_GREEDY;
+			else if (!strcmp(optarg, "cb"))
+				policy = FTL_GC_COST_BENEFIT;
+			else
+				usage(argv[0]);
+			break;
+		case 's':
+			snap_fifo = optarg;
+			break;
+		case 'c':
+			cold = optarg;
+			break;
+		case 'P':
+			checkpoint = optarg;
+			break;
+		case 'd':
+			stripe_devs = optarg;
+			break;
+		case 'k':
+			chunk_kb = strtoull(optarg, NULL, 0);
+			break;
+		case 'u':
+			use_uring = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (pages_per_block == 0)
+		usage(argv[0]);
+	if (strcmp(backend, "mem") && strcmp(backend, "null") && strcmp(backend, "ftl") &&
+	    strcmp(backend, "tier") && strcmp(backend, "stripe") && strcmp(backend, "kv"))
+		usage(argv[0]);
+	if (snap_fifo && strcmp(backend, "mem"))
+		usage(argv[0]);
+	if (checkpoint && (strcmp(backend, "mem") || snap_fifo))
+		usage(argv[0]);
+	if (!!cold != !strcmp(backend, "tier"))
+		usage(argv[0]);
+	if (!!stripe_devs != !strcmp(backend, "stripe"))
+		usage(argv[0]);
+
+	if (cheeze_shm_attach(&shm))
+		return 1;
+	if (use_uring && cheeze_shm_uring(&shm))
 		return 1;
+	if (cheeze_stats_open(&shm))
+		fprintf(stderr, "cheeze: running without the stats segment\n");
+
+	signal(SIGINT, stop_handler);
+	signal(SIGTERM, stop_handler);
+
+	if (!strcmp(backend, "null")) {
+		cheeze_run(&shm, &cheeze_null_backend, NULL, &stop);
+		return 0;
 	}
 
-	close(copyfd);
+	if (!strcmp(backend, "stripe")) {
+		if (stripe_init(&stripe, &shm, stripe_devs, chunk_kb << 10))
+			return 1;
+		printf("stripe: %d members, %lu KiB chunks, exporting %lu bytes\n",
+		       stripe.nr_devs, stripe.chunk >> 10, stripe.size);
+		signal(SIGUSR1, sigusr1_handler);
+
+		cheeze_run(&shm, &stripe_backend, &stripe, &stop);
+		stripe_print_stats(&stripe, stdout);
+		stripe_exit(&stripe);
+		return 0;
+	}
 
 	dumpfd = open(TRACE_TARGET, O_WRONLY | O_TRUNC | O_CREAT, 0644);
 	if (dumpfd < 0) {
@@ -209,55 +400,52 @@ int main() {
 		return 1;
 	}
 
-	while (1) {
-		for (i = 0; i < CHEEZE_QUEUE_SIZE; i++) {
-			send = &send_event_addr[i];
-			recv = &recv_event_addr[i];
-			if (*send) {
-				id = i;
-				// printf("id: %d, seq_addr[id]: %lu, seq: %lu\n", id, seq_addr[id], seq);
-				ureq = ureq_addr + id;
-				// ureq_print(ureq);
-
-				// if (seq_addr[id] == seq) {
-					buf = mem + (ureq->pos * 4096ULL);
-					page_buf = get_buf_addr(data_addr, id);
-					switch (ureq->op) {
-						case REQ_OP_READ:
-							write(dumpfd, ureq, sizeof(*ureq));
-							for (j = 0; j < ureq->len; j += 4096) {
-								crc = crc32c(0, buf + j, 4096);
-								write(dumpfd, &crc, sizeof(crc));
-							}
-							memcpy(page_buf, buf, ureq->len);
-							break;
-						case REQ_OP_WRITE:
-							memcpy(buf, page_buf, ureq->len);
-							write(dumpfd, ureq, sizeof(*ureq));
-							for (j = 0; j < ureq->len; j += 4096) {
-								crc = crc32c(0, buf + j, 4096);
-								write(dumpfd, &crc, sizeof(crc));
-							}
-							break;
-						case REQ_OP_DISCARD:
-							memset(buf, 0, ureq->len);
-							write(dumpfd, ureq, sizeof(*ureq));
-							for (j = 0; j < ureq->len; j += 4096) {
-								crc = 0;
-								write(dumpfd, &crc, sizeof(crc));
-							}
-							break;
-					}
-					seq++;
-					barrier();
-					*send = 0;
-					barrier();
-					*recv = 1;
-				// } else {
-				// 	continue;
-				// }
-			}
-		}
+	if (cheeze_mem_open(&mem, COPY_TARGET, dumpfd))
+		return 1;
+
+	if (!strcmp(backend, "ftl")) {
+		if (ftl_init(&fb.ftl, mem.mem, mem.size, op_percent, pages_per_block, policy))
+			return 1;
+		fb.trace_fd = dumpfd;
+		printf("ftl: %u blocks of %u pages, exporting %llu bytes\n",
+		       fb.ftl.nr_blocks, fb.ftl.pages_per_block,
+		       (unsigned long long)fb.ftl.nr_lpages << FTL_PAGE_SHIFT);
+		signal(SIGUSR1, sigusr1_handler);
+
+		cheeze_run(&shm, &ftl_backend, &fb, &stop);
+		ftl_print_stats(&fb.ftl, stdout);
+	} else if (!strcmp(backend, "tier")) {
+		if (tier_init(&tb.tier, mem.mem, mem.size, cold))
+			return 1;
+		tb.trace_fd = dumpfd;
+		printf("tier: %u hot extents over %lu bytes in %s\n",
+		       tb.tier.nr_slots, tb.tier.size, cold);
+		signal(SIGUSR1, sigusr1_handler);
+
+		cheeze_run(&shm, &tier_backend, &tb, &stop);
+		tier_exit(&tb.tier);
+		tier_print_stats(&tb.tier, stdout);
+	} else if (!strcmp(backend, "kv")) {
+		if (kv_init(&kb.kv))
+			return 1;
+		kb.mem = &mem;
+		signal(SIGUSR1, sigusr1_handler);
+
+		cheeze_run(&shm, &kv_backend, &kb, &stop);
+		kv_print_stats(&kb.kv, stdout);
+		kv_exit(&kb.kv);
+	} else if (checkpoint) {
+		if (persist_open(&persist, &mem, checkpoint))
+			return 1;
+		cheeze_run(&shm, &persist_backend, &persist, &stop);
+		if (persist_checkpoint(&persist))
+			return 1;
+	} else if (snap_fifo) {
+		if (snap_init(&snap, &mem, snap_fifo))
+			return 1;
+		cheeze_run(&shm, &snap_backend, &snap, &stop);
+	} else {
+		cheeze_run(&shm, &cheeze_mem_backend, &mem, &stop);
 	}
 
 	close(dumpfd);
@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Park Ju Hyung
+ */
+
+/*
+ * Parallel integrity verifier.
+ *
+ * Replays the write and discard history of a trace into an LBA -> expected
+ * CRC32C map, checks every traced read against it and then, optionally,
+ * checksums a backend image to flag blocks that silently changed.  Blocks
+ * first seen through a read are learned from that read.
+ *
+ * The LBA space is split into one contiguous range per thread.  Every
+ * thread walks all record headers of the mmap()ed trace but only replays
+ * blocks in its own range, so the history of a block is always applied in
+ * trace order, and then checksums the same range of the image.
+ *
+ * The image check only makes sense for backends that store block n at
+ * offset n * 4 KiB, such as the mem backend.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "cheeze.h"
+#include "crc32c.c"
+
+#define TRACE_TARGET "/trace"
+
+#define BLK_SHIFT 12
+#define BLK_SIZE (1 << BLK_SHIFT)
+#define SCAN_SIZE (2 * 1024 * 1024)
+#define MAX_REPORTS 32
+
+enum {
+	BLK_UNKNOWN,
+	BLK_WRITTEN,	// expected CRC from a write or discard
+	BLK_LEARNED,	// expected CRC from the first read
+};
+
+struct mismatch {
+	uint64_t rec;	// record index, UINT64_MAX for the image scan
+	uint64_t lba;
+	uint32_t expected;
+	uint32_t found;
+};
+
+struct worker {
+	pthread_t thread;
+	uint64_t lo, hi;	// LBA range
+
+	uint64_t reads_checked;
+	uint64_t blocks_scanned;
+	uint64_t trace_errors;
+	uint64_t image_errors;
+	int nr_reports;
+	struct mismatch reports[MAX_REPORTS];
+};
+
+static const char *trace;
+static size_t trace_len;
+static int image_fd = -1;
+static uint64_t image_blocks;
+
+static uint32_t *expected;
+static uint8_t *state;
+static uint32_t zero_crc;
+
+static void report(struct worker *w, uint64_t rec, uint64_t lba,
+		   uint32_t exp, uint32_t found)
+{
+	struct mismatch *m;
+
+	if (w->nr_reports == MAX_REPORTS)
+		return;
+
+	m = &w->reports[w->nr_reports++];
+	m->rec = rec;
+	m->lba = lba;
+	m->expected = exp;
+	m->found = found;
+}
+
+static void replay(struct worker *w)
+{
+	const char *p = trace, *end = trace + trace_len;
+	const struct cheeze_req_user *ureq;
+	const uint32_t *crcs;
+	uint64_t rec = 0, lba, first, last;
+	unsigned int nr;
+
+	while (p + sizeof(*ureq) <= end) {
+		ureq = (const struct cheeze_req_user *)p;
+		nr = ureq->len >> BLK_SHIFT;
+		crcs = (const uint32_t *)(p + sizeof(*ureq));
+		p += sizeof(*ureq) + nr * sizeof(uint32_t);
+		if (p > end)
+			break;
+		rec++;
+
+		first = ureq->pos > w->lo ? ureq->pos : w->lo;
+		last = (uint64_t)ureq->pos + nr < w->hi ? (uint64_t)ureq->pos + nr : w->hi;
+
+		for (lba = first; lba < last; lba++) {
+			uint32_t crc = crcs[lba - ureq->pos];
+
+			switch (ureq->op) {
+			case REQ_OP_WRITE:
+				expected[lba] = crc;
+				state[lba] = BLK_WRITTEN;
+				break;
+			case REQ_OP_DISCARD:
+				/* Discards are traced with a 0 CRC but read back as zeroes */
+				expected[lba] = zero_crc;
+				state[lba] = BLK_WRITTEN;
+				break;
+			case REQ_OP_READ:
+				if (state[lba] == BLK_UNKNOWN) {
+					expected[lba] = crc;
+					state[lba] = BLK_LEARNED;
+					break;
+				}
+				w->reads_checked++;
+				if (expected[lba] != crc) {
+					w->trace_errors++;
+					report(w, rec - 1, lba, expected[lba], crc);
+				}
+				break;
+			}
+		}
+	}
+}
+
+static void scan_image(struct worker *w)
+{
+	uint64_t lba, off, i, nr, hi;
+	uint32_t crc;
+	ssize_t ret;
+	char *buf;
+
+	if (posix_memalign((void **)&buf, BLK_SIZE, SCAN_SIZE)) {
+		perror("posix_memalign");
+		exit(1);
+	}
+
+	hi = w->hi < image_blocks ? w->hi : image_blocks;
+	for (lba = w->lo; lba < hi; lba += nr) {
+		nr = hi - lba < SCAN_SIZE / BLK_SIZE ? hi - lba : SCAN_SIZE / BLK_SIZE;
+		off = lba << BLK_SHIFT;
+		ret = pread(image_fd, buf, nr << BLK_SHIFT, off);
+		if (ret != (ssize_t)(nr << BLK_SHIFT)) {
+			fprintf(stderr, "short read at offset %lu\n", off);
+			break;
+		}
+
+		for (i = 0; i < nr; i++) {
+			if (state[lba + i] == BLK_UNKNOWN)
+				continue;
+			w->blocks_scanned++;
+			crc = crc32c(0, buf + (i << BLK_SHIFT), BLK_SIZE);
+			if (crc != expected[lba + i]) {
+				w->image_errors++;
+				report(w, UINT64_MAX, lba + i, expected[lba + i], crc);
+			}
+		}
+	}
+
+	free(buf);
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+
+	replay(w);
+	if (image_fd >= 0)
+		scan_image(w);
+
+	return NULL;
+}
+
+static int cmp_mismatch(const void *a, const void *b)
+{
+	const struct mismatch *x = a, *y = b;
+
+	if (x->rec != y->rec)
+		return (x->rec > y->rec) - (x->rec < y->rec);
+	return (x->lba > y->lba) - (x->lba < y->lba);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-t threads] [-i image] [trace]\n"
+		"    -t    worker threads (default: number of CPUs)\n"
+		"    -i    backend image to check against the trace, e.g. /dev/hugepages/disk\n"
+		"    trace defaults to " TRACE_TARGET "\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = TRACE_TARGET, *image = NULL;
+	const struct cheeze_req_user *ureq;
+	const char *p, *end;
+	struct worker *workers, *w;
+	struct mismatch *all;
+	uint64_t nr_blocks = 0, per, reads = 0, scanned = 0, terr = 0, ierr = 0;
+	int nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int fd, opt, i, nr_all = 0;
+	char zero[BLK_SIZE] = { 0 };
+	struct stat st;
+
+	while ((opt = getopt(argc, argv, "t:i:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_workers = atoi(optarg);
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+	if (nr_workers < 1)
+		usage(argv[0]);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		return 1;
+	}
+	trace_len = st.st_size;
+	if (trace_len) {
+		trace = mmap(NULL, trace_len, PROT_READ, MAP_SHARED, fd, 0);
+		if (trace == MAP_FAILED) {
+			perror("Failed to mmap trace");
+			return 1;
+		}
+		madvise((void *)trace, trace_len, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	if (image) {
+		image_fd = open(image, O_RDONLY);
+		if (image_fd < 0) {
+			perror(image);
+			return 1;
+		}
+		image_blocks = lseek(image_fd, 0, SEEK_END) >> BLK_SHIFT;
+		nr_blocks = image_blocks;
+	}
+
+	/* Size the maps from the highest traced LBA */
+	for (p = trace, end = trace + trace_len; p + sizeof(*ureq) <= end;) {
+		ureq = (const struct cheeze_req_user *)p;
+		p += sizeof(*ureq) + (ureq->len >> BLK_SHIFT) * sizeof(uint32_t);
+		if ((uint64_t)ureq->pos + (ureq->len >> BLK_SHIFT) > nr_blocks)
+			nr_blocks = (uint64_t)ureq->pos + (ureq->len >> BLK_SHIFT);
+	}
+
+	expected = calloc(nr_blocks + 1, sizeof(*expected));
+	state = calloc(nr_blocks + 1, sizeof(*state));
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!expected || !state || !workers) {
+		perror("calloc");
+		return 1;
+	}
+
+	zero_crc = crc32c(0, zero, BLK_SIZE);
+
+	/* Keep ranges a multiple of the scan size */
+	per = (nr_blocks + nr_workers - 1) / nr_workers;
+	per = (per + SCAN_SIZE / BLK_SIZE - 1) / (SCAN_SIZE / BLK_SIZE) * (SCAN_SIZE / BLK_SIZE);
+	for (i = 0; i < nr_workers; i++) {
+		w = &workers[i];
+		w->lo = per * i < nr_blocks ? per * i : nr_blocks;
+		w->hi = per * (i + 1) < nr_blocks ? per * (i + 1) : nr_blocks;
+		if (pthread_create(&w->thread, NULL, worker_fn, w)) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	all = calloc(nr_workers * MAX_REPORTS, sizeof(*all));
+	for (i = 0; i < nr_workers; i++) {
+		w = &workers[i];
+		pthread_join(w->thread, NULL);
+		reads += w->reads_checked;
+		scanned += w->blocks_scanned;
+		terr += w->trace_errors;
+		ierr += w->image_errors;
+		memcpy(all + nr_all, w->reports, w->nr_reports * sizeof(*all));
+		nr_all += w->nr_reports;
+	}
+
+	qsort(all, nr_all, sizeof(*all), cmp_mismatch);
+	for (i = 0; i < nr_all && i < MAX_REPORTS; i++) {
+		if (all[i].rec == UINT64_MAX)
+			printf("image: lba=%lu expected=0x%08x found=0x%08x\n",
+			       all[i].lba, all[i].expected, all[i].found);
+		else
+			printf("trace: record=%lu lba=%lu expected=0x%08x found=0x%08x\n",
+			       all[i].rec, all[i].lba, all[i].expected, all[i].found);
+	}
+
+	printf("reads checked: %lu, mismatches: %lu\n", reads, terr);
+	if (image)
+		printf("image blocks checked: %lu, mismatches: %lu\n", scanned, ierr);
+
+	return (terr || ierr) ? 2 : 0;
+}